@@ -0,0 +1,312 @@
+/*
+ * xSF - 2SF NitroComposer HLE
+ * By Naram Qashat (CyberBotX) [cyberbotx@cyberbotx.com]
+ *
+ * Plays the sequence a 2SF's ARM9 asks the standard NitroComposer sound driver for
+ * through the native SSEQ player of the NCSF decoder, instead of emulating the DS
+ *
+ * The sound library on the ARM9 queues SNDCommands ({ next, id, arg[4] }) in main memory
+ * and hands each list to the ARM7 driver through the IPC FIFO under the sound PXI tag.
+ */
+
+#include <algorithm>
+#include <bitset>
+#include <exception>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include "XSFCommon.h"
+#include "NitroComposerHLE.h"
+#include "../in_ncsf/SSEQPlayer/SDAT.h"
+#include "../in_ncsf/SSEQPlayer/SSEQ.h"
+#include "../in_ncsf/SSEQPlayer/Player.h"
+#include "../in_ncsf/SSEQPlayer/common.h"
+#include "../in_ncsf/SSEQPlayer/consts.h"
+
+static const std::uint32_t PXI_FIFO_TAG_SOUND = 7;
+static const std::uint32_t SND_COMMAND_START_SEQ = 0;
+static const std::uint32_t SND_COMMAND_PREPARE_SEQ = 2;
+static const std::uint32_t SND_COMMAND_START_PREPARED_SEQ = 3;
+static const std::uint32_t SND_COMMAND_SHARED_WORK = 29;
+static const std::uint32_t SND_COMMAND_READ_DRIVER_INFO = 33;
+// a list is never longer than the library's command pool, this only guards against loops
+static const unsigned MAX_COMMANDS = 256;
+// bytes of each sequence compared against the one in main memory
+static const std::uint32_t SEQUENCE_MATCH_SIZE = 256;
+
+// Reads from the rom within one SDAT, anything outside of it reads as 0
+class SDATReader
+{
+	const std::vector<std::uint8_t> &rom;
+	std::uint32_t offset, size;
+public:
+	SDATReader(const std::vector<std::uint8_t> &romToRead, std::uint32_t sdatOffset, std::uint32_t sdatSize) : rom(romToRead), offset(sdatOffset), size(sdatSize)
+	{
+	}
+
+	bool Contains(std::uint32_t pos, std::uint32_t bytes) const
+	{
+		return pos <= this->size && bytes <= this->size - pos;
+	}
+
+	const std::uint8_t *At(std::uint32_t pos) const
+	{
+		return &this->rom[this->offset + pos];
+	}
+
+	std::uint32_t Read32(std::uint32_t pos) const
+	{
+		return this->Contains(pos, 4) ? Get32BitsLE(this->At(pos)) : 0;
+	}
+
+	std::uint16_t Read16(std::uint32_t pos) const
+	{
+		return this->Contains(pos, 2) ? ReadLE<std::uint16_t>(this->At(pos)) : 0;
+	}
+
+	// Where the INFO record of the given type is, 0 if there is none
+	std::uint32_t InfoRecord(int recordType) const
+	{
+		std::uint32_t info = this->Read32(0x18), record = this->Read32(info + 8 + recordType * 4);
+		return record ? info + record : 0;
+	}
+
+	std::uint32_t InfoCount(int recordType) const
+	{
+		std::uint32_t record = this->InfoRecord(recordType);
+		return record ? this->Read32(record) : 0;
+	}
+
+	// Where the INFO entry for item of the given record type is, 0 if there is none
+	std::uint32_t InfoEntry(int recordType, std::uint32_t item) const
+	{
+		if (item >= this->InfoCount(recordType))
+			return 0;
+		std::uint32_t entry = this->Read32(this->InfoRecord(recordType) + 4 + item * 4);
+		return entry ? this->Read32(0x18) + entry : 0;
+	}
+
+	// The offset and size of a file within the SDAT, false if the FAT doesn't have it
+	bool File(std::uint16_t fileID, std::uint32_t &fileOffset, std::uint32_t &fileSize) const
+	{
+		std::uint32_t fat = this->Read32(0x20);
+		if (fileID >= this->Read32(fat + 8))
+			return false;
+		fileOffset = this->Read32(fat + 12 + fileID * 16);
+		fileSize = this->Read32(fat + 12 + fileID * 16 + 4);
+		return fileSize && this->Contains(fileOffset, fileSize);
+	}
+};
+
+// Main memory, as the ARM9 sees it
+class MainMemoryReader
+{
+	const std::uint8_t *mem;
+	std::uint32_t mask;
+public:
+	MainMemoryReader(const std::uint8_t *mainMem, std::uint32_t mainMemMask) : mem(mainMem), mask(mainMemMask)
+	{
+	}
+
+	static bool InMainMemory(std::uint32_t addr)
+	{
+		return (addr & 0xFF000000) == 0x02000000;
+	}
+
+	std::uint32_t Read32(std::uint32_t addr) const
+	{
+		return Get32BitsLE(&this->mem[addr & this->mask & ~3]);
+	}
+
+	bool Matches(std::uint32_t addr, const std::uint8_t *data, std::uint32_t size) const
+	{
+		for (std::uint32_t i = 0; i < size; ++i)
+			if (this->mem[(addr + i) & this->mask] != data[i])
+				return false;
+		return true;
+	}
+};
+
+NitroComposerHLE::NitroComposerHLE(const std::vector<std::uint8_t> &romToSearch) : rom(romToSearch), sdats(), sdatData(), sdat(), player(), secondsPerSample(0),
+	secondsIntoPlayback(0), secondsUntilNextClock(0)
+{
+}
+
+NitroComposerHLE::~NitroComposerHLE()
+{
+	if (this->player)
+		this->player->Stop(true);
+}
+
+bool NitroComposerHLE::FindSDATs()
+{
+	this->sdats.clear();
+	if (this->rom.size() < 0x40)
+		return false;
+
+	// SDATs are files of the rom's file system, which are at least word aligned
+	for (std::uint32_t offset = 0, end = this->rom.size() - 0x40; offset <= end; offset += 4)
+	{
+		const std::uint8_t *header = &this->rom[offset];
+		if (memcmp(header, "SDAT", 4) || Get32BitsLE(header + 4) != 0x0100FEFF)
+			continue;
+		std::uint32_t size = Get32BitsLE(header + 8);
+		if (size < 0x40 || size > this->rom.size() - offset)
+			continue;
+		SDATReader sdatReader(this->rom, offset, size);
+		std::uint32_t info = sdatReader.Read32(0x18), fat = sdatReader.Read32(0x20);
+		if (!sdatReader.Contains(info, 0x28) || memcmp(sdatReader.At(info), "INFO", 4) || !sdatReader.Contains(fat, 12) || memcmp(sdatReader.At(fat), "FAT ", 4))
+			continue;
+		this->sdats.push_back({ offset, size });
+		offset += size - 4;
+	}
+
+	return !this->sdats.empty();
+}
+
+// The library passes the start of the sequence data itself (the SSEQ's DATA block plus the
+// sequence's offset into it) and the bank as loaded. Sequences are compared by their data and
+// identical ones told apart by their banks; the parts of the bank the library links to wave
+// archives once loaded are not compared.
+bool NitroComposerHLE::MatchSequence(const std::uint8_t *mainMem, std::uint32_t mainMemMask, std::uint32_t seqData, std::uint32_t bank)
+{
+	if (!MainMemoryReader::InMainMemory(seqData))
+		return false;
+	MainMemoryReader mem(mainMem, mainMemMask);
+
+	struct Match
+	{
+		std::size_t sdat;
+		std::uint32_t sseq;
+	};
+	std::vector<Match> matches, bankMatches;
+	for (std::size_t s = 0; s < this->sdats.size(); ++s)
+	{
+		SDATReader sdatReader(this->rom, this->sdats[s].offset, this->sdats[s].size);
+		for (std::uint32_t sseq = 0, numSSEQs = sdatReader.InfoCount(REC_SEQ); sseq < numSSEQs; ++sseq)
+		{
+			std::uint32_t seqEntry = sdatReader.InfoEntry(REC_SEQ, sseq), fileOffset, fileSize;
+			if (!seqEntry || !sdatReader.File(sdatReader.Read16(seqEntry), fileOffset, fileSize) || fileSize < 0x1C)
+				continue;
+			if (memcmp(sdatReader.At(fileOffset), "SSEQ", 4))
+				continue;
+			std::uint32_t dataOffset = sdatReader.Read32(fileOffset + 0x18);
+			if (dataOffset >= fileSize)
+				continue;
+			std::uint32_t compareSize = std::min(fileSize - dataOffset, SEQUENCE_MATCH_SIZE);
+			if (!mem.Matches(seqData, sdatReader.At(fileOffset + dataOffset), compareSize))
+				continue;
+			matches.push_back({ s, sseq });
+
+			std::uint32_t bankEntry = sdatReader.InfoEntry(REC_BANK, sdatReader.Read16(seqEntry + 4)), bankOffset, bankSize;
+			if (!MainMemoryReader::InMainMemory(bank) || !bankEntry || !sdatReader.File(sdatReader.Read16(bankEntry), bankOffset, bankSize) || bankSize < 0x3C)
+				continue;
+			std::uint32_t instrumentsSize = std::min<std::uint32_t>(bankSize - 0x38, 0x40);
+			if (mem.Matches(bank, sdatReader.At(bankOffset), 0x18) && mem.Matches(bank + 0x38, sdatReader.At(bankOffset + 0x38), instrumentsSize))
+				bankMatches.push_back({ s, sseq });
+		}
+	}
+
+	const Match *match = !bankMatches.empty() ? &bankMatches[0] : !matches.empty() ? &matches[0] : nullptr;
+	if (!match)
+		return false;
+
+	const SDATLocation &location = this->sdats[match->sdat];
+	this->sdatData.assign(this->rom.begin() + location.offset, this->rom.begin() + location.offset + location.size);
+	try
+	{
+		PseudoFile file;
+		file.data = &this->sdatData;
+		this->sdat.reset(new SDAT(file, match->sseq));
+	}
+	catch (const std::exception &)
+	{
+		this->sdat.reset();
+		std::vector<std::uint8_t>().swap(this->sdatData);
+		return false;
+	}
+	return true;
+}
+
+NitroComposerHLE::Detection NitroComposerHLE::ExamineIPCSend(std::uint32_t val, const std::uint8_t *mainMem, std::uint32_t mainMemMask)
+{
+	// PXI words are the tag in the low 5 bits, an error bit, then 26 bits of data
+	if ((val & 0x1F) != PXI_FIFO_TAG_SOUND)
+		return Detection::Pending;
+	std::uint32_t command = val >> 6;
+	if (!MainMemoryReader::InMainMemory(command))
+		return Detection::Pending;
+
+	MainMemoryReader mem(mainMem, mainMemMask);
+	for (unsigned n = 0; n < MAX_COMMANDS && MainMemoryReader::InMainMemory(command); ++n)
+	{
+		std::uint32_t id = mem.Read32(command + 4);
+		if (!this->sdat && (id == SND_COMMAND_START_SEQ || id == SND_COMMAND_PREPARE_SEQ))
+		{
+			// arg[0] is the player, then the sequence data, the offset of the sequence in it and the bank
+			std::uint32_t seqData = mem.Read32(command + 12) + mem.Read32(command + 16), bank = mem.Read32(command + 20);
+			if (!this->MatchSequence(mainMem, mainMemMask, seqData, bank))
+				return Detection::Failed;
+		}
+		// the commands before the sequence starts are dropped along with what they play, from then on
+		// only the ones that leave the driver playing it as the native player does are let through
+		else if (this->sdat && id != SND_COMMAND_START_PREPARED_SEQ && id != SND_COMMAND_SHARED_WORK && id != SND_COMMAND_READ_DRIVER_INFO)
+			return Detection::Failed;
+		command = mem.Read32(command);
+	}
+	return this->sdat ? Detection::Found : Detection::Pending;
+}
+
+void NitroComposerHLE::Start(unsigned sampleRate)
+{
+	auto *sseqToPlay = this->sdat->sseq.get();
+	this->player.reset(new Player());
+	this->player->allowedChannels = std::bitset<16>(this->sdat->player.channelMask);
+	this->player->sseqVol = Cnv_Scale(sseqToPlay->info.vol);
+	this->player->sampleRate = sampleRate;
+	this->player->Setup(sseqToPlay);
+	this->player->Timer();
+	this->secondsPerSample = 1.0 / sampleRate;
+	this->secondsIntoPlayback = 0;
+	this->secondsUntilNextClock = SecondsPerClockCycle;
+}
+
+static inline std::int16_t Clamp16(std::int32_t val)
+{
+	return static_cast<std::int16_t>(std::clamp<std::int32_t>(val, -0x8000, 0x7FFF));
+}
+
+void NitroComposerHLE::Render(std::int16_t *out, std::int16_t *stems, unsigned samples, const std::bitset<16> &mutes, unsigned interpolation)
+{
+	// None, Linear, Cosine, Sharp and Sinc
+	static const Interpolation interpolations[] = { Interpolation::None, Interpolation::Linear, Interpolation::Linear, Interpolation::SixPointLegrange, Interpolation::Sinc };
+	this->player->interpolation = interpolations[std::min<unsigned>(interpolation, 4)];
+
+	for (unsigned smpl = 0; smpl < samples; ++smpl)
+	{
+		this->secondsIntoPlayback += this->secondsPerSample;
+
+		std::int32_t leftChannel, rightChannel, channels[32];
+		this->player->Mix(mutes, leftChannel, rightChannel, stems ? channels : nullptr);
+
+		if (stems)
+		{
+			for (std::int32_t channel : channels)
+				*stems++ = Clamp16(channel);
+			*stems++ = Clamp16(leftChannel);
+			*stems++ = Clamp16(rightChannel);
+		}
+		if (out)
+		{
+			*out++ = Clamp16(leftChannel);
+			*out++ = Clamp16(rightChannel);
+		}
+
+		if (this->secondsIntoPlayback > this->secondsUntilNextClock)
+		{
+			this->player->Timer();
+			this->secondsUntilNextClock += SecondsPerClockCycle;
+		}
+	}
+}
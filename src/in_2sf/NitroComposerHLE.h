@@ -0,0 +1,60 @@
+/*
+ * xSF - 2SF NitroComposer HLE
+ * By Naram Qashat (CyberBotX) [cyberbotx@cyberbotx.com]
+ *
+ * Plays the sequence a 2SF's ARM9 asks the standard NitroComposer sound driver for
+ * through the native SSEQ player of the NCSF decoder, instead of emulating the DS
+ */
+
+#pragma once
+
+#include <bitset>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+// Kept apart from XSFPlayer_2SF.cpp, as the SSEQ player's headers and DeSmuME's don't mix
+struct SDAT;
+struct Player;
+
+class NitroComposerHLE
+{
+	struct SDATLocation
+	{
+		std::uint32_t offset, size;
+	};
+
+	const std::vector<std::uint8_t> &rom;
+	std::vector<SDATLocation> sdats;
+	std::vector<std::uint8_t> sdatData;
+	std::unique_ptr<SDAT> sdat;
+	std::unique_ptr<Player> player;
+	double secondsPerSample, secondsIntoPlayback, secondsUntilNextClock;
+
+	bool MatchSequence(const std::uint8_t *mainMem, std::uint32_t mainMemMask, std::uint32_t seqData, std::uint32_t bank);
+public:
+	enum class Detection
+	{
+		Pending,
+		Found,
+		Failed
+	};
+
+	NitroComposerHLE(const std::vector<std::uint8_t> &romToSearch);
+	~NitroComposerHLE();
+
+	// Looks for SDATs in the rom, without one there is nothing to detect
+	bool FindSDATs();
+	// Examines a word the ARM9 sent the ARM7 through the IPC FIFO. Found once a sequence started
+	// by a sound command list is one of the rom's, Failed once the started sequence is not. Every
+	// later word has to be examined as well, which stays Found until a list has a command the
+	// native player can't reproduce (stopping, a volume or tempo change, a second sequence...),
+	// and Failed as soon as one does.
+	Detection ExamineIPCSend(std::uint32_t val, const std::uint8_t *mainMem, std::uint32_t mainMemMask);
+	// Only valid after ExamineIPCSend returned Found
+	void Start(unsigned sampleRate);
+	// Renders interleaved 16-bit stereo to out and, when stems isn't null, 17 stereo pairs per
+	// sample frame (the channels, then the mix) as SPU_SetStemSink does; either may be null.
+	// Interpolation takes an SPUInterpolationMode, which is mapped to the nearest SSEQ player one.
+	void Render(std::int16_t *out, std::int16_t *stems, unsigned samples, const std::bitset<16> &mutes, unsigned interpolation);
+};
@@ -20,7 +20,8 @@ class XSFPlayer;
 enum
 {
 	idInterpolation = 1000,
-	idMutes
+	idMutes,
+	idNitroComposerHLE
 };
 
 class XSFConfig_2SF : public XSFConfig
@@ -28,10 +29,12 @@ class XSFConfig_2SF : public XSFConfig
 protected:
 	static unsigned initInterpolation;
 	static std::string initMutes;
+	static bool initNitroComposerHLE;
 
 	friend class XSFConfig;
 	unsigned interpolation;
 	std::bitset<16> mutes;
+	bool nitroComposerHLE;
 
 	XSFConfig_2SF();
 	void LoadSpecificConfig() override;
@@ -50,13 +53,14 @@ std::string XSFConfig::commonName = "2SF Decoder";
 std::string XSFConfig::versionNumber = "0.9b";
 unsigned XSFConfig_2SF::initInterpolation = 2;
 std::string XSFConfig_2SF::initMutes = "0000000000000000";
+bool XSFConfig_2SF::initNitroComposerHLE = false;
 
 XSFConfig *XSFConfig::Create()
 {
 	return new XSFConfig_2SF();
 }
 
-XSFConfig_2SF::XSFConfig_2SF() : XSFConfig(), interpolation(0), mutes()
+XSFConfig_2SF::XSFConfig_2SF() : XSFConfig(), interpolation(0), mutes(), nitroComposerHLE(false)
 {
 	this->supportedSampleRates.push_back(DESMUME_SAMPLE_RATE);
 }
@@ -66,12 +70,14 @@ void XSFConfig_2SF::LoadSpecificConfig()
 	this->interpolation = this->configIO->GetValue("Interpolation", XSFConfig_2SF::initInterpolation);
 	std::stringstream mutesSS(this->configIO->GetValue("Mutes", XSFConfig_2SF::initMutes));
 	mutesSS >> this->mutes;
+	this->nitroComposerHLE = this->configIO->GetValue("NitroComposerHLE", XSFConfig_2SF::initNitroComposerHLE);
 }
 
 void XSFConfig_2SF::SaveSpecificConfig()
 {
 	this->configIO->SetValue("Interpolation", this->interpolation);
 	this->configIO->SetValue("Mutes", this->mutes.to_string<char>());
+	this->configIO->SetValue("NitroComposerHLE", this->nitroComposerHLE);
 }
 
 void XSFConfig_2SF::GenerateSpecificDialogs()
@@ -82,6 +88,10 @@ void XSFConfig_2SF::GenerateSpecificDialogs()
 	this->configDialog.AddLabelControl(DialogLabelBuilder(L"Mute").WithSize(50, 8).InGroup(L"Output").WithRelativePositionToSibling(RelativePosition::PositionType::FromBottomLeft, Point<short>(0, 10), 2).IsLeftJustified());
 	this->configDialog.AddListBoxControl(DialogListBoxBuilder().WithSize(78, 45).WithExactHeight().InGroup(L"Output").WithRelativePositionToSibling(RelativePosition::PositionType::FromTopRight, Point<short>(5, -3)).WithID(idMutes).WithBorder().
 		WithVerticalScrollbar().WithMultipleSelect().WithTabStop());
+	this->configDialog.AddCheckBoxControl(DialogCheckBoxBuilder(L"Native NitroComposer Playback").WithSize(110, 10).InGroup(L"Output").WithRelativePositionToSibling(RelativePosition::PositionType::FromBottomLeft, Point<short>(-55, 7)).WithTabStop().
+		WithID(idNitroComposerHLE));
+	this->configDialog.AddLabelControl(DialogLabelBuilder(L"(drops what plays before the sequence starts)").WithSize(160, 8).InGroup(L"Output").WithRelativePositionToSibling(RelativePosition::PositionType::FromBottomLeft, Point<short>(11, 2)).
+		IsLeftJustified());
 }
 
 INT_PTR CALLBACK XSFConfig_2SF::ConfigDialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
@@ -94,6 +104,7 @@ INT_PTR CALLBACK XSFConfig_2SF::ConfigDialogProc(HWND hwndDlg, UINT uMsg, WPARAM
 			SendMessageW(GetDlgItem(hwndDlg, idInterpolation), CB_ADDSTRING, 0, reinterpret_cast<LPARAM>(L"Linear Interpolation"));
 			SendMessageW(GetDlgItem(hwndDlg, idInterpolation), CB_ADDSTRING, 0, reinterpret_cast<LPARAM>(L"Cosine Interpolation"));
 			SendMessageW(GetDlgItem(hwndDlg, idInterpolation), CB_ADDSTRING, 0, reinterpret_cast<LPARAM>(L"Sharp Interpolation"));
+			SendMessageW(GetDlgItem(hwndDlg, idInterpolation), CB_ADDSTRING, 0, reinterpret_cast<LPARAM>(L"Sinc Interpolation"));
 			SendMessageW(GetDlgItem(hwndDlg, idInterpolation), CB_SETCURSEL, this->interpolation, 0);
 			// Mutes
 			for (std::size_t x = 0, numMutes = this->mutes.size(); x < numMutes; ++x)
@@ -101,6 +112,9 @@ INT_PTR CALLBACK XSFConfig_2SF::ConfigDialogProc(HWND hwndDlg, UINT uMsg, WPARAM
 				SendMessageW(GetDlgItem(hwndDlg, idMutes), LB_ADDSTRING, 0, reinterpret_cast<LPARAM>((L"SPU " + std::to_wstring(x + 1)).c_str()));
 				SendMessageW(GetDlgItem(hwndDlg, idMutes), LB_SETSEL, this->mutes[x], x);
 			}
+			// NitroComposer HLE
+			if (this->nitroComposerHLE)
+				SendMessageW(GetDlgItem(hwndDlg, idNitroComposerHLE), BM_SETCHECK, BST_CHECKED, 0);
 			break;
 		case WM_COMMAND:
 			break;
@@ -115,6 +129,7 @@ void XSFConfig_2SF::ResetSpecificConfigDefaults(HWND hwndDlg)
 	auto tmpMutes = std::bitset<16>(XSFConfig_2SF::initMutes);
 	for (std::size_t x = 0, numMutes = tmpMutes.size(); x < numMutes; ++x)
 		SendMessageW(GetDlgItem(hwndDlg, idMutes), LB_SETSEL, tmpMutes[x], x);
+	SendMessageW(GetDlgItem(hwndDlg, idNitroComposerHLE), BM_SETCHECK, XSFConfig_2SF::initNitroComposerHLE ? BST_CHECKED : BST_UNCHECKED, 0);
 }
 
 void XSFConfig_2SF::SaveSpecificConfigDialog(HWND hwndDlg)
@@ -122,11 +137,15 @@ void XSFConfig_2SF::SaveSpecificConfigDialog(HWND hwndDlg)
 	this->interpolation = static_cast<unsigned>(SendMessageW(GetDlgItem(hwndDlg, idInterpolation), CB_GETCURSEL, 0, 0));
 	for (std::size_t x = 0, numMutes = this->mutes.size(); x < numMutes; ++x)
 		this->mutes[x] = !!SendMessageW(GetDlgItem(hwndDlg, idMutes), LB_GETSEL, x, 0);
+	this->nitroComposerHLE = SendMessageW(GetDlgItem(hwndDlg, idNitroComposerHLE), BM_GETCHECK, 0, 0) == BST_CHECKED;
 }
 
 void XSFConfig_2SF::CopySpecificConfigToMemory(XSFPlayer *, bool preLoad)
 {
-	if (!preLoad)
+	// XSFPlayer_2SF::Load lets a _2sf_hle tag override this
+	if (preLoad)
+		CommonSettings.nitroComposerHLE = this->nitroComposerHLE;
+	else
 	{
 		CommonSettings.spuInterpolationMode = static_cast<SPUInterpolationMode>(this->interpolation);
 		for (std::size_t x = 0, numMutes = this->mutes.size(); x < numMutes; ++x)
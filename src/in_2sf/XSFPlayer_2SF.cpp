@@ -11,30 +11,55 @@
  */
 
 #include <algorithm>
+#include <bitset>
+#include <exception>
 #include <filesystem>
 #include <memory>
 #include <string>
 #include <vector>
+#include <cstddef>
 #include <cstdint>
 #include <zlib.h>
 #include "XSFCommon.h"
 #include "XSFPlayer.h"
+#include "NitroComposerHLE.h"
 #include "desmume/NDSSystem.h"
+#include "desmume/FIFO.h"
+#include "desmume/saveStates.h"
 
 class XSFPlayer_2SF : public XSFPlayer
 {
-	std::vector<std::uint8_t> rom;
+	// where a 2SF's program section goes in the rom
+	struct Section
+	{
+		const XSFFile *xSF;
+		std::uint32_t offset, size;
+	};
 
-	void Map2SFSection(const std::vector<std::uint8_t> &section);
-	bool Map2SF(XSFFile *xSFToLoad);
-	bool RecursiveLoad2SF(XSFFile *xSFToLoad, int level);
+	// the sections mapped, followed by padding (see Load2SF)
+	std::vector<std::uint8_t> rom;
+	std::uint32_t romSize;
+	// stem frames rendered past the end of the last GenerateStems request
+	std::vector<std::int16_t> stemQueue;
+	// set when the sequence is played natively rather than emulated
+	std::unique_ptr<NitroComposerHLE> hle;
+
+	bool Map2SF(XSFFile *xSFToLoad, std::vector<Section> &sections);
+	bool RecursiveLoad2SF(XSFFile *xSFToLoad, int level, std::vector<std::unique_ptr<XSFFile>> &libs, std::vector<Section> &sections);
 	bool Load2SF(XSFFile *xSFToLoad);
+	bool StartNitroComposerHLE();
 public:
 	XSFPlayer_2SF(const std::filesystem::path &path);
 	~XSFPlayer_2SF() override { this->Terminate(); }
 	bool Load() override;
 	void GenerateSamples(std::vector<std::uint8_t> &buf, unsigned offset, unsigned samples) override;
+	void SkipSamples(std::vector<std::uint8_t> &buf, unsigned samples) override;
 	void Terminate() override;
+	// Renders the next samples sample frames as SPU_STEM_COUNT interleaved stereo pairs each
+	// (SPU channels 0-15, then the master mix), from a single emulation pass. This advances the
+	// same emulation as GenerateSamples, so use one or the other for a given load. The
+	// in2sfGetStems_ exports at the end of this file are what call it.
+	void GenerateStems(std::vector<std::int16_t> &buf, unsigned samples);
 };
 
 const char *XSFPlayer::WinampDescription = "2SF Decoder";
@@ -49,22 +74,15 @@ volatile bool execute = false;
 
 static struct
 {
-	std::vector<std::uint8_t> buf;
-	unsigned filled, used;
-	std::uint32_t bufferbytes, cycles;
-	int xfs_load, sync_type;
-} sndifwork = { std::vector<std::uint8_t>(), 0, 0, 0, 0, 0, 0 };
+	int xfs_load;
+} sndifwork = { 0 };
 
+// The SPU writes straight into GenerateSamples' buffer (see SPU_SetDirectOutput), so the sound
+// core only has to exist; it never receives audio.
 static void SNDIFDeInit() { }
 
-static int SNDIFInit(int buffersize)
+static int SNDIFInit(int)
 {
-	std::uint32_t bufferbytes = buffersize * sizeof(std::int16_t);
-	SNDIFDeInit();
-	sndifwork.buf.resize(bufferbytes + 3);
-	sndifwork.bufferbytes = bufferbytes;
-	sndifwork.filled = sndifwork.used = 0;
-	sndifwork.cycles = 0;
 	return 0;
 }
 
@@ -74,18 +92,10 @@ static void SNDIFSetVolume(int) { }
 
 static std::uint32_t SNDIFGetAudioSpace()
 {
-	return sndifwork.bufferbytes >> 2; // bytes to samples
+	return 0;
 }
 
-static void SNDIFUpdateAudio(std::int16_t *buffer, std::uint32_t num_samples)
-{
-	std::uint32_t num_bytes = num_samples << 2;
-	if (num_bytes > sndifwork.bufferbytes)
-		num_bytes = sndifwork.bufferbytes;
-	std::copy_n(reinterpret_cast<std::uint8_t *>(buffer), num_bytes, &sndifwork.buf[0]);
-	sndifwork.filled = num_bytes;
-	sndifwork.used = 0;
-}
+static void SNDIFUpdateAudio(std::int16_t *, std::uint32_t) { }
 
 static const int SNDIFID_2SF = 1;
 static SoundInterface_struct SNDIF_2SF =
@@ -111,40 +121,69 @@ SoundInterface_struct *SNDCoreList[] =
 	nullptr
 };
 
-void XSFPlayer_2SF::Map2SFSection(const std::vector<std::uint8_t> &section)
+// A program section is an 8 byte header, the offset and size of the data in the rom, then the
+// data. This inflates the header, and the data straight into dest when it is given.
+static bool Inflate2SFSection(const XSFFile *xSFFile, std::uint8_t (&header)[8], std::uint8_t *dest = nullptr, std::uint32_t destSize = 0)
 {
-	std::uint32_t offset = Get32BitsLE(&section[0]), size = Get32BitsLE(&section[4]), finalSize = size + offset;
-	finalSize = NextHighestPowerOf2(finalSize);
-	if (this->rom.empty())
-		this->rom.resize(finalSize + 10, 0);
-	else if (this->rom.size() < size + offset)
-		this->rom.resize(offset + finalSize + 10);
-	std::copy_n(&section[8], size, &this->rom[offset]);
+	std::uint32_t compressedSize;
+	auto compressed = xSFFile->GetCompressedProgramSection(compressedSize);
+	if (!compressed)
+		return false;
+
+	z_stream stream = {};
+	stream.next_in = const_cast<Bytef *>(compressed);
+	stream.avail_in = compressedSize;
+	if (inflateInit(&stream) != Z_OK)
+		return false;
+	auto inflateTo = [&stream](std::uint8_t *out, std::uint32_t size)
+	{
+		stream.next_out = out;
+		stream.avail_out = size;
+		int result = Z_OK;
+		while (stream.avail_out && result == Z_OK)
+			result = inflate(&stream, Z_NO_FLUSH);
+		return !stream.avail_out;
+	};
+	// data that is cut short or corrupt leaves the rest of its section as it was rather than failing the load
+	bool inflated = inflateTo(header, 8);
+	if (inflated && dest)
+		inflateTo(dest, destSize);
+	inflateEnd(&stream);
+	return inflated;
 }
 
-bool XSFPlayer_2SF::Map2SF(XSFFile *xSFToLoad)
+bool XSFPlayer_2SF::Map2SF(XSFFile *xSFToLoad, std::vector<Section> &sections)
 {
 	if (!xSFToLoad->IsValidType(0x24))
 		return false;
 
-	const auto &programSection = xSFToLoad->GetProgramSection();
+	std::uint32_t compressedSize;
+	if (!xSFToLoad->GetCompressedProgramSection(compressedSize))
+		return true;
 
-	if (!programSection.empty())
-		this->Map2SFSection(programSection);
+	std::uint8_t header[8];
+	if (!Inflate2SFSection(xSFToLoad, header))
+		return false;
+	std::uint32_t offset = Get32BitsLE(&header[0]), size = Get32BitsLE(&header[4]);
+	if (size > UINT32_MAX - offset)
+		return false;
+	sections.push_back({ xSFToLoad, offset, size });
 
 	return true;
 }
 
-bool XSFPlayer_2SF::RecursiveLoad2SF(XSFFile *xSFToLoad, int level)
+// Only the tags are read, the program sections are left compressed until Load2SF knows the
+// extent of the rom
+bool XSFPlayer_2SF::RecursiveLoad2SF(XSFFile *xSFToLoad, int level, std::vector<std::unique_ptr<XSFFile>> &libs, std::vector<Section> &sections)
 {
 	if (level <= 10 && xSFToLoad->GetTagExists("_lib"))
 	{
-		auto libxSF = std::make_unique<XSFFile>(xSFToLoad->GetFilepath().parent_path() / xSFToLoad->GetTagValue("_lib"), 4, 8);
-		if (!this->RecursiveLoad2SF(libxSF.get(), level + 1))
+		libs.emplace_back(new XSFFile(xSFToLoad->GetFilepath().parent_path() / xSFToLoad->GetTagValue("_lib")));
+		if (!this->RecursiveLoad2SF(libs.back().get(), level + 1, libs, sections))
 			return false;
 	}
 
-	if (!this->Map2SF(xSFToLoad))
+	if (!this->Map2SF(xSFToLoad, sections))
 		return false;
 
 	unsigned n = 2;
@@ -156,8 +195,8 @@ bool XSFPlayer_2SF::RecursiveLoad2SF(XSFFile *xSFToLoad, int level)
 		if (xSFToLoad->GetTagExists(libTag))
 		{
 			found = true;
-			auto libxSF = std::make_unique<XSFFile>(xSFToLoad->GetFilepath().parent_path() / xSFToLoad->GetTagValue(libTag), 4, 8);
-			if (!this->RecursiveLoad2SF(libxSF.get(), level + 1))
+			libs.emplace_back(new XSFFile(xSFToLoad->GetFilepath().parent_path() / xSFToLoad->GetTagValue(libTag)));
+			if (!this->RecursiveLoad2SF(libs.back().get(), level + 1, libs, sections))
 				return false;
 		}
 	} while (found);
@@ -165,24 +204,108 @@ bool XSFPlayer_2SF::RecursiveLoad2SF(XSFFile *xSFToLoad, int level)
 	return true;
 }
 
+// NDS_Reset reads the whole rom header, and slot-1 reads fetch a word from any byte of the rom
+static const std::uint32_t ROM_MIN_SIZE = 0x200;
+static const std::uint32_t ROM_PADDING = 3;
+
+// The rom is allocated once, for the extent of all the sections, and each section is inflated
+// into it in the order the sections map, so later ones still overwrite earlier ones
 bool XSFPlayer_2SF::Load2SF(XSFFile *xSFToLoad)
 {
-	this->rom.clear();
+	std::vector<std::uint8_t>().swap(this->rom);
+	this->romSize = 0;
+
+	std::vector<std::unique_ptr<XSFFile>> libs;
+	std::vector<Section> sections;
+	if (!this->RecursiveLoad2SF(xSFToLoad, 1, libs, sections))
+		return false;
+
+	for (const auto &section : sections)
+		this->romSize = std::max(this->romSize, section.offset + section.size);
+	if (!this->romSize)
+		return true;
+
+	this->rom.resize(std::max(this->romSize, ROM_MIN_SIZE) + ROM_PADDING);
+	for (const auto &section : sections)
+	{
+		std::uint8_t header[8];
+		if (!Inflate2SFSection(section.xSF, header, &this->rom[section.offset], section.size))
+			return false;
+	}
+
+	return true;
+}
+
+XSFPlayer_2SF::XSFPlayer_2SF(const std::filesystem::path &path) : XSFPlayer(), romSize(0)
+{
+	this->xSF.reset(new XSFFile(path));
+}
+
+// How long the ARM9 gets to start its sequence, in frames. Rips start their sequence right away,
+// so a file that hasn't by then is emulated with little time lost.
+static const int NITRO_COMPOSER_DETECTION_FRAMES = 60;
+// How long the ARM9 is followed once it has, in frames. The volume, tempo and such a game sets
+// up along with its sequence come within this.
+static const int NITRO_COMPOSER_FOLLOW_FRAMES = 30;
 
-	return this->RecursiveLoad2SF(xSFToLoad, 1);
+struct NitroComposerDetection
+{
+	NitroComposerHLE *hle;
+	NitroComposerHLE::Detection result;
+};
+
+static void NitroComposerIPCSend(std::uint8_t proc, std::uint32_t val, void *context)
+{
+	auto detection = static_cast<NitroComposerDetection *>(context);
+	if (proc == ARMCPU_ARM9 && detection->result != NitroComposerHLE::Detection::Failed)
+		detection->result = detection->hle->ExamineIPCSend(val, MMU.MAIN_MEM, _MMU_MAIN_MEM_MASK);
 }
 
-XSFPlayer_2SF::XSFPlayer_2SF(const std::filesystem::path &path) : XSFPlayer()
+// Emulates until the ARM9 starts a sequence, then follows it a little longer for the commands
+// that come with it. When the sequence is one of the rom's and nothing the native player can't
+// reproduce came after it, that is played natively from then on, with the emulator stopped for
+// good. Otherwise the emulator is put back the way it was, as if this never ran, so emulation
+// starts from the top (_frames included) with nothing having been heard yet.
+bool XSFPlayer_2SF::StartNitroComposerHLE()
 {
-	this->xSF.reset(new XSFFile(path, 4, 8));
+	auto newHLE = std::make_unique<NitroComposerHLE>(this->rom);
+	std::vector<std::uint8_t> state;
+	if (!newHLE->FindSDATs() || !savestate_save(state))
+		return false;
+
+	NitroComposerDetection detection = { newHLE.get(), NitroComposerHLE::Detection::Pending };
+	IPC_FIFOsetSendHook(NitroComposerIPCSend, &detection);
+	for (int i = 0; i < NITRO_COMPOSER_DETECTION_FRAMES && detection.result == NitroComposerHLE::Detection::Pending; ++i)
+		NDS_exec<false>();
+	for (int i = 0; i < NITRO_COMPOSER_FOLLOW_FRAMES && detection.result == NitroComposerHLE::Detection::Found; ++i)
+		NDS_exec<false>();
+	IPC_FIFOsetSendHook(nullptr, nullptr);
+
+	if (detection.result == NitroComposerHLE::Detection::Found)
+	{
+		newHLE->Start(this->sampleRate);
+		this->hle = std::move(newHLE);
+		return true;
+	}
+
+	if (!savestate_load(state))
+		NDS_Reset();
+	return false;
 }
 
 bool XSFPlayer_2SF::Load()
 {
 	int frames = this->xSF->GetTagValue("_frames", -1);
-	sndifwork.sync_type = this->xSF->GetTagValue("_2sf_sync_type", 0);
+	// _2sf_skew=n lets the cpus run up to n cycles apart (see CommonSettings.cpu_skew)
+	static const std::uint32_t defaultSkew = CommonSettings.cpu_skew;
+	CommonSettings.cpu_skew = this->xSF->GetTagValue("_2sf_skew", defaultSkew);
+	bool nitroComposerHLE = CommonSettings.nitroComposerHLE;
+	// _2sf_hle=0 keeps a 2SF emulated, any other value tries to play it natively
+	if (this->xSF->GetTagExists("_2sf_hle"))
+		nitroComposerHLE = this->xSF->GetTagValue("_2sf_hle") != "0";
 
 	sndifwork.xfs_load = false;
+	this->stemQueue.clear();
 	if (!this->Load2SF(this->xSF.get()))
 		return false;
 
@@ -197,19 +320,28 @@ bool XSFPlayer_2SF::Load()
 	MMU_unsetRom();
 	if (!this->rom.empty())
 	{
-		NDS_SetROM(&this->rom[0], this->rom.size() - 1);
-		gameInfo.loadData(reinterpret_cast<char *>(&this->rom[0]), this->rom.size() - 1);
+		gameInfo.useExternalData(this->romSize);
+		NDS_SetROM(&this->rom[0], gameInfo.mask);
 	}
 
 	CommonSettings.use_jit = true;
-	CommonSettings.jit_max_block_size = 100;
+	CommonSettings.jit_max_block_size = 0;
 	NDS_Reset();
+	SPU_SetDirectOutput(true);
 
 	execute = true;
 
+	// the native player starts on the sequence's first tick, so _frames only applies to emulation
+	this->hle.reset();
+	if (nitroComposerHLE && this->StartNitroComposerHLE())
+	{
+		sndifwork.xfs_load = true;
+		return XSFPlayer::Load();
+	}
+
 	if (frames > 0)
 	{
-		/* skip 1 sec */
+		/* skip 1 sec, silently since no output span is set */
 		for (int i = 0; i < frames; ++i)
 			NDS_exec<false>();
 	}
@@ -222,72 +354,122 @@ bool XSFPlayer_2SF::Load()
 	return XSFPlayer::Load();
 }
 
+static std::bitset<16> MutedChannels()
+{
+	std::bitset<16> mutes;
+	for (std::size_t x = 0; x < mutes.size(); ++x)
+		mutes[x] = CommonSettings.spu_muteChannels[x];
+	return mutes;
+}
+
 void XSFPlayer_2SF::GenerateSamples(std::vector<std::uint8_t> &buf, unsigned offset, unsigned samples)
 {
-	static const double HBASE_CYCLES = 33509300.322234;
-	static const int HLINE_CYCLES = 6 * (99 + 256);
-	std::uint32_t HSAMPLES = static_cast<std::uint32_t>(static_cast<double>(this->sampleRate * HLINE_CYCLES) / HBASE_CYCLES);
-	static const int VDIVISION = 100;
-	static const int VLINES = 263;
-	static const double VBASE_CYCLES = HBASE_CYCLES / VDIVISION;
-	std::uint32_t VSAMPLES = static_cast<std::uint32_t>(static_cast<double>(this->sampleRate * HLINE_CYCLES * VLINES) / HBASE_CYCLES);
+	// an empty span never counts as full, so there would be nothing to stop the loop below
+	if (!sndifwork.xfs_load || !samples)
+		return;
+	if (this->hle)
+	{
+		this->hle->Render(reinterpret_cast<std::int16_t *>(&buf[offset]), nullptr, samples, MutedChannels(), CommonSettings.spuInterpolationMode);
+		return;
+	}
+	SPU_SetOutputSpan(reinterpret_cast<std::int16_t *>(&buf[offset]), samples);
+	while (!NDS_execUntilOutputFull())
+		;
+	SPU_SetOutputSpan(nullptr, 0);
+}
 
+// The SPU advances every channel (and any running capture) without mixing while skipping
+void XSFPlayer_2SF::SkipSamples(std::vector<std::uint8_t> &, unsigned samples)
+{
+	if (!sndifwork.xfs_load || !samples)
+		return;
+	if (this->hle)
+	{
+		this->hle->Render(nullptr, nullptr, samples, MutedChannels(), CommonSettings.spuInterpolationMode);
+		return;
+	}
+	SPU_SetOutputSpan(nullptr, samples);
+	while (!NDS_execUntilOutputFull())
+		;
+	SPU_SetOutputSpan(nullptr, 0);
+}
+
+static void StemSinkAppend(const std::int16_t *stems, std::uint32_t num_samples, void *context)
+{
+	auto queue = static_cast<std::vector<std::int16_t> *>(context);
+	queue->insert(queue->end(), stems, stems + num_samples * SPU_STEM_COUNT * 2);
+}
+
+void XSFPlayer_2SF::GenerateStems(std::vector<std::int16_t> &buf, unsigned samples)
+{
+	const std::size_t frameValues = SPU_STEM_COUNT * 2;
+
+	buf.resize(samples * frameValues);
 	if (!sndifwork.xfs_load)
+	{
+		std::fill(buf.begin(), buf.end(), 0);
 		return;
-	unsigned bytes = samples << 2;
-	while (bytes)
+	}
+	if (this->hle)
 	{
-		unsigned remainbytes = sndifwork.filled - sndifwork.used;
-		if (remainbytes > 0)
-		{
-			if (remainbytes > bytes)
-			{
-				std::copy_n(&sndifwork.buf[sndifwork.used], bytes, &buf[offset]);
-				sndifwork.used += bytes;
-				offset += bytes;
-				remainbytes -= bytes;
-				bytes = 0;
-				break;
-			}
-			else
-			{
-				std::copy_n(&sndifwork.buf[sndifwork.used], remainbytes, &buf[offset]);
-				sndifwork.used += remainbytes;
-				offset += remainbytes;
-				bytes -= remainbytes;
-				remainbytes = 0;
-			}
-		}
-		if (!remainbytes)
-		{
-			if (sndifwork.sync_type == 1)
-			{
-				/* vsync */
-				sndifwork.cycles += (this->sampleRate / VDIVISION) * HLINE_CYCLES * VLINES;
-				if (sndifwork.cycles >= static_cast<std::uint32_t>(VBASE_CYCLES * (VSAMPLES + 1)))
-					sndifwork.cycles -= static_cast<std::uint32_t>(VBASE_CYCLES * (VSAMPLES + 1));
-				else
-					sndifwork.cycles -= static_cast<std::uint32_t>(VBASE_CYCLES * VSAMPLES);
-			}
-			else
-			{
-				/* hsync */
-				sndifwork.cycles += this->sampleRate * HLINE_CYCLES;
-				if (sndifwork.cycles >= static_cast<std::uint32_t>(HBASE_CYCLES * (HSAMPLES + 1)))
-					sndifwork.cycles -= static_cast<std::uint32_t>(HBASE_CYCLES * (HSAMPLES + 1));
-				else
-					sndifwork.cycles -= static_cast<std::uint32_t>(HBASE_CYCLES * HSAMPLES);
-			}
-			NDS_exec<false>();
-			SPU_Emulate_user();
-		}
+		this->hle->Render(nullptr, buf.data(), samples, MutedChannels(), CommonSettings.spuInterpolationMode);
+		return;
 	}
+
+	SPU_SetStemSink(StemSinkAppend, &this->stemQueue);
+	while (this->stemQueue.size() < buf.size())
+		NDS_exec<false>();
+	SPU_SetStemSink(nullptr, nullptr);
+
+	std::copy_n(this->stemQueue.begin(), buf.size(), buf.begin());
+	this->stemQueue.erase(this->stemQueue.begin(), this->stemQueue.begin() + buf.size());
 }
 
 void XSFPlayer_2SF::Terminate()
 {
+	this->hle.reset();
 	MMU_unsetRom();
 	NDS_DeInit();
 
-	this->rom.clear();
+	std::vector<std::uint8_t>().swap(this->rom);
+	this->romSize = 0;
+}
+
+std::intptr_t wrapperWinampGetExtendedRead_open(std::unique_ptr<XSFPlayer> &&tmpxSFPlayer, int *size, int *bps, int *nch, int *srate);
+
+// Stem export, for tools rather than Winamp. Opens like the extended read does, but the data is
+// what GenerateStems renders, SPU_STEM_COUNT interleaved 16-bit stereo pairs per sample frame.
+// The length (in sample frames, fade included) is only reported, ending there is left to the
+// caller, and the handle is closed with in2sfGetStems_close.
+extern "C" __declspec(dllexport) std::intptr_t in2sfGetStems_openW(const wchar_t *fn, int *samples, int *nch, int *srate)
+{
+	try
+	{
+		auto handle = wrapperWinampGetExtendedRead_open(std::make_unique<XSFPlayer_2SF>(fn), nullptr, nullptr, nullptr, srate);
+		if (handle && samples)
+			*samples = reinterpret_cast<XSFPlayer *>(handle)->GetLengthInSamples();
+		if (handle && nch)
+			*nch = SPU_STEM_COUNT * 2;
+		return handle;
+	}
+	catch (const std::exception &)
+	{
+		return 0;
+	}
+}
+
+extern "C" __declspec(dllexport) std::size_t in2sfGetStems_getData(std::intptr_t handle, std::int16_t *dest, std::size_t samples)
+{
+	auto tmpxSFPlayer = static_cast<XSFPlayer_2SF *>(reinterpret_cast<XSFPlayer *>(handle));
+	if (!tmpxSFPlayer)
+		return 0;
+	std::vector<std::int16_t> stems;
+	tmpxSFPlayer->GenerateStems(stems, samples);
+	std::copy(stems.begin(), stems.end(), dest);
+	return samples;
+}
+
+extern "C" __declspec(dllexport) void in2sfGetStems_close(std::intptr_t handle)
+{
+	delete reinterpret_cast<XSFPlayer *>(handle);
 }
@@ -27,44 +27,51 @@
 // ========================================================= IPC FIFO
 IPC_FIFO ipc_fifo[2]; // 0 - ARM9, 1 - ARM7
 
+// IPCFIFOCNT of each cpu, kept in I/O memory since reads of the register are served from there
+static inline uint8_t *IPC_FIFOcntRegs(uint8_t proc) { return MMU.MMU_MEM[proc][0x40] + 0x184; }
+
+static IPC_FIFOSendHook sendHook = nullptr;
+static void *sendHookContext = nullptr;
+
 void IPC_FIFOinit(uint8_t proc)
 {
 	memset(&ipc_fifo[proc], 0, sizeof(IPC_FIFO));
-	T1WriteWord(MMU.MMU_MEM[proc][0x40], 0x184, 0x00000101);
+	T1WriteWord(IPC_FIFOcntRegs(proc), 0, 0x00000101);
 }
 
 void IPC_FIFOsend(uint8_t proc, uint32_t val)
 {
-	uint16_t cnt_l = T1ReadWord(MMU.MMU_MEM[proc][0x40], 0x184);
+	uint8_t *regs_l = IPC_FIFOcntRegs(proc);
+	uint16_t cnt_l = T1ReadWord(regs_l, 0);
 	if (!(cnt_l & IPCFIFOCNT_FIFOENABLE))
 		return; // FIFO disabled
 	uint8_t proc_remote = proc ^ 1;
+	IPC_FIFO &fifo = ipc_fifo[proc];
 
-	if (ipc_fifo[proc].size > 15)
+	if (fifo.size > 15)
 	{
-		cnt_l |= IPCFIFOCNT_FIFOERROR;
-		T1WriteWord(MMU.MMU_MEM[proc][0x40], 0x184, cnt_l);
+		T1WriteWord(regs_l, 0, cnt_l | IPCFIFOCNT_FIFOERROR);
 		return;
 	}
 
-	uint16_t cnt_r = T1ReadWord(MMU.MMU_MEM[proc_remote][0x40], 0x184);
+	uint8_t *regs_r = IPC_FIFOcntRegs(proc_remote);
+	uint16_t cnt_r = T1ReadWord(regs_r, 0);
 
 	cnt_l &= 0xBFFC; // clear send empty bit & full
 	cnt_r &= 0xBCFF; // set recv empty bit & full
-	ipc_fifo[proc].buf[ipc_fifo[proc].tail] = val;
-	++ipc_fifo[proc].tail;
-	++ipc_fifo[proc].size;
-	if (ipc_fifo[proc].tail > 15)
-		ipc_fifo[proc].tail = 0;
-
-	if (ipc_fifo[proc].size > 15)
+	fifo.buf[fifo.tail] = val;
+	fifo.tail = (fifo.tail + 1) & 15;
+	if (++fifo.size > 15)
 	{
 		cnt_l |= IPCFIFOCNT_SENDFULL; // set send full bit
 		cnt_r |= IPCFIFOCNT_RECVFULL; // set recv full bit
 	}
 
-	T1WriteWord(MMU.MMU_MEM[proc][0x40], 0x184, cnt_l);
-	T1WriteWord(MMU.MMU_MEM[proc_remote][0x40], 0x184, cnt_r);
+	T1WriteWord(regs_l, 0, cnt_l);
+	T1WriteWord(regs_r, 0, cnt_r);
+
+	if (sendHook)
+		sendHook(proc, val, sendHookContext);
 
 	if (cnt_r & IPCFIFOCNT_RECVIRQEN)
 		NDS_makeIrq(proc_remote, IRQ_BIT_IPCFIFO_RECVNONEMPTY);
@@ -72,34 +79,36 @@ void IPC_FIFOsend(uint8_t proc, uint32_t val)
 	NDS_Reschedule();
 }
 
+void IPC_FIFOsetSendHook(IPC_FIFOSendHook hook, void *context)
+{
+	sendHook = hook;
+	sendHookContext = context;
+}
+
 uint32_t IPC_FIFOrecv(uint8_t proc)
 {
-	uint16_t cnt_l = T1ReadWord(MMU.MMU_MEM[proc][0x40], 0x184);
+	uint8_t *regs_l = IPC_FIFOcntRegs(proc);
+	uint16_t cnt_l = T1ReadWord(regs_l, 0);
 	if (!(cnt_l & IPCFIFOCNT_FIFOENABLE))
 		return 0; // FIFO disabled
 	uint8_t proc_remote = proc ^ 1;
+	IPC_FIFO &fifo = ipc_fifo[proc_remote];
 
-	uint32_t val = 0;
-
-	if (!ipc_fifo[proc_remote].size) // remote FIFO error
+	if (!fifo.size) // remote FIFO error
 	{
-		cnt_l |= IPCFIFOCNT_FIFOERROR;
-		T1WriteWord(MMU.MMU_MEM[proc][0x40], 0x184, cnt_l);
+		T1WriteWord(regs_l, 0, cnt_l | IPCFIFOCNT_FIFOERROR);
 		return 0;
 	}
 
-	uint16_t cnt_r = T1ReadWord(MMU.MMU_MEM[proc_remote][0x40], 0x184);
+	uint8_t *regs_r = IPC_FIFOcntRegs(proc_remote);
+	uint16_t cnt_r = T1ReadWord(regs_r, 0);
 
 	cnt_l &= 0xBCFF; // clear send full bit & empty
 	cnt_r &= 0xBFFC; // set recv full bit & empty
 
-	val = ipc_fifo[proc_remote].buf[ipc_fifo[proc_remote].head];
-	++ipc_fifo[proc_remote].head;
-	--ipc_fifo[proc_remote].size;
-	if (ipc_fifo[proc_remote].head > 15)
-		ipc_fifo[proc_remote].head = 0;
-
-	if (!ipc_fifo[proc_remote].size) // FIFO empty
+	uint32_t val = fifo.buf[fifo.head];
+	fifo.head = (fifo.head + 1) & 15;
+	if (!--fifo.size) // FIFO empty
 	{
 		cnt_l |= IPCFIFOCNT_RECVEMPTY;
 		cnt_r |= IPCFIFOCNT_SENDEMPTY;
@@ -108,8 +117,8 @@ uint32_t IPC_FIFOrecv(uint8_t proc)
 			NDS_makeIrq(proc_remote, IRQ_BIT_IPCFIFO_SENDEMPTY);
 	}
 
-	T1WriteWord(MMU.MMU_MEM[proc][0x40], 0x184, cnt_l);
-	T1WriteWord(MMU.MMU_MEM[proc_remote][0x40], 0x184, cnt_r);
+	T1WriteWord(regs_l, 0, cnt_l);
+	T1WriteWord(regs_r, 0, cnt_r);
 
 	NDS_Reschedule();
 
@@ -118,8 +127,10 @@ uint32_t IPC_FIFOrecv(uint8_t proc)
 
 void IPC_FIFOcnt(uint8_t proc, uint16_t val)
 {
-	uint16_t cnt_l = T1ReadWord(MMU.MMU_MEM[proc][0x40], 0x184);
-	uint16_t cnt_r = T1ReadWord(MMU.MMU_MEM[proc^1][0x40], 0x184);
+	uint8_t *regs_l = IPC_FIFOcntRegs(proc);
+	uint8_t *regs_r = IPC_FIFOcntRegs(proc ^ 1);
+	uint16_t cnt_l = T1ReadWord(regs_l, 0);
+	uint16_t cnt_r = T1ReadWord(regs_r, 0);
 
 	if (val & IPCFIFOCNT_FIFOERROR)
 		// at least SPP uses this, maybe every retail game
@@ -150,8 +161,8 @@ void IPC_FIFOcnt(uint8_t proc, uint16_t val)
 	if ((cnt_l & IPCFIFOCNT_RECVIRQEN) && !(cnt_l & IPCFIFOCNT_RECVEMPTY))
 		NDS_makeIrq(proc, IRQ_BIT_IPCFIFO_RECVNONEMPTY);
 
-	T1WriteWord(MMU.MMU_MEM[proc][0x40], 0x184, cnt_l);
-	T1WriteWord(MMU.MMU_MEM[proc^1][0x40], 0x184, cnt_r);
+	T1WriteWord(regs_l, 0, cnt_l);
+	T1WriteWord(regs_r, 0, cnt_r);
 
 	NDS_Reschedule();
 }
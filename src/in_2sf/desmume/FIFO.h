@@ -36,3 +36,7 @@ extern void IPC_FIFOinit(uint8_t proc);
 extern void IPC_FIFOsend(uint8_t proc, uint32_t val);
 extern uint32_t IPC_FIFOrecv(uint8_t proc);
 extern void IPC_FIFOcnt(uint8_t proc, uint16_t val);
+
+// Observes every word a cpu puts in its send FIFO (proc is the sender), before the receiver can see it
+typedef void (*IPC_FIFOSendHook)(uint8_t proc, uint32_t val, void *context);
+extern void IPC_FIFOsetSendHook(IPC_FIFOSendHook hook, void *context);
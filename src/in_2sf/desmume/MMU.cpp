@@ -17,6 +17,7 @@
 	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <sstream>
 #include <cstdlib>
 #include <cmath>
@@ -29,6 +30,7 @@
 #include "slot1.h"
 #include "readwrite.h"
 #include "MMU_timing.h"
+#include "saveStates.h"
 
 // http://home.utah.edu/~nahaj/factoring/isqrt.c.html
 static uint64_t isqrt(uint64_t x)
@@ -72,6 +74,7 @@ uint32_t _MMU_MAIN_MEM_MASK32 = 0x3FFFFF & ~3;
 MMU_struct MMU;
 MMU_struct_new MMU_new;
 MMU_struct_timing MMU_timing;
+MMU_struct_fastmem MMU_fastmem;
 
 uint8_t *MMU_struct::MMU_MEM[2][256] =
 {
@@ -82,7 +85,7 @@ uint8_t *MMU_struct::MMU_MEM[2][256] =
 		/* 1X*/	DUP16(MMU.UNUSED_RAM),
 		/* 2X*/	DUP16(MMU.MAIN_MEM),
 		/* 3X*/	DUP16(MMU.SWIRAM),
-		/* 4X*/	DUP16(MMU.ARM9_REG),
+		/* 4X*/	MMU.ARM9_REG, DUP8(MMU.UNUSED_RAM), DUP4(MMU.UNUSED_RAM), DUP2(MMU.UNUSED_RAM), MMU.UNUSED_RAM,
 		/* 5X*/	DUP16(MMU.ARM9_VMEM),
 		/* 6X*/	DUP16(MMU.ARM9_LCD),
 		/* 7X*/	DUP16(MMU.ARM9_OAM),
@@ -127,7 +130,7 @@ uint32_t MMU_struct::MMU_MASK[2][256] =
 		/* 1X*/	DUP16(0x00000003),
 		/* 2X*/	DUP16(0x003FFFFF),
 		/* 3X*/	DUP16(0x00007FFF),
-		/* 4X*/	DUP16(0x00FFFFFF),
+		/* 4X*/	0x0000FFFF, DUP8(0x00000003), DUP4(0x00000003), DUP2(0x00000003), 0x00000003,
 		/* 5X*/	DUP16(0x000007FF),
 		/* 6X*/	DUP16(0x000FFFFF),
 		/* 7X*/	DUP16(0x000007FF),
@@ -632,6 +635,12 @@ static inline void MMU_VRAMmapControl(uint8_t block, uint8_t VRAMBankCnt)
 	// handle WRAM, first of all
 	if (block == 7)
 	{
+		// shared wram moves between the cpus without any write to it
+		if (MMU.WRAMCNT != (VRAMBankCnt & 3))
+		{
+			decode_cache_reset(ARMCPU_ARM9);
+			decode_cache_reset(ARMCPU_ARM7);
+		}
 		MMU.WRAMCNT = VRAMBankCnt & 3;
 		return;
 	}
@@ -713,9 +722,37 @@ static inline void MMU_VRAMmapControl(uint8_t block, uint8_t VRAMBankCnt)
 //end vram
 //////////////////////////////////////////////////////////////
 
+// the regions in the table have fixed backing memory, so it only needs building once
+static void MMU_fastmemInit()
+{
+	memset(&MMU_fastmem, 0, sizeof(MMU_fastmem));
+	for (uint32_t page = 0; page < 0x10000; ++page)
+	{
+		uint32_t adr = page << 12;
+		uint8_t *arm7 = nullptr;
+		if ((adr & 0x0F800000) == 0x03000000)
+			arm7 = MMU.SWIRAM + (adr & 0x7FFF);
+		else if ((adr & 0x0F800000) == 0x03800000)
+			arm7 = MMU.ARM7_ERAM + (adr & 0xFFFF);
+		MMU_fastmem.read[ARMCPU_ARM7][page] = MMU_fastmem.write[ARMCPU_ARM7][page] = arm7;
+
+		// wifi RAM proper, between the wifi registers
+		if ((adr & 0x0F800000) == 0x04800000 && (adr & 0xE000) == 0x4000)
+			MMU_fastmem.read[ARMCPU_ARM7][page] = MMU.ARM7_WIRAM + (adr & 0xFFFF);
+	}
+}
+
+// The 4X row of MMU_MEM covers a whole megabyte, but ARM9_REG only holds 04000000-0400FFFF.
+// Registers past that are handled by address, and anything else there is unused memory.
+static inline uint8_t *MMU_ARM9_IOptr(uint32_t adr)
+{
+	return adr < 0x04010000 ? &MMU.ARM9_REG[adr & 0xFFFF] : &MMU.UNUSED_RAM[adr & 3];
+}
+
 void MMU_Init()
 {
 	memset(&MMU, 0, sizeof(MMU_struct));
+	MMU_fastmemInit();
 
 	MMU.CART_ROM = MMU.UNUSED_RAM;
 
@@ -851,6 +888,115 @@ void MMU_unsetRom()
 	MMU.CART_ROM = MMU.UNUSED_RAM;
 }
 
+// The bioses are set up by NDS_Reset and never written afterwards, and the VRAM mapping is
+// rebuilt from the bank control registers, so neither is stored
+template<bool SAVE> bool MMU_state(EMUFILE *f)
+{
+	// main memory is only stored up to its size for the console type
+	uint32_t mainMemMask = _MMU_MAIN_MEM_MASK;
+	savestate_field<SAVE>(f, mainMemMask);
+	if (mainMemMask != _MMU_MAIN_MEM_MASK)
+		return false;
+
+	savestate_field<SAVE>(f, MMU.ARM9_ITCM);
+	savestate_field<SAVE>(f, MMU.ARM9_DTCM);
+	savestate_raw<SAVE>(f, MMU.MAIN_MEM, _MMU_MAIN_MEM_MASK + 1);
+	savestate_field<SAVE>(f, MMU.ARM9_REG);
+	savestate_field<SAVE>(f, MMU.ARM9_VMEM);
+	savestate_field<SAVE>(f, MMU.ARM9_LCD);
+	savestate_field<SAVE>(f, MMU.ARM9_OAM);
+	savestate_field<SAVE>(f, MMU.ARM7_ERAM);
+	savestate_field<SAVE>(f, MMU.ARM7_REG);
+	savestate_field<SAVE>(f, MMU.ARM7_WIRAM);
+	savestate_field<SAVE>(f, MMU.VRAM_MAP);
+	savestate_field<SAVE>(f, MMU.LCD_VRAM_ADDR);
+	savestate_field<SAVE>(f, MMU.LCDCenable);
+	savestate_field<SAVE>(f, MMU.SWIRAM);
+	savestate_field<SAVE>(f, MMU.UNUSED_RAM);
+	savestate_field<SAVE>(f, MMU.MORE_UNUSED_RAM);
+
+	savestate_field<SAVE>(f, MMU.ARM9_RW_MODE);
+	savestate_field<SAVE>(f, MMU.DTCMRegion);
+	savestate_field<SAVE>(f, MMU.ITCMRegion);
+	savestate_field<SAVE>(f, MMU.timer);
+	savestate_field<SAVE>(f, MMU.timerMODE);
+	savestate_field<SAVE>(f, MMU.timerON);
+	savestate_field<SAVE>(f, MMU.timerRUN);
+	savestate_field<SAVE>(f, MMU.timerReload);
+	savestate_field<SAVE>(f, MMU.reg_IME);
+	savestate_field<SAVE>(f, MMU.reg_IE);
+	savestate_field<SAVE>(f, MMU.reg_IF_bits);
+	savestate_field<SAVE>(f, MMU.reg_IF_pending);
+	savestate_field<SAVE>(f, MMU.divRunning);
+	savestate_field<SAVE>(f, MMU.divResult);
+	savestate_field<SAVE>(f, MMU.divMod);
+	savestate_field<SAVE>(f, MMU.divCycles);
+	savestate_field<SAVE>(f, MMU.sqrtRunning);
+	savestate_field<SAVE>(f, MMU.sqrtResult);
+	savestate_field<SAVE>(f, MMU.sqrtCycles);
+	savestate_field<SAVE>(f, MMU.SPI_CNT);
+	savestate_field<SAVE>(f, MMU.SPI_CMD);
+	savestate_field<SAVE>(f, MMU.AUX_SPI_CNT);
+	savestate_field<SAVE>(f, MMU.AUX_SPI_CMD);
+	savestate_field<SAVE>(f, MMU.WRAMCNT);
+	savestate_field<SAVE>(f, MMU.powerMan_CntReg);
+	savestate_field<SAVE>(f, MMU.powerMan_CntRegWritten);
+	savestate_field<SAVE>(f, MMU.powerMan_Reg);
+	savestate_field<SAVE>(f, MMU.fw.com);
+	savestate_field<SAVE>(f, MMU.fw.addr);
+	savestate_field<SAVE>(f, MMU.fw.addr_shift);
+	savestate_field<SAVE>(f, MMU.fw.addr_size);
+	savestate_field<SAVE>(f, MMU.fw.write_enable);
+	savestate_field<SAVE>(f, MMU.dscard);
+	savestate_field<SAVE>(f, partie);
+	savestate_field<SAVE>(f, ipc_fifo);
+
+	for (int proc = 0; proc < 2; ++proc)
+		for (int chan = 0; chan < 4; ++chan)
+		{
+			DmaController &dma = MMU_new.dma[proc][chan];
+			savestate_field<SAVE>(f, dma.enable);
+			savestate_field<SAVE>(f, dma.irq);
+			savestate_field<SAVE>(f, dma.repeatMode);
+			savestate_field<SAVE>(f, dma._startmode);
+			savestate_field<SAVE>(f, dma.userEnable);
+			savestate_field<SAVE>(f, dma.wordcount);
+			savestate_field<SAVE>(f, dma.startmode);
+			savestate_field<SAVE>(f, dma.bitWidth);
+			savestate_field<SAVE>(f, dma.sar);
+			savestate_field<SAVE>(f, dma.dar);
+			savestate_field<SAVE>(f, dma.saddr);
+			savestate_field<SAVE>(f, dma.daddr);
+			savestate_field<SAVE>(f, dma.saddr_user);
+			savestate_field<SAVE>(f, dma.daddr_user);
+			savestate_field<SAVE>(f, dma.dmaCheck);
+			savestate_field<SAVE>(f, dma.running);
+			savestate_field<SAVE>(f, dma.paused);
+			savestate_field<SAVE>(f, dma.triggered);
+			savestate_field<SAVE>(f, dma.nextEvent);
+		}
+	savestate_field<SAVE>(f, MMU_new.gxstat.tb);
+	savestate_field<SAVE>(f, MMU_new.gxstat.tr);
+	savestate_field<SAVE>(f, MMU_new.gxstat.se);
+	savestate_field<SAVE>(f, MMU_new.gxstat.sb);
+	savestate_field<SAVE>(f, MMU_new.gxstat.gxfifo_irq);
+	savestate_field<SAVE>(f, MMU_new.gxstat.fifo_empty);
+	savestate_field<SAVE>(f, MMU_new.gxstat.fifo_low);
+	savestate_field<SAVE>(f, MMU_new.sqrt.mode);
+	savestate_field<SAVE>(f, MMU_new.sqrt.busy);
+	savestate_field<SAVE>(f, MMU_new.div.mode);
+	savestate_field<SAVE>(f, MMU_new.div.busy);
+	savestate_field<SAVE>(f, MMU_new.div.div0);
+	savestate_field<SAVE>(f, MMU_timing);
+
+	if (!SAVE)
+		MMU_VRAMmapControl(0, T1ReadByte(MMU.ARM9_REG, 0x240));
+	return !f->fail();
+}
+
+template bool MMU_state<false>(EMUFILE *f);
+template bool MMU_state<true>(EMUFILE *f);
+
 static void execsqrt()
 {
 	uint32_t ret;
@@ -875,7 +1021,7 @@ static void execsqrt()
 	MMU.sqrtCycles = nds_timer + 26;
 	MMU.sqrtResult = ret;
 	MMU.sqrtRunning = true;
-	NDS_Reschedule();
+	NDS_RescheduleDivSqrt();
 }
 
 static void execdiv()
@@ -929,7 +1075,7 @@ static void execdiv()
 	MMU.divResult = res;
 	MMU.divMod = mod;
 	MMU.divRunning = true;
-	NDS_Reschedule();
+	NDS_RescheduleDivSqrt();
 }
 
 DSI_TSC::DSI_TSC()
@@ -1409,6 +1555,71 @@ void DmaController::exec()
 	}
 }
 
+// Runs as many units of a transfer as possible with host memory operations, starting at src and dst, and returns
+// how many it did (0 if the next unit has to go through the MMU). Transfers between plain RAM become memmoves with
+// one range invalidation; transfers from plain RAM to a fixed address (a fifo) still write through the MMU, but
+// read their source directly. Decrementing transfers and unaligned addresses are left to the per-unit loop.
+template<int PROCNUM> static uint32_t DMA_bulkCopy(uint32_t &src, uint32_t &dst, uint32_t srcinc, uint32_t dstinc, uint32_t sz, uint32_t todo)
+{
+	if (((src | dst) & (sz - 1)) || (srcinc && srcinc != sz) || (dstinc && dstinc != sz))
+		return 0;
+	if (!srcinc && !dstinc)
+		return 0;
+
+	uint32_t avail;
+	const uint8_t *from = MMU_hostSpan(PROCNUM, src, srcinc ? todo * sz : sz, false, avail);
+	if (!from || avail < sz)
+		return 0;
+	uint32_t n = srcinc ? avail / sz : todo;
+
+	if (dstinc)
+	{
+		uint32_t room;
+		uint8_t *to = MMU_hostSpan(PROCNUM, dst, n * sz, true, room);
+		if (!to || room < sz)
+			return 0;
+		n = std::min(n, room / sz);
+		uint32_t bytes = n * sz;
+		if (srcinc)
+		{
+			// a forward copy onto a later part of its own source repeats the first dst - src bytes,
+			// which copying in steps of that size reproduces
+			uint32_t step = bytes;
+			if (to > from && to < from + bytes)
+				step = to - from;
+			for (uint32_t ofs = 0; ofs < bytes; ofs += step)
+				std::memmove(to + ofs, from + ofs, std::min(step, bytes - ofs));
+		}
+		else if (sz == 4)
+		{
+			uint32_t val = T1ReadLong(from, 0);
+			for (uint32_t ofs = 0; ofs < bytes; ofs += 4)
+				T1WriteLong(to, ofs, val);
+		}
+		else
+		{
+			uint16_t val = T1ReadWord(from, 0);
+			for (uint32_t ofs = 0; ofs < bytes; ofs += 2)
+				T1WriteWord(to, ofs, val);
+		}
+		MMU_invalidateRange(PROCNUM, dst, bytes);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			if (sz == 4)
+				_MMU_write32(PROCNUM, MMU_AT_DMA, dst, T1ReadLong(from, i * 4));
+			else
+				_MMU_write16(PROCNUM, MMU_AT_DMA, dst, T1ReadWord(from, i * 2));
+		}
+	}
+
+	src += srcinc * n;
+	dst += dstinc * n;
+	return n;
+}
+
 template<int PROCNUM> void DmaController::doCopy()
 {
 	// generate a copy count depending on various copy mode's behavior
@@ -1477,9 +1688,15 @@ template<int PROCNUM> void DmaController::doCopy()
 	// TODO - these might be losing out a lot by not going through the templated version anymore.
 	// we might make another function to do just the raw copy op which can use them with checks
 	// outside the loop
+	// the bulk path skips _MMU_accesstime, whose result isn't used; the cost of a dma is accounted for below
 	int time_elapsed = 0;
 	for (int32_t i = todo; i > 0; --i)
 	{
+		if (uint32_t done = DMA_bulkCopy<PROCNUM>(src, dst, srcinc, dstinc, sz, i))
+		{
+			i -= done - 1;
+			continue;
+		}
 		if (sz == 4)
 		{
 			time_elapsed += _MMU_accesstime<PROCNUM, MMU_AT_DMA, 32, MMU_AD_READ, true>(src, true);
@@ -1597,6 +1814,7 @@ void FASTCALL _MMU_ARM9_write08(uint32_t adr, uint8_t val)
 #ifdef HAVE_JIT
 		JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0) = 0;
 #endif
+		decode_cache_invalidate<1>(adr);
 		T1WriteByte(MMU.ARM9_ITCM, adr & 0x7FFF, val);
 		return;
 	}
@@ -1674,7 +1892,7 @@ void FASTCALL _MMU_ARM9_write08(uint32_t adr, uint8_t val)
 				MMU_VRAMmapControl(adr - REG_VRAMCNTA, val);
 		}
 
-		MMU.MMU_MEM[ARMCPU_ARM9][adr >> 20][adr & MMU.MMU_MASK[ARMCPU_ARM9][adr >> 20]] = val;
+		*MMU_ARM9_IOptr(adr) = val;
 		return;
 	}
 
@@ -1682,6 +1900,8 @@ void FASTCALL _MMU_ARM9_write08(uint32_t adr, uint8_t val)
 	if (JIT_MAPPED(adr, ARMCPU_ARM9))
 		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 0) = 0;
 #endif
+	decode_cache_invalidate<1>(adr);
+	sampleCacheNotifyWrite(adr, 1);
 
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	MMU.MMU_MEM[ARMCPU_ARM9][adr >> 20][adr & MMU.MMU_MASK[ARMCPU_ARM9][adr >> 20]] = val;
@@ -1697,6 +1917,7 @@ void FASTCALL _MMU_ARM9_write16(uint32_t adr, uint16_t val)
 #ifdef HAVE_JIT
 		JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0) = 0;
 #endif
+		decode_cache_invalidate<2>(adr);
 		T1WriteWord(MMU.ARM9_ITCM, adr & 0x7FFF, val);
 		return;
 	}
@@ -1815,7 +2036,7 @@ void FASTCALL _MMU_ARM9_write16(uint32_t adr, uint16_t val)
 				return;
 		}
 
-		T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][adr >> 20], adr & MMU.MMU_MASK[ARMCPU_ARM9][adr >> 20], val);
+		T1WriteWord(MMU_ARM9_IOptr(adr), 0, val);
 		return;
 	}
 
@@ -1828,6 +2049,8 @@ void FASTCALL _MMU_ARM9_write16(uint32_t adr, uint16_t val)
 	if (JIT_MAPPED(adr, ARMCPU_ARM9))
 		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 0) = 0;
 #endif
+	decode_cache_invalidate<2>(adr);
+	sampleCacheNotifyWrite(adr, 2);
 
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM9][adr >> 20], adr & MMU.MMU_MASK[ARMCPU_ARM9][adr >> 20], val);
@@ -1844,6 +2067,7 @@ void FASTCALL _MMU_ARM9_write32(uint32_t adr, uint32_t val)
 		JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 0) = 0;
 		JIT_COMPILED_FUNC_KNOWNBANK(adr, ARM9_ITCM, 0x7FFF, 1) = 0;
 #endif
+		decode_cache_invalidate<4>(adr);
 		T1WriteLong(MMU.ARM9_ITCM, adr & 0x7FFF, val);
 		return;
 	}
@@ -1964,7 +2188,7 @@ void FASTCALL _MMU_ARM9_write32(uint32_t adr, uint32_t val)
 				return;
 		}
 
-		T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][adr >> 20], adr & MMU.MMU_MASK[ARMCPU_ARM9][adr >> 20], val);
+		T1WriteLong(MMU_ARM9_IOptr(adr), 0, val);
 		return;
 	}
 
@@ -1980,6 +2204,8 @@ void FASTCALL _MMU_ARM9_write32(uint32_t adr, uint32_t val)
 		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM9, 1) = 0;
 	}
 #endif
+	decode_cache_invalidate<4>(adr);
+	sampleCacheNotifyWrite(adr, 4);
 
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM9][adr >> 20], adr & MMU.MMU_MASK[ARMCPU_ARM9][adr >> 20], val);
@@ -2044,6 +2270,8 @@ uint8_t FASTCALL _MMU_ARM9_read08(uint32_t adr)
 				fprintf(stderr, "ERROR 8bit DIVCNT+3 READ\n");
 				return 0;
 		}
+
+		return *MMU_ARM9_IOptr(adr);
 	}
 
 	bool unmapped, restricted;
@@ -2114,7 +2342,7 @@ uint16_t FASTCALL _MMU_ARM9_read16(uint32_t adr)
 				return MMU.AUX_SPI_CNT;
 		}
 
-		return T1ReadWord_guaranteedAligned(MMU.MMU_MEM[ARMCPU_ARM9][adr >> 20], adr & MMU.MMU_MASK[ARMCPU_ARM9][adr >> 20]);
+		return T1ReadWord_guaranteedAligned(MMU_ARM9_IOptr(adr), 0);
 	}
 
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF
@@ -2183,7 +2411,7 @@ uint32_t FASTCALL _MMU_ARM9_read32(uint32_t adr)
 			case REG_GCDATAIN:
 				return MMU_readFromGC(ARMCPU_ARM9);
 		}
-		return T1ReadLong_guaranteedAligned(MMU.MMU_MEM[ARMCPU_ARM9][adr >> 20], adr & MMU.MMU_MASK[ARMCPU_ARM9][adr >> 20]);
+		return T1ReadLong_guaranteedAligned(MMU_ARM9_IOptr(adr), 0);
 	}
 
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [zeromus, inspired by shash]
@@ -2274,6 +2502,8 @@ void FASTCALL _MMU_ARM7_write08(uint32_t adr, uint8_t val)
 	if (JIT_MAPPED(adr, ARMCPU_ARM7))
 		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 0) = 0;
 #endif
+	decode_cache_invalidate<1>(adr);
+	sampleCacheNotifyWrite(adr, 1);
 
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	MMU.MMU_MEM[ARMCPU_ARM7][adr >> 20][adr & MMU.MMU_MASK[ARMCPU_ARM7][adr >> 20]] = val;
@@ -2575,6 +2805,8 @@ void FASTCALL _MMU_ARM7_write16(uint32_t adr, uint16_t val)
 	if (JIT_MAPPED(adr, ARMCPU_ARM7))
 		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 0) = 0;
 #endif
+	decode_cache_invalidate<2>(adr);
+	sampleCacheNotifyWrite(adr, 2);
 
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	T1WriteWord(MMU.MMU_MEM[ARMCPU_ARM7][adr >> 20], adr & MMU.MMU_MASK[ARMCPU_ARM7][adr >> 20], val);
@@ -2663,6 +2895,8 @@ void FASTCALL _MMU_ARM7_write32(uint32_t adr, uint32_t val)
 		JIT_COMPILED_FUNC_PREMASKED(adr, ARMCPU_ARM7, 1) = 0;
 	}
 #endif
+	decode_cache_invalidate<4>(adr);
+	sampleCacheNotifyWrite(adr, 4);
 
 	// Removed the &0xFF as they are implicit with the adr&0x0FFFFFFF [shash]
 	T1WriteLong(MMU.MMU_MEM[ARMCPU_ARM7][adr >> 20], adr & MMU.MMU_MASK[ARMCPU_ARM7][adr >> 20], val);
@@ -25,6 +25,8 @@
 #include "mc.h"
 #include "bits.h"
 #include "readwrite.h"
+#include "instructions.h"
+#include "../spu/samplecache.h"
 
 #ifdef HAVE_LUA
 #include "lua-engine.h"
@@ -311,7 +313,7 @@ struct MMU_struct
 	//u8 MAIN_MEM[4*1024*1024]; // expanded from 4MB to 8MB to support debug consoles
 	//u8 MAIN_MEM[8*1024*1024]; // expanded from 8MB to 16MB to support dsi
 	uint8_t MAIN_MEM[16*1024*1024]; // expanded from 8MB to 16MB to support dsi
-	uint8_t ARM9_REG[0x1000000];
+	uint8_t ARM9_REG[0x10000]; // 04000000-0400FFFF; the rest of the I/O region is decoded by address or unused
 	uint8_t ARM9_BIOS[0x8000];
 	uint8_t ARM9_VMEM[0x800];
 
@@ -448,8 +450,21 @@ struct MMU_struct_new
 	bool is_dma(uint32_t adr) { return adr >= _REG_DMA_CONTROL_MIN && adr <= _REG_DMA_CONTROL_MAX; }
 };
 
+// Host pointers to every 4KB page of plain RAM that the inline accessors below can reach
+// without going through the region handlers: shared WRAM, ARM7 exclusive WRAM and wifi RAM.
+// Main memory and the TCMs keep their own tests ahead of the table, and null pages (I/O,
+// VRAM, BIOS) take the regular path. ARM9 shared WRAM is left out since its 8-bit reads and
+// its writes are remapped through WRAMCNT, and wifi RAM is read-only here since 8-bit writes
+// to it are dropped.
+struct MMU_struct_fastmem
+{
+	uint8_t *read[2][0x10000];
+	uint8_t *write[2][0x10000];
+};
+
 extern MMU_struct MMU;
 extern MMU_struct_new MMU_new;
+extern MMU_struct_fastmem MMU_fastmem;
 
 void MMU_Init();
 void MMU_DeInit();
@@ -577,6 +592,9 @@ inline uint8_t _MMU_read08(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr)
 	if ((addr & 0x0F000000) == 0x02000000)
 		return T1ReadByte(MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK);
 
+	if (uint8_t *page = MMU_fastmem.read[PROCNUM][(addr >> 12) & 0xFFFF])
+		return T1ReadByte(page, addr & 0xFFF);
+
 	if (PROCNUM == ARMCPU_ARM9)
 		return _MMU_ARM9_read08(addr);
 	else
@@ -617,6 +635,9 @@ inline uint16_t _MMU_read16(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr)
 	if ((addr & 0x0F000000) == 0x02000000)
 		return T1ReadWord_guaranteedAligned(MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK16);
 
+	if (uint8_t *page = MMU_fastmem.read[PROCNUM][(addr >> 12) & 0xFFFF])
+		return T1ReadWord_guaranteedAligned(page, addr & 0xFFE);
+
 dunno:
 	if (PROCNUM == ARMCPU_ARM9)
 		return _MMU_ARM9_read16(addr);
@@ -672,6 +693,13 @@ inline uint32_t _MMU_read32(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr)
 			return T1ReadLong_guaranteedAligned(MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK32);
 	}
 
+	if (uint8_t *page = MMU_fastmem.read[PROCNUM][(addr >> 12) & 0xFFFF])
+		return T1ReadLong_guaranteedAligned(page, addr & 0xFFC);
+
+	// sound drivers take all of their commands through here, so skip the i/o register dispatch
+	if (addr == REG_IPCFIFORECV)
+		return IPC_FIFOrecv(PROCNUM);
+
 dunno:
 	if (PROCNUM == ARMCPU_ARM9)
 		return _MMU_ARM9_read32(addr);
@@ -704,6 +732,8 @@ inline void _MMU_write08(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr, uint8_t
 #ifdef HAVE_JIT
 		JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK, 0) = 0;
 #endif
+		decode_cache_invalidate<1>(addr);
+		sampleCacheNotifyWrite(addr, 1);
 		T1WriteByte( MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK, val);
 #ifdef HAVE_LUA
 		CallRegisteredLuaMemHook(addr, 1, val, LUAMEMHOOK_WRITE);
@@ -711,6 +741,22 @@ inline void _MMU_write08(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr, uint8_t
 		return;
 	}
 
+	if (uint8_t *page = MMU_fastmem.write[PROCNUM][(addr >> 12) & 0xFFFF])
+	{
+		uint32_t adr = addr & 0x0FFFFFFF;
+#ifdef HAVE_JIT
+		if (JIT_MAPPED(adr, PROCNUM))
+			JIT_COMPILED_FUNC_PREMASKED(adr, PROCNUM, 0) = 0;
+#endif
+		decode_cache_invalidate<1>(adr);
+		sampleCacheNotifyWrite(adr, 1);
+		T1WriteByte(page, adr & 0xFFF, val);
+#ifdef HAVE_LUA
+		CallRegisteredLuaMemHook(addr, 1, val, LUAMEMHOOK_WRITE);
+#endif
+		return;
+	}
+
 	if (PROCNUM == ARMCPU_ARM9)
 		_MMU_ARM9_write08(addr, val);
 	else
@@ -745,6 +791,8 @@ inline void _MMU_write16(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr, uint16_
 #ifdef HAVE_JIT
 		JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK16, 0) = 0;
 #endif
+		decode_cache_invalidate<2>(addr);
+		sampleCacheNotifyWrite(addr, 2);
 		T1WriteWord( MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK16, val);
 #ifdef HAVE_LUA
 		CallRegisteredLuaMemHook(addr, 2, val, LUAMEMHOOK_WRITE);
@@ -752,6 +800,22 @@ inline void _MMU_write16(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr, uint16_
 		return;
 	}
 
+	if (uint8_t *page = MMU_fastmem.write[PROCNUM][(addr >> 12) & 0xFFFF])
+	{
+		uint32_t adr = addr & 0x0FFFFFFE;
+#ifdef HAVE_JIT
+		if (JIT_MAPPED(adr, PROCNUM))
+			JIT_COMPILED_FUNC_PREMASKED(adr, PROCNUM, 0) = 0;
+#endif
+		decode_cache_invalidate<2>(adr);
+		sampleCacheNotifyWrite(adr, 2);
+		T1WriteWord(page, adr & 0xFFE, val);
+#ifdef HAVE_LUA
+		CallRegisteredLuaMemHook(addr, 2, val, LUAMEMHOOK_WRITE);
+#endif
+		return;
+	}
+
 	if (PROCNUM == ARMCPU_ARM9)
 		_MMU_ARM9_write16(addr, val);
 	else
@@ -787,6 +851,8 @@ inline void _MMU_write32(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr, uint32_
 		JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK32, 0) = 0;
 		JIT_COMPILED_FUNC_KNOWNBANK(addr, MAIN_MEM, _MMU_MAIN_MEM_MASK32, 1) = 0;
 #endif
+		decode_cache_invalidate<4>(addr);
+		sampleCacheNotifyWrite(addr, 4);
 		T1WriteLong( MMU.MAIN_MEM, addr & _MMU_MAIN_MEM_MASK32, val);
 #ifdef HAVE_LUA
 		CallRegisteredLuaMemHook(addr, 4, val, LUAMEMHOOK_WRITE);
@@ -794,7 +860,28 @@ inline void _MMU_write32(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr, uint32_
 		return;
 	}
 
-	if (PROCNUM == ARMCPU_ARM9)
+	if (uint8_t *page = MMU_fastmem.write[PROCNUM][(addr >> 12) & 0xFFFF])
+	{
+		uint32_t adr = addr & 0x0FFFFFFC;
+#ifdef HAVE_JIT
+		if (JIT_MAPPED(adr, PROCNUM))
+		{
+			JIT_COMPILED_FUNC_PREMASKED(adr, PROCNUM, 0) = 0;
+			JIT_COMPILED_FUNC_PREMASKED(adr, PROCNUM, 1) = 0;
+		}
+#endif
+		decode_cache_invalidate<4>(adr);
+		sampleCacheNotifyWrite(adr, 4);
+		T1WriteLong(page, adr & 0xFFC, val);
+#ifdef HAVE_LUA
+		CallRegisteredLuaMemHook(addr, 4, val, LUAMEMHOOK_WRITE);
+#endif
+		return;
+	}
+
+	if (addr == REG_IPCFIFOSEND)
+		IPC_FIFOsend(PROCNUM, val);
+	else if (PROCNUM == ARMCPU_ARM9)
 		_MMU_ARM9_write32(addr, val);
 	else
 		_MMU_ARM7_write32(addr, val);
@@ -803,6 +890,58 @@ inline void _MMU_write32(int PROCNUM, MMU_ACCESS_TYPE AT, uint32_t addr, uint32_
 #endif
 }
 
+// Does what plain memory writes to [addr, addr + size) would have invalidated one access at a time:
+// compiled JIT blocks, predecoded opcodes and decoded SPU samples. For callers that write RAM in bulk
+// through host pointers.
+inline void MMU_invalidateRange(int PROCNUM, uint32_t addr, uint32_t size)
+{
+	uint32_t adr = addr & 0x0FFFFFFE;
+#ifdef HAVE_JIT
+	for (uint32_t ofs = 0; ofs < size + (addr & 1); ofs += 2)
+		if (JIT_MAPPED(adr + ofs, PROCNUM))
+			JIT_COMPILED_FUNC_PREMASKED(adr + ofs, PROCNUM, 0) = 0;
+#endif
+	decode_cache_invalidate_range(addr & 0x0FFFFFFF, size);
+	sampleCacheNotifyWriteRange(addr & 0x0FFFFFFF, size);
+}
+
+// Host pointer to as much of [addr, addr + size) as is contiguous plain RAM for PROCNUM, the length of which
+// is stored in avail, or nullptr when addr itself isn't plain RAM. Nothing is invalidated for writes through it.
+inline uint8_t *MMU_hostSpan(int PROCNUM, uint32_t addr, uint32_t size, bool write, uint32_t &avail)
+{
+	uint8_t *host = nullptr;
+	avail = 0;
+	if (!size)
+		return nullptr;
+	if (PROCNUM == ARMCPU_ARM9 && (addr & ~0x3FFF) == MMU.DTCMRegion)
+		return nullptr;
+	if ((addr & 0x0F000000) == 0x02000000)
+	{
+		uint32_t ofs = addr & _MMU_MAIN_MEM_MASK;
+		host = MMU.MAIN_MEM + ofs;
+		avail = std::min(size, _MMU_MAIN_MEM_MASK + 1 - ofs);
+	}
+	else
+	{
+		uint8_t *const *pages = write ? MMU_fastmem.write[PROCNUM] : MMU_fastmem.read[PROCNUM];
+		uint32_t page = (addr >> 12) & 0xFFFF;
+		if (!pages[page])
+			return nullptr;
+		host = pages[page] + (addr & 0xFFF);
+		avail = 0x1000 - (addr & 0xFFF);
+		while (avail < size && page + 1 < 0x10000 && pages[page + 1] == pages[page] + 0x1000)
+		{
+			++page;
+			avail += 0x1000;
+		}
+		avail = std::min(avail, size);
+	}
+	// dtcm is patched on top of main memory for the arm9
+	if (PROCNUM == ARMCPU_ARM9 && addr < MMU.DTCMRegion && addr + avail > MMU.DTCMRegion)
+		avail = MMU.DTCMRegion - addr;
+	return host;
+}
+
 #define READ32(a,b)		_MMU_read32<PROCNUM>((b) & 0xFFFFFFFC)
 #define WRITE32(a,b,c)	_MMU_write32<PROCNUM>((b) & 0xFFFFFFFC,c)
 #define READ16(a,b)		_MMU_read16<PROCNUM>((b) & 0xFFFFFFFE)
@@ -29,6 +29,7 @@
 #include "firmware.h"
 #include "version.h"
 #include "slot1.h"
+#include "saveStates.h"
 
 // ===============================================================
 
@@ -140,7 +141,7 @@ RomBanner::RomBanner(bool defaultInit)
 
 void NDS_FreeROM()
 {
-	if (MMU.CART_ROM == reinterpret_cast<uint8_t *>(&gameInfo.romdata[0]))
+	if (MMU.CART_ROM == reinterpret_cast<uint8_t *>(gameInfo.romdata.get()))
 		gameInfo.romdata.reset();
 	if (MMU.CART_ROM != MMU.UNUSED_RAM)
 		delete [] MMU.CART_ROM;
@@ -325,10 +326,104 @@ struct TSequenceItem_sqrtunit : public TSequenceItem
 	}
 };
 
+// Every event the sequencer can wait on has a fixed slot in the queue below
+enum ESequencerSlot
+{
+	ESS_DISPCNT, ESS_DIVIDER, ESS_SQRTUNIT,
+	ESS_DMA_0_0, ESS_DMA_0_1, ESS_DMA_0_2, ESS_DMA_0_3,
+	ESS_DMA_1_0, ESS_DMA_1_1, ESS_DMA_1_2, ESS_DMA_1_3,
+	ESS_TIMER_0_0, ESS_TIMER_0_1, ESS_TIMER_0_2, ESS_TIMER_0_3,
+	ESS_TIMER_1_0, ESS_TIMER_1_1, ESS_TIMER_1_2, ESS_TIMER_1_3,
+	ESS_COUNT
+};
+
+static const uint64_t kSequenceDisabled = ~static_cast<uint64_t>(0);
+
+// Indexed binary min-heap keyed on the time each slot fires next (kSequenceDisabled when it won't).
+// pos[] tracks where each slot sits in the heap, so moving a single event is one sift
+// instead of a rescan of every timer and DMA channel.
+struct TSequenceQueue
+{
+	uint64_t key[ESS_COUNT];
+	uint8_t heap[ESS_COUNT];
+	uint8_t pos[ESS_COUNT];
+
+	TSequenceQueue()
+	{
+		this->clear();
+	}
+
+	void clear()
+	{
+		for (int i = 0; i < ESS_COUNT; ++i)
+		{
+			this->key[i] = kSequenceDisabled;
+			this->heap[i] = this->pos[i] = i;
+		}
+	}
+
+	uint64_t top() const
+	{
+		return this->key[this->heap[0]];
+	}
+
+	void update(int slot, uint64_t when)
+	{
+		uint64_t old = this->key[slot];
+		if (old == when)
+			return;
+		this->key[slot] = when;
+		if (when < old)
+			this->siftUp(this->pos[slot]);
+		else
+			this->siftDown(this->pos[slot]);
+	}
+
+private:
+	void place(int i, uint8_t slot)
+	{
+		this->heap[i] = slot;
+		this->pos[slot] = i;
+	}
+
+	void siftUp(int i)
+	{
+		uint8_t slot = this->heap[i];
+		while (i)
+		{
+			int parent = (i - 1) >> 1;
+			if (this->key[this->heap[parent]] <= this->key[slot])
+				break;
+			this->place(i, this->heap[parent]);
+			i = parent;
+		}
+		this->place(i, slot);
+	}
+
+	void siftDown(int i)
+	{
+		uint8_t slot = this->heap[i];
+		for (;;)
+		{
+			int child = (i << 1) + 1;
+			if (child >= ESS_COUNT)
+				break;
+			if (child + 1 < ESS_COUNT && this->key[this->heap[child + 1]] < this->key[this->heap[child]])
+				++child;
+			if (this->key[slot] <= this->key[this->heap[child]])
+				break;
+			this->place(i, this->heap[child]);
+			i = child;
+		}
+		this->place(i, slot);
+	}
+};
+
 static struct Sequencer
 {
 	bool nds_vblankEnded;
 	bool reschedule;
+	TSequenceQueue queue;
 	TSequenceItem dispcnt;
 	TSequenceItem wifi;
 	TSequenceItem_divider divider;
@@ -347,6 +442,37 @@ static struct Sequencer
 
 	void execHardware();
 	uint64_t findNext();
+
+	// these push the current state of the event(s) into the queue,
+	// and must be called whenever that state changes
+	void queueDispcnt()
+	{
+		this->queue.update(ESS_DISPCNT, this->dispcnt.timestamp);
+	}
+
+	void queueDivSqrt()
+	{
+		this->queue.update(ESS_DIVIDER, this->divider.isEnabled() ? this->divider.next() : kSequenceDisabled);
+		this->queue.update(ESS_SQRTUNIT, this->sqrtunit.isEnabled() ? this->sqrtunit.next() : kSequenceDisabled);
+	}
+
+	void queueDMA()
+	{
+#define check(X, Y) \
+	this->queue.update(ESS_DMA_##X##_##Y, this->dma_##X##_##Y .controller && this->dma_##X##_##Y .isEnabled() ? this->dma_##X##_##Y .next() : kSequenceDisabled);
+		check(0, 0); check(0, 1); check(0, 2); check(0, 3);
+		check(1, 0); check(1, 1); check(1, 2); check(1, 3);
+#undef check
+	}
+
+	void queueTimers()
+	{
+#define check(X, Y) \
+	this->queue.update(ESS_TIMER_##X##_##Y, this->timer_##X##_##Y .enabled ? this->timer_##X##_##Y .next() : kSequenceDisabled);
+		check(0, 0); check(0, 1); check(0, 2); check(0, 3);
+		check(1, 0); check(1, 1); check(1, 2); check(1, 3);
+#undef check
+	}
 } sequencer;
 
 void NDS_RescheduleTimers()
@@ -355,13 +481,20 @@ void NDS_RescheduleTimers()
 	check(0, 0); check(0, 1); check(0, 2); check(0, 3);
 	check(1, 0); check(1, 1); check(1, 2); check(1, 3);
 #undef check
+	sequencer.queueTimers();
 
 	NDS_Reschedule();
 }
 
 void NDS_RescheduleDMA()
 {
-	//TBD
+	sequencer.queueDMA();
+	NDS_Reschedule();
+}
+
+void NDS_RescheduleDivSqrt()
+{
+	sequencer.queueDivSqrt();
 	NDS_Reschedule();
 }
 
@@ -386,8 +519,20 @@ static void initSchedule()
 
 void Sequencer::init()
 {
+	this->queue.clear();
+
+	this->dma_0_0.controller = &MMU_new.dma[0][0];
+	this->dma_0_1.controller = &MMU_new.dma[0][1];
+	this->dma_0_2.controller = &MMU_new.dma[0][2];
+	this->dma_0_3.controller = &MMU_new.dma[0][3];
+	this->dma_1_0.controller = &MMU_new.dma[1][0];
+	this->dma_1_1.controller = &MMU_new.dma[1][1];
+	this->dma_1_2.controller = &MMU_new.dma[1][2];
+	this->dma_1_3.controller = &MMU_new.dma[1][3];
+
 	NDS_RescheduleTimers();
 	NDS_RescheduleDMA();
+	NDS_RescheduleDivSqrt();
 
 	this->reschedule = false;
 	nds_timer = 0;
@@ -397,15 +542,7 @@ void Sequencer::init()
 	this->dispcnt.enabled = true;
 	this->dispcnt.param = ESI_DISPCNT_HStart;
 	this->dispcnt.timestamp = 0;
-
-	this->dma_0_0.controller = &MMU_new.dma[0][0];
-	this->dma_0_1.controller = &MMU_new.dma[0][1];
-	this->dma_0_2.controller = &MMU_new.dma[0][2];
-	this->dma_0_3.controller = &MMU_new.dma[0][3];
-	this->dma_1_0.controller = &MMU_new.dma[1][0];
-	this->dma_1_1.controller = &MMU_new.dma[1][1];
-	this->dma_1_2.controller = &MMU_new.dma[1][2];
-	this->dma_1_3.controller = &MMU_new.dma[1][3];
+	this->queueDispcnt();
 }
 
 static void execHardware_hblank()
@@ -603,32 +740,16 @@ static inline uint64_t _fast_min(uint64_t a, uint64_t b)
 
 uint64_t Sequencer::findNext()
 {
-	// this one is always enabled so dont bother to check it
-	uint64_t next = this->dispcnt.next();
-
-	if (this->divider.isEnabled())
-		next = _fast_min(next, this->divider.next());
-	if (this->sqrtunit.isEnabled())
-		next = _fast_min(next, this->sqrtunit.next());
-
-#define test(X, Y) \
-	if (this->dma_##X##_##Y .isEnabled()) \
-		next = _fast_min(next, this->dma_##X##_##Y .next());
-	test(0, 0); test(0, 1); test(0, 2); test(0, 3);
-	test(1, 0); test(1, 1); test(1, 2); test(1, 3);
-#undef test
-#define test(X, Y) \
-	if (this->timer_##X##_##Y .enabled) \
-		next = _fast_min(next, this->timer_##X##_##Y .next());
-	test(0, 0); test(0, 1); test(0, 2); test(0, 3);
-	test(1, 0); test(1, 1); test(1, 2); test(1, 3);
-#undef test
-
-	return next;
+	// dispcnt is always queued, so the top of the heap is never disabled
+	return this->queue.top();
 }
 
 void Sequencer::execHardware()
 {
+	// nothing is due yet
+	if (this->queue.top() > nds_timer)
+		return;
+
 	if (this->dispcnt.isTriggered())
 	{
 		switch (this->dispcnt.param)
@@ -660,22 +781,36 @@ void Sequencer::execHardware()
 				this->dispcnt.timestamp += 1056;
 				this->dispcnt.param = ESI_DISPCNT_HStart;
 		}
+		this->queueDispcnt();
 	}
 
 	if (this->divider.isTriggered())
+	{
 		this->divider.exec();
+		this->queueDivSqrt();
+	}
 	if (this->sqrtunit.isTriggered())
+	{
 		this->sqrtunit.exec();
+		this->queueDivSqrt();
+	}
 
+	// a dma's completion time is only settled once exec (and doCopy within it) returns
 #define test(X, Y) \
 	if (this->dma_##X##_##Y .isTriggered()) \
-		this->dma_##X##_##Y .exec();
+	{ \
+		this->dma_##X##_##Y .exec(); \
+		this->queue.update(ESS_DMA_##X##_##Y, this->dma_##X##_##Y .isEnabled() ? this->dma_##X##_##Y .next() : kSequenceDisabled); \
+	}
 	test(0, 0); test(0, 1); test(0, 2); test(0, 3);
 	test(1, 0); test(1, 1); test(1, 2); test(1, 3);
 #undef test
 #define test(X, Y) \
 	if (this->timer_##X##_##Y .enabled && this->timer_##X##_##Y .isTriggered()) \
-		this->timer_##X##_##Y .exec();
+	{ \
+		this->timer_##X##_##Y .exec(); \
+		this->queue.update(ESS_TIMER_##X##_##Y, this->timer_##X##_##Y .next()); \
+	}
 	test(0, 0); test(0, 1); test(0, 2); test(0, 3);
 	test(1, 0); test(1, 1); test(1, 2); test(1, 3);
 #undef test
@@ -755,7 +890,60 @@ static std::pair<int32_t, int32_t> armInnerLoop(uint64_t nds_timer_base, int32_t
 	return std::make_pair(arm9, arm7);
 }
 
-template<bool FORCE> void NDS_exec(int32_t)
+// armInnerLoop with a skew budget: the cpu that is behind runs until it is skew cycles ahead of
+// the other (or reaches the next event) before they switch, so each keeps its code hot for longer.
+// Which cpu runs is decided by cycle counts alone, so the result is the same on every run for a
+// given skew. Anything that reschedules, IPC sync and FIFO traffic included, ends the budget, but
+// plain memory the cpus share (main memory and shared WRAM) can be seen up to skew cycles early.
+#ifdef HAVE_JIT
+template<int PROCNUM, bool jit>
+#else
+template<int PROCNUM>
+#endif
+static inline int32_t armRunAhead(uint64_t nds_timer_base, int32_t cycles, int32_t other, int32_t skew, int32_t s32next)
+{
+	armcpu_t &cpu = PROCNUM == ARMCPU_ARM9 ? NDS_ARM9 : NDS_ARM7;
+	int32_t limit = std::min(s32next, other + skew);
+	do
+	{
+		if (cpu.waitIRQ || nds.freezeBus)
+			// the other cpu may be the one to raise the irq
+			return std::min(s32next, cycles + kIrqWait);
+#ifdef HAVE_JIT
+		cycles += armcpu_exec<PROCNUM, jit>() << PROCNUM;
+#else
+		cycles += armcpu_exec<PROCNUM>() << PROCNUM;
+#endif
+		nds_timer = nds_timer_base + std::min(cycles, other);
+	} while (cycles <= limit && !sequencer.reschedule && execute);
+	return cycles;
+}
+
+#ifdef HAVE_JIT
+template<bool jit>
+#endif
+static std::pair<int32_t, int32_t> armInnerLoopSkewed(uint64_t nds_timer_base, int32_t s32next, int32_t arm9, int32_t arm7, int32_t skew)
+{
+	while (std::min(arm9, arm7) < s32next && !sequencer.reschedule && execute)
+	{
+#ifdef HAVE_JIT
+		if (arm9 <= arm7)
+			arm9 = armRunAhead<ARMCPU_ARM9, jit>(nds_timer_base, arm9, arm7, skew, s32next);
+		else
+			arm7 = armRunAhead<ARMCPU_ARM7, jit>(nds_timer_base, arm7, arm9, skew, s32next);
+#else
+		if (arm9 <= arm7)
+			arm9 = armRunAhead<ARMCPU_ARM9>(nds_timer_base, arm9, arm7, skew, s32next);
+		else
+			arm7 = armRunAhead<ARMCPU_ARM7>(nds_timer_base, arm7, arm9, skew, s32next);
+#endif
+		nds_timer = nds_timer_base + std::min(arm9, arm7);
+	}
+
+	return std::make_pair(arm9, arm7);
+}
+
+template<bool UNTIL_OUTPUT> static void execLoop()
 {
 	sequencer.nds_vblankEnded = false;
 
@@ -776,6 +964,9 @@ template<bool FORCE> void NDS_exec(int32_t)
 			// break out once per frame
 			if (sequencer.nds_vblankEnded)
 				break;
+			// or as soon as the hblank that filled the output span has run
+			if (UNTIL_OUTPUT && SPU_OutputSpanFull())
+				break;
 			// it should be benign to execute execHardware in the next frame,
 			// since there won't be anything for it to do (everything should be scheduled in the future)
 
@@ -799,10 +990,18 @@ template<bool FORCE> void NDS_exec(int32_t)
 			int32_t arm7 = (nds_arm7_timer - nds_timer) & 0xFFFFFFFF;
 			int32_t s32next = (next - nds_timer) & 0xFFFFFFFF;
 
+			std::pair<int32_t, int32_t> arm9arm7;
+			int32_t skew = std::min<uint32_t>(CommonSettings.cpu_skew, kMaxWork);
 #ifdef HAVE_JIT
-			auto arm9arm7 = CommonSettings.use_jit ? armInnerLoop<true, true, true>(nds_timer_base, s32next, arm9, arm7) : armInnerLoop<true, true, false>(nds_timer_base, s32next, arm9, arm7);
+			if (skew)
+				arm9arm7 = CommonSettings.use_jit ? armInnerLoopSkewed<true>(nds_timer_base, s32next, arm9, arm7, skew) : armInnerLoopSkewed<false>(nds_timer_base, s32next, arm9, arm7, skew);
+			else
+				arm9arm7 = CommonSettings.use_jit ? armInnerLoop<true, true, true>(nds_timer_base, s32next, arm9, arm7) : armInnerLoop<true, true, false>(nds_timer_base, s32next, arm9, arm7);
 #else
-			auto arm9arm7 = armInnerLoop<true, true>(nds_timer_base, s32next, arm9, arm7);
+			if (skew)
+				arm9arm7 = armInnerLoopSkewed(nds_timer_base, s32next, arm9, arm7, skew);
+			else
+				arm9arm7 = armInnerLoop<true, true>(nds_timer_base, s32next, arm9, arm7);
 #endif
 
 			arm9 = arm9arm7.first;
@@ -820,6 +1019,17 @@ template<bool FORCE> void NDS_exec(int32_t)
 	}
 }
 
+template<bool FORCE> void NDS_exec(int32_t)
+{
+	execLoop<false>();
+}
+
+bool NDS_execUntilOutputFull()
+{
+	execLoop<true>();
+	return SPU_OutputSpanFull();
+}
+
 template<int PROCNUM> static void execHardware_interrupts_core()
 {
 	uint32_t IF = MMU.gen_IF<PROCNUM>();
@@ -1186,6 +1396,55 @@ void NDS_Reset()
 	SPU_ReInit();
 }
 
+// the event queue isn't stored; only its top matters, so it's rebuilt from the events on load
+template<bool SAVE> bool NDS_state(EMUFILE *f)
+{
+	int consoleType = nds.ConsoleType;
+	savestate_field<SAVE>(f, consoleType);
+	if (consoleType != nds.ConsoleType)
+		return false;
+
+	savestate_field<SAVE>(f, nds.cycles);
+	savestate_field<SAVE>(f, nds.timerCycle);
+	savestate_field<SAVE>(f, nds.VCount);
+	savestate_field<SAVE>(f, nds.old);
+	savestate_field<SAVE>(f, nds.sleeping);
+	savestate_field<SAVE>(f, nds.cardEjected);
+	savestate_field<SAVE>(f, nds.freezeBus);
+	savestate_field<SAVE>(f, nds_timer);
+	savestate_field<SAVE>(f, nds_arm9_timer);
+	savestate_field<SAVE>(f, nds_arm7_timer);
+
+	savestate_field<SAVE>(f, sequencer.nds_vblankEnded);
+	savestate_field<SAVE>(f, sequencer.reschedule);
+	TSequenceItem *items[] =
+	{
+		&sequencer.dispcnt, &sequencer.wifi, &sequencer.divider, &sequencer.sqrtunit, &sequencer.gxfifo,
+		&sequencer.dma_0_0, &sequencer.dma_0_1, &sequencer.dma_0_2, &sequencer.dma_0_3,
+		&sequencer.dma_1_0, &sequencer.dma_1_1, &sequencer.dma_1_2, &sequencer.dma_1_3,
+		&sequencer.timer_0_0, &sequencer.timer_0_1, &sequencer.timer_0_2, &sequencer.timer_0_3,
+		&sequencer.timer_1_0, &sequencer.timer_1_1, &sequencer.timer_1_2, &sequencer.timer_1_3
+	};
+	for (auto item : items)
+	{
+		savestate_field<SAVE>(f, item->timestamp);
+		savestate_field<SAVE>(f, item->param);
+		savestate_field<SAVE>(f, item->enabled);
+	}
+
+	if (!SAVE)
+	{
+		sequencer.queue.clear();
+		sequencer.queueDispcnt();
+		sequencer.queueDivSqrt();
+		sequencer.queueDMA();
+		sequencer.queueTimers();
+	}
+	return !f->fail();
+}
+
 // these templates needed to be instantiated manually
+template bool NDS_state<false>(EMUFILE *f);
+template bool NDS_state<true>(EMUFILE *f);
 template void NDS_exec<false>(int32_t nb);
 template void NDS_exec<true>(int32_t nb);
@@ -114,6 +114,7 @@ extern uint64_t nds_timer;
 void NDS_Reschedule();
 void NDS_RescheduleDMA();
 void NDS_RescheduleTimers();
+void NDS_RescheduleDivSqrt();
 
 enum NDS_CONSOLE_TYPE
 {
@@ -221,15 +222,19 @@ struct GameInfo
 		memset(&this->romdata[this->romsize], 0xFF, this->allocatedSize - this->romsize);
 	}
 
+	// For a rom the caller keeps (see NDS_SetROM), with at least 3 bytes readable past size: slot-1
+	// reads are wrapped with the mask and served from it directly, past size they read as 0xFF
+	void useExternalData(uint32_t size)
+	{
+		this->romdata.reset();
+		this->allocatedSize = 0;
+		this->setMask(size);
+		this->romsize = size;
+	}
+
 	void resize(int size)
 	{
-		// calculate the necessary mask for the requested size
-		mask = size - 1;
-		mask |= mask >> 1;
-		mask |= mask >> 2;
-		mask |= mask >> 4;
-		mask |= mask >> 8;
-		mask |= mask >> 16;
+		this->setMask(size);
 
 		// now, we actually need to over-allocate, because bytes from anywhere protected by that mask
 		// could be read from the rom
@@ -238,6 +243,17 @@ struct GameInfo
 		this->romdata.reset(new char[allocatedSize]);
 		this->romsize = size;
 	}
+
+	void setMask(uint32_t size)
+	{
+		// calculate the necessary mask for the requested size
+		mask = size - 1;
+		mask |= mask >> 1;
+		mask |= mask >> 2;
+		mask |= mask >> 4;
+		mask |= mask >> 8;
+		mask |= mask >> 16;
+	}
 	uint32_t crc;
 	NDS_header header;
 	char ROMserial[20];
@@ -279,11 +295,15 @@ void NDS_Sleep();
 void execHardware_doAllDma(EDMAMode modeNum);
 
 template<bool FORCE> void NDS_exec(int32_t nb = 560190 << 1);
+// Like NDS_exec, but also returns as soon as the SPU output span (SPU_SetOutputSpan) is full,
+// so a request costs only the scanlines it needs. Returns whether the span is full.
+bool NDS_execUntilOutputFull();
 
 extern struct TCommonSettings
 {
 	TCommonSettings() : UseExtBIOS(false), SWIFromBIOS(false), PatchSWI3(false), UseExtFirmware(false), BootFromFirmware(false), ConsoleType(NDS_CONSOLE_TYPE_FAT), rigorous_timing(false), advanced_timing(true),
-		spuInterpolationMode(SPUInterpolation_Linear), manualBackupType(0), spu_captureMuted(false), spu_advanced(false)
+		jit_max_block_size(0), spuInterpolationMode(SPUInterpolation_Linear), manualBackupType(0), spu_captureMuted(false), spu_advanced(false),
+		spu_sampleCacheBudget(64 << 20), spu_fixedPointCounters(!!SPU_FIXED_POINT_COUNTERS), nitroComposerHLE(false), cpu_skew(0)
 	{
 		strcpy(this->ARM9BIOS, "biosnds9.bin");
 		strcpy(this->ARM7BIOS, "biosnds7.bin");
@@ -326,6 +346,14 @@ extern struct TCommonSettings
 #else
 		this->use_jit = false;
 #endif
+		const char *statsVal = getenv("JIT_STATS_2SF");
+		this->jit_stats = statsVal && statsVal[0] == '1';
+		const char *fixedVal = getenv("SPU_FIXED_2SF");
+		if (fixedVal)
+			this->spu_fixedPointCounters = fixedVal[0] == '1';
+		const char *skewVal = getenv("CPU_SKEW_2SF");
+		if (skewVal)
+			this->cpu_skew = strtoul(skewVal, nullptr, 10);
 	}
 
 	bool UseExtBIOS;
@@ -346,7 +374,10 @@ extern struct TCommonSettings
 	bool advanced_timing;
 
 	bool use_jit;
+	// 0 picks the block size automatically (short blocks, with hot ones recompiled longer)
 	uint32_t jit_max_block_size;
+	// collect per-block and interpreter fallback statistics, reported at arm_jit_close
+	bool jit_stats;
 
 	SPUInterpolationMode spuInterpolationMode;
 
@@ -356,4 +387,15 @@ extern struct TCommonSettings
 	bool spu_muteChannels[16];
 	bool spu_captureMuted;
 	bool spu_advanced;
+	// bytes of decoded sample data kept before least recently used samples are dropped
+	size_t spu_sampleCacheBudget;
+	// track SPU sample positions in 32.32 fixed point (SPU_FIXED_2SF=0/1 overrides the build default)
+	bool spu_fixedPointCounters;
+	// play sequences of the standard NitroComposer driver with the native SSEQ player when they can
+	// be found in the rom, emulating only until the ARM9 starts one (a _2sf_hle tag overrides this)
+	bool nitroComposerHLE;
+	// experimental: ARM9 cycles either cpu may run ahead of the other before they switch, rather than
+	// switching every instruction (0). Output only depends on the value (CPU_SKEW_2SF=n or a _2sf_skew
+	// tag overrides it), and events and IPC traffic still bring the cpus back together.
+	uint32_t cpu_skew;
 } CommonSettings;
@@ -31,6 +31,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <queue>
 #include <vector>
 
@@ -41,6 +42,7 @@
 #include "armcpu.h"
 #include "NDSSystem.h"
 #include "emufile.h"
+#include "saveStates.h"
 #include "matrix.h"
 #include "utils/bits.h"
 
@@ -54,9 +56,16 @@ static inline s8 read_s8(u32 addr) { return (s8)_MMU_read08<ARMCPU_ARM7,MMU_AT_D
 SPU_struct *SPU_core = 0;
 int SPU_currentCoreNum = SNDCORE_DUMMY;
 static int volume = 100;
-static SampleCache sampleCache;
 
 static size_t buffersize = 0;
+static SPU_StemSink stemSink = NULL;
+static void *stemContext = NULL;
+static std::vector<s32> stemMix; //per sample: 16 channels of L,R before master volume
+static std::vector<s16> stemOut;
+static bool directOutput = false;
+static s16 *outputSpan = NULL;
+static u32 outputSpanSize = 0, outputSpanFilled = 0;
+static std::vector<s16> outputSpill; //samples mixed past the end of the last span
 static ESynchMode synchmode = ESynchMode_Synchronous;
 static ESynchMethod synchmethod = ESynchMethod_0;
 static ISynchronizingAudioBuffer* synchronizer = metaspu_construct(synchmethod);
@@ -99,10 +108,14 @@ static const double ARM7_CLOCK = 33513982;
 double DESMUME_SAMPLE_RATE = 32728.498;
 static double samples_per_hline = (DESMUME_SAMPLE_RATE / 59.8261f) / 263.0f;
 static double sampleLength = DESMUME_SAMPLE_RATE / 32728.498;
+//SPU timer ticks (half the ARM7 clock) per output sample, in 32.32 fixed point.
+//a channel's step is this divided by its timer period, see adjust_channel_timer
+static u64 timerTicksPerSampleFixed = (u64)(ARM7_CLOCK / (DESMUME_SAMPLE_RATE * 2) * 4294967296.0 + 0.5);
 
 void SetDesmumeSampleRate(double rate) {
   DESMUME_SAMPLE_RATE = rate;
   sampleLength = DESMUME_SAMPLE_RATE / 32728.498;
+  timerTicksPerSampleFixed = (u64)(ARM7_CLOCK / (DESMUME_SAMPLE_RATE * 2) * 4294967296.0 + 0.5);
   samples_per_hline = (DESMUME_SAMPLE_RATE / 59.8261f) / 263.0f;
   for (int i = 0; i < 16; i++) {
     channel_struct *chan = &SPU_core->channels[i];
@@ -242,6 +255,9 @@ void SPU_Reset(void)
 
   SPU_core->reset();
 
+  sampleCache.clear();
+  sampleCache.setBudget(CommonSettings.spu_sampleCacheBudget);
+
   //zero - 09-apr-2010: this concerns me, regarding savestate synch.
   //After 0.9.6, lets experiment with removing it and just properly zapping the spu instead
   // Reset Registers
@@ -251,6 +267,31 @@ void SPU_Reset(void)
   samples = 0;
 }
 
+// sndbuf and outbuf only live for one hline, so they aren't stored; samples mixed past the end
+// of the last output span are, as the next span starts with them
+template<bool SAVE> bool SPU_state(EMUFILE *f)
+{
+  savestate_field<SAVE>(f, SPU_core->bufpos);
+  savestate_field<SAVE>(f, SPU_core->buflength);
+  savestate_field<SAVE>(f, SPU_core->lastdata);
+  savestate_field<SAVE>(f, SPU_core->fixedCounters);
+  savestate_field<SAVE>(f, SPU_core->regs);
+  for (int i = 0; i < 16; i++)
+  {
+    channel_struct &chan = SPU_core->channels[i];
+    savestate_field<SAVE>(f, chan);
+    // the mixer rebinds it from the sample cache
+    if (!SAVE)
+      chan.sample = NULL;
+  }
+  savestate_field<SAVE>(f, samples);
+  savestate_vector<SAVE>(f, outputSpill);
+  return !f->fail();
+}
+
+template bool SPU_state<false>(EMUFILE *f);
+template bool SPU_state<true>(EMUFILE *f);
+
 //------------------------------------------
 
 void SPU_struct::reset()
@@ -262,6 +303,8 @@ void SPU_struct::reset()
 
   reconstruct(&regs);
 
+  fixedCounters = CommonSettings.spu_fixedPointCounters;
+
   for(int i = 0; i < 16; i++)
   {
     channels[i].num = i;
@@ -306,6 +349,15 @@ void SPU_struct::ShutUp()
 static FORCEINLINE void adjust_channel_timer(channel_struct *chan)
 {
   chan->sampinc = (((double)ARM7_CLOCK) / (DESMUME_SAMPLE_RATE * 2)) / (double)(0x10000 - chan->timer);
+  const u32 period = 0x10000 - chan->timer;
+  chan->sampincFixed = (s64)((timerTicksPerSampleFixed + period / 2) / period);
+}
+
+static FORCEINLINE const SampleData *bind_channel_sample(channel_struct *chan, int format)
+{
+  chan->sample = &sampleCache.getSample(chan->addr, chan->loopstart, chan->length, SampleData::Format(format));
+  chan->sampleGeneration = sampleCache.generation();
+  return chan->sample;
 }
 
 void SPU_struct::KeyProbe(int chan_num)
@@ -365,13 +417,21 @@ void SPU_struct::KeyOn(int channel)
   }
 
   thischan.double_totlength_shifted = (double)(thischan.totlength << format_shift[thischan.format]);
+  thischan.totlengthFixed = (s64)(thischan.totlength << format_shift[thischan.format]) << 32;
+  thischan.sampcntFixed = (s64)thischan.sampcnt * ((s64)1 << 32);
 
+  thischan.interpolation = CommonSettings.spuInterpolationMode;
+  thischan.sample = NULL;
   if(thischan.format != 3)
   {
     if(thischan.double_totlength_shifted == 0)
     {
       thischan.status = CHANSTAT_STOPPED;
     }
+    else
+    {
+      bind_channel_sample(&thischan, thischan.format);
+    }
   }
 }
 
@@ -644,6 +704,7 @@ void SPU_struct::ProbeCapture(int which)
   if(len==0) len=1;
   cap.runtime.maxdad = cap.dad + len*4;
   cap.runtime.sampcnt = 0;
+  cap.runtime.sampcntFixed = 0;
   cap.runtime.fifo.reset();
 }
 
@@ -668,20 +729,21 @@ void SPU_struct::WriteByte(u32 addr, u8 val)
                 thischan.repeat = (val >> 3) & 0x03;
                 thischan.format = (val >> 5) & 0x03;
                 thischan.keyon = (val >> 7) & 0x01;
+                thischan.sample = NULL;
                 KeyProbe(chan_num);
                 break;
-      case 0x4: thischan.addr &= 0xFFFFFF00; thischan.addr |= (val & 0xFC); break;
-      case 0x5: thischan.addr &= 0xFFFF00FF; thischan.addr |= (val << 8); break;
-      case 0x6: thischan.addr &= 0xFF00FFFF; thischan.addr |= (val << 16); break;
-      case 0x7: thischan.addr &= 0x00FFFFFF; thischan.addr |= ((val&7) << 24); break; //only 27 bits of this register are used
+      case 0x4: thischan.addr &= 0xFFFFFF00; thischan.addr |= (val & 0xFC); thischan.sample = NULL; break;
+      case 0x5: thischan.addr &= 0xFFFF00FF; thischan.addr |= (val << 8); thischan.sample = NULL; break;
+      case 0x6: thischan.addr &= 0xFF00FFFF; thischan.addr |= (val << 16); thischan.sample = NULL; break;
+      case 0x7: thischan.addr &= 0x00FFFFFF; thischan.addr |= ((val&7) << 24); thischan.sample = NULL; break; //only 27 bits of this register are used
       case 0x8: thischan.timer &= 0xFF00; thischan.timer |= (val << 0); adjust_channel_timer(&thischan); break;
       case 0x9: thischan.timer &= 0x00FF; thischan.timer |= (val << 8); adjust_channel_timer(&thischan); break;
 
-      case 0xA: thischan.loopstart &= 0xFF00; thischan.loopstart |= (val << 0); break;
-      case 0xB: thischan.loopstart &= 0x00FF; thischan.loopstart |= (val << 8); break;
-      case 0xC: thischan.length &= 0xFFFFFF00; thischan.length |= (val << 0); break;
-      case 0xD: thischan.length &= 0xFFFF00FF; thischan.length |= (val << 8); break;
-      case 0xE: thischan.length &= 0xFF00FFFF; thischan.length |= ((val & 0x3F) << 16); //only 22 bits of this register are used
+      case 0xA: thischan.loopstart &= 0xFF00; thischan.loopstart |= (val << 0); thischan.sample = NULL; break;
+      case 0xB: thischan.loopstart &= 0x00FF; thischan.loopstart |= (val << 8); thischan.sample = NULL; break;
+      case 0xC: thischan.length &= 0xFFFFFF00; thischan.length |= (val << 0); thischan.sample = NULL; break;
+      case 0xD: thischan.length &= 0xFFFF00FF; thischan.length |= (val << 8); thischan.sample = NULL; break;
+      case 0xE: thischan.length &= 0xFF00FFFF; thischan.length |= ((val & 0x3F) << 16); thischan.sample = NULL; //only 22 bits of this register are used
       case 0xF: break;
 
     } //switch on individual channel regs
@@ -762,14 +824,15 @@ void SPU_struct::WriteWord(u32 addr, u16 val)
         thischan.repeat = (val >> 11) & 0x3;
         thischan.format = (val >> 13) & 0x3;
         thischan.keyon = (val >> 15) & 0x1;
+        thischan.sample = NULL;
         KeyProbe(chan_num);
         break;
-      case 0x4: thischan.addr &= 0xFFFF0000; thischan.addr |= (val & 0xFFFC); break;
-      case 0x6: thischan.addr &= 0x0000FFFF; thischan.addr |= ((val & 0x07FF) << 16); break;
+      case 0x4: thischan.addr &= 0xFFFF0000; thischan.addr |= (val & 0xFFFC); thischan.sample = NULL; break;
+      case 0x6: thischan.addr &= 0x0000FFFF; thischan.addr |= ((val & 0x07FF) << 16); thischan.sample = NULL; break;
       case 0x8: thischan.timer = val; adjust_channel_timer(&thischan); break;
-      case 0xA: thischan.loopstart = val; break;
-      case 0xC: thischan.length &= 0xFFFF0000; thischan.length |= (val << 0); break;
-      case 0xE: thischan.length &= 0x0000FFFF; thischan.length |= ((val & 0x003F) << 16); break;
+      case 0xA: thischan.loopstart = val; thischan.sample = NULL; break;
+      case 0xC: thischan.length &= 0xFFFF0000; thischan.length |= (val << 0); thischan.sample = NULL; break;
+      case 0xE: thischan.length &= 0x0000FFFF; thischan.length |= ((val & 0x003F) << 16); thischan.sample = NULL; break;
     } //switch on individual channel regs
     return;
   }
@@ -845,17 +908,19 @@ void SPU_struct::WriteLong(u32 addr, u32 val)
         thischan.repeat = (val >> 27) & 0x3;
         thischan.format = (val >> 29) & 0x3;
         thischan.keyon = (val >> 31) & 0x1;
+        thischan.sample = NULL;
         KeyProbe(chan_num);
         break;
 
-      case 0x4: thischan.addr = (val & 0x07FFFFFC); break;
+      case 0x4: thischan.addr = (val & 0x07FFFFFC); thischan.sample = NULL; break;
       case 0x8:
                 thischan.timer = (val & 0xFFFF);
                 thischan.loopstart = ((val >> 16) & 0xFFFF);
+                thischan.sample = NULL;
                 adjust_channel_timer(&thischan);
                 break;
 
-      case 0xC: thischan.length = (val & 0x003FFFFF); break; //only 22 bits of this register are used
+      case 0xC: thischan.length = (val & 0x003FFFFF); thischan.sample = NULL; break; //only 22 bits of this register are used
     } //switch on individual channel regs
     return;
   }
@@ -910,32 +975,26 @@ void SPU_struct::WriteLong(u32 addr, u32 val)
 
 //////////////////////////////////////////////////////////////////////////////
 
-static FORCEINLINE void FetchPSGData(channel_struct *chan, s32 *data)
+//pos is the whole part of a non-negative sample counter
+static FORCEINLINE void FetchPSGData(channel_struct *chan, u32 pos, s32 *data)
 {
-  if (chan->sampcnt < 0)
-  {
-    *data = 0;
-    return;
-  }
-
   if(chan->num < 8)
   {
     *data = 0;
   }
   else if(chan->num < 14)
   {
-    *data = (s32)wavedutytbl[chan->waveduty][(sputrunc(chan->sampcnt)) & 0x7];
+    *data = (s32)wavedutytbl[chan->waveduty][pos & 0x7];
   }
   else
   {
-    if(chan->lastsampcnt == sputrunc(chan->sampcnt))
+    if(chan->lastsampcnt == pos)
     {
       *data = (s32)chan->psgnoise_last;
       return;
     }
 
-    u32 max = sputrunc(chan->sampcnt);
-    for(u32 i = chan->lastsampcnt; i < max; i++)
+    for(u32 i = chan->lastsampcnt; i < pos; i++)
     {
       if(chan->x & 0x1)
       {
@@ -949,7 +1008,7 @@ static FORCEINLINE void FetchPSGData(channel_struct *chan, s32 *data)
       }
     }
 
-    chan->lastsampcnt = sputrunc(chan->sampcnt);
+    chan->lastsampcnt = pos;
 
     *data = (s32)chan->psgnoise_last;
   }
@@ -1042,6 +1101,65 @@ static FORCEINLINE void TestForLoop2(SPU_struct *SPU, channel_struct *chan)
   }
 }
 
+//fixed point versions of the above
+template<int FORMAT> static FORCEINLINE void TestForLoopFixed(SPU_struct *SPU, channel_struct *chan)
+{
+  const int shift = (FORMAT == 0 ? 2 : 1);
+
+  chan->sampcntFixed += chan->sampincFixed;
+
+  if (chan->sampcntFixed > chan->totlengthFixed)
+  {
+    if (chan->repeat == 1)
+    {
+      s64 step = chan->totlengthFixed - ((s64)(chan->loopstart << shift) << 32);
+      while (chan->sampcntFixed > chan->totlengthFixed)
+        chan->sampcntFixed -= step;
+    }
+    else
+    {
+      SPU->KeyOff(chan->num);
+      SPU->bufpos = SPU->buflength;
+    }
+  }
+}
+
+static FORCEINLINE void TestForLoop2Fixed(SPU_struct *SPU, channel_struct *chan)
+{
+  if (chan->totlength < 4) return;
+
+  chan->sampcntFixed += chan->sampincFixed;
+
+  if (chan->sampcntFixed > chan->totlengthFixed)
+  {
+    if (chan->repeat == 1)
+    {
+      s64 step = chan->totlengthFixed - ((s64)(chan->loopstart << 3) << 32);
+
+      while (chan->sampcntFixed > chan->totlengthFixed) chan->sampcntFixed -= step;
+
+      if(chan->loop_index == K_ADPCM_LOOPING_RECOVERY_INDEX)
+      {
+        chan->pcm16b = (s16)read16(chan->addr);
+        chan->index = read08(chan->addr+2) & 0x7F;
+        chan->lastsampcnt = 7;
+      }
+      else
+      {
+        chan->pcm16b = chan->loop_pcm16b;
+        chan->index = chan->loop_index;
+        chan->lastsampcnt = (chan->loopstart << 3);
+      }
+    }
+    else
+    {
+      chan->status = CHANSTAT_STOPPED;
+      SPU->KeyOff(chan->num);
+      SPU->bufpos = SPU->buflength;
+    }
+  }
+}
+
 template<int CHANNELS> FORCEINLINE static void SPU_Mix(SPU_struct* SPU, channel_struct *chan, s32 data)
 {
   switch(CHANNELS)
@@ -1053,10 +1171,39 @@ template<int CHANNELS> FORCEINLINE static void SPU_Mix(SPU_struct* SPU, channel_
   SPU->lastdata = data;
 }
 
+template<int INTERPOLATION> static FORCEINLINE s32 FetchSampleData(const SampleData& sample, double sampcnt)
+{
+  switch(INTERPOLATION)
+  {
+    case SPUInterpolation_Linear: return LinearInterpolator::interpolateAt(sample, sampcnt);
+    case SPUInterpolation_Cosine: return CosineInterpolator::interpolateAt(sample, sampcnt);
+    case SPUInterpolation_Sharp: return SharpIInterpolator::interpolateAt(sample, sampcnt);
+    case SPUInterpolation_Sinc: return SincInterpolator::interpolateAt(sample, sampcnt);
+    default: return sample[u32(sampcnt)];
+  }
+}
+
+//the channel's decoded sample, or NULL when it has no data.
+//register writes never happen inside a channel update, so this stays valid for the whole run
+template<int FORMAT> static FORCEINLINE const SampleData *channel_sample(channel_struct *chan)
+{
+  const SampleData *sample;
+  if (chan->sample && chan->sampleGeneration == sampleCache.generation())
+    sample = chan->sample;
+  else
+    sample = bind_channel_sample(chan, FORMAT);
+  sampleCache.touch(*sample);
+  return sample->baseAddr ? sample : NULL;
+}
+
 //WORK
-  template<int FORMAT, int CHANNELS>
-FORCEINLINE static void ____SPU_ChanUpdate(SPU_struct* const SPU, channel_struct* const chan)
+  template<int FORMAT, int CHANNELS, int INTERPOLATION>
+FORCEINLINE static void ____SPU_ChanUpdateDouble(SPU_struct* const SPU, channel_struct* const chan)
 {
+  const SampleData *sample = NULL;
+  if(CHANNELS != -1 && FORMAT != 3)
+    sample = channel_sample<FORMAT>(chan);
+
   for (; SPU->bufpos < SPU->buflength; SPU->bufpos++)
   {
     if(CHANNELS != -1)
@@ -1065,10 +1212,11 @@ FORCEINLINE static void ____SPU_ChanUpdate(SPU_struct* const SPU, channel_struct
       if (chan->sampcnt < 0) {
         data = 0;
       } else if (FORMAT == 3) {
-        FetchPSGData(chan, &data);
+        FetchPSGData(chan, sputrunc(chan->sampcnt), &data);
+      } else if (!sample) {
+        data = 0;
       } else {
-        const SampleData& sample = sampleCache.getSample(chan->addr, chan->loopstart, chan->length, SampleData::Format(FORMAT));
-        data = sample.sampleAt(chan->sampcnt, IInterpolator::allInterpolators[CommonSettings.spuInterpolationMode]);
+        data = FetchSampleData<INTERPOLATION>(*sample, chan->sampcnt);
       }
       SPU_Mix<CHANNELS>(SPU, chan, data);
     }
@@ -1081,17 +1229,101 @@ FORCEINLINE static void ____SPU_ChanUpdate(SPU_struct* const SPU, channel_struct
   }
 }
 
+//with fixed point counters a channel's positions up to the next loop check are known in advance,
+//so sample channels are rendered a run at a time through the batch interpolation kernels.
+//the loop check (and PSG generation) still goes one sample at a time.
+  template<int FORMAT, int CHANNELS, int INTERPOLATION>
+FORCEINLINE static void ____SPU_ChanUpdateFixed(SPU_struct* const SPU, channel_struct* const chan)
+{
+  static const u32 BLOCK = 64;
+  const SampleData *sample = NULL;
+  InterpolateBlockFunc kernel = NULL;
+  if(CHANNELS != -1 && FORMAT != 3)
+  {
+    sample = channel_sample<FORMAT>(chan);
+    kernel = IInterpolator::blockKernel(INTERPOLATION);
+  }
+
+  while (SPU->bufpos < SPU->buflength)
+  {
+    //short ADPCM channels never advance, see TestForLoop2
+    const s64 inc = (FORMAT == 2 && chan->totlength < 4) ? 0 : chan->sampincFixed;
+
+    //samples before the loop check can fire: every one of them lies at or before the end
+    u32 n = SPU->buflength - SPU->bufpos;
+    if (FORMAT != 3 && inc > 0)
+    {
+      s64 left = chan->totlengthFixed - chan->sampcntFixed;
+      n = (left < 0) ? 1 : (u32)std::min<s64>(n, left / inc + 1);
+    }
+
+    if(CHANNELS != -1 && FORMAT != 3 && sample && chan->sampcntFixed >= 0)
+    {
+      s32 block[BLOCK];
+      n = std::min(n, BLOCK);
+      kernel(*sample, chan->sampcntFixed, inc, block, n);
+      for (u32 i = 0; i < n; i++, SPU->bufpos++)
+        SPU_Mix<CHANNELS>(SPU, chan, block[i]);
+      SPU->bufpos--;
+    }
+    else if(CHANNELS != -1)
+    {
+      s32 data = 0;
+      if (FORMAT == 3 && chan->sampcntFixed >= 0)
+        FetchPSGData(chan, (u32)(chan->sampcntFixed >> 32), &data);
+      SPU_Mix<CHANNELS>(SPU, chan, data);
+      n = 1;
+    }
+    else
+      SPU->bufpos += n - 1;
+
+    //skip to the last sample of the run; the check below steps past it
+    chan->sampcntFixed += (s64)(n - 1) * inc;
+
+    switch(FORMAT) {
+      case 0: case 1: TestForLoopFixed<FORMAT>(SPU, chan); break;
+      case 2: TestForLoop2Fixed(SPU, chan); break;
+      case 3: chan->sampcntFixed += chan->sampincFixed; break;
+    }
+    SPU->bufpos++;
+  }
+}
+
+  template<int FORMAT, int CHANNELS, int INTERPOLATION>
+FORCEINLINE static void ____SPU_ChanUpdate(SPU_struct* const SPU, channel_struct* const chan)
+{
+  if (SPU->fixedCounters)
+    ____SPU_ChanUpdateFixed<FORMAT,CHANNELS,INTERPOLATION>(SPU, chan);
+  else
+    ____SPU_ChanUpdateDouble<FORMAT,CHANNELS,INTERPOLATION>(SPU, chan);
+}
+
+template<int FORMAT, int INTERPOLATION>
+FORCEINLINE static void ___SPU_ChanUpdate(SPU_struct* const SPU, channel_struct* const chan)
+{
+  if (chan->pan == 0)
+    ____SPU_ChanUpdate<FORMAT,0,INTERPOLATION>(SPU,chan);
+  else if (chan->pan == 127)
+    ____SPU_ChanUpdate<FORMAT,2,INTERPOLATION>(SPU,chan);
+  else
+    ____SPU_ChanUpdate<FORMAT,1,INTERPOLATION>(SPU,chan);
+}
+
 template<int FORMAT>
 FORCEINLINE static void ___SPU_ChanUpdate(const bool actuallyMix, SPU_struct* const SPU, channel_struct* const chan)
 {
   if(!actuallyMix)
-    ____SPU_ChanUpdate<FORMAT,-1>(SPU,chan);
-  else if (chan->pan == 0)
-    ____SPU_ChanUpdate<FORMAT,0>(SPU,chan);
-  else if (chan->pan == 127)
-    ____SPU_ChanUpdate<FORMAT,2>(SPU,chan);
-  else
-    ____SPU_ChanUpdate<FORMAT,1>(SPU,chan);
+    ____SPU_ChanUpdate<FORMAT,-1,SPUInterpolation_None>(SPU,chan);
+  else if (FORMAT == 3)
+    ___SPU_ChanUpdate<FORMAT,SPUInterpolation_None>(SPU,chan);
+  else switch(chan->interpolation)
+  {
+    case SPUInterpolation_Linear: ___SPU_ChanUpdate<FORMAT,SPUInterpolation_Linear>(SPU,chan); break;
+    case SPUInterpolation_Cosine: ___SPU_ChanUpdate<FORMAT,SPUInterpolation_Cosine>(SPU,chan); break;
+    case SPUInterpolation_Sharp: ___SPU_ChanUpdate<FORMAT,SPUInterpolation_Sharp>(SPU,chan); break;
+    case SPUInterpolation_Sinc: ___SPU_ChanUpdate<FORMAT,SPUInterpolation_Sinc>(SPU,chan); break;
+    default: ___SPU_ChanUpdate<FORMAT,SPUInterpolation_None>(SPU,chan); break;
+  }
 }
 
 FORCEINLINE static void _SPU_ChanUpdate(const bool actuallyMix, SPU_struct* const SPU, channel_struct* const chan)
@@ -1165,7 +1397,7 @@ static void SPU_MixAudio_Advanced(bool actuallyMix, SPU_struct *SPU, int length)
 
         //channels 1 and 3 should probably always generate their audio
         //internally at least, just in case they get used by the spu output
-        bool domix = outputToCap || outputToMix || i==1 || i==3;
+        bool domix = outputToCap || outputToMix || i==1 || i==3 || stemSink;
 
         //clear the output buffer since this is where _SPU_ChanUpdate wants to accumulate things
         SPU->sndbuf[0] = SPU->sndbuf[1] = 0;
@@ -1200,6 +1432,9 @@ static void SPU_MixAudio_Advanced(bool actuallyMix, SPU_struct *SPU, int length)
       }
     } //foreach channel
 
+    if (stemSink)
+      memcpy(&stemMix[samp*32], submix, sizeof(submix));
+
     s32 mixout[2] = {mix[0],mix[1]};
     s32 capmixout[2] = {capmix[0],capmix[1]};
     s32 sndout[2];
@@ -1255,9 +1490,19 @@ static void SPU_MixAudio_Advanced(bool actuallyMix, SPU_struct *SPU, int length)
       if (SPU->regs.cap[capchan].runtime.running)
       {
         SPU_struct::REGS::CAP& cap = SPU->regs.cap[capchan];
-        u32 last = sputrunc(cap.runtime.sampcnt);
-        cap.runtime.sampcnt += SPU->channels[1+2*capchan].sampinc;
-        u32 curr = sputrunc(cap.runtime.sampcnt);
+        u32 last, curr;
+        if (SPU->fixedCounters)
+        {
+          last = (u32)(cap.runtime.sampcntFixed >> 32);
+          cap.runtime.sampcntFixed += SPU->channels[1+2*capchan].sampincFixed;
+          curr = (u32)(cap.runtime.sampcntFixed >> 32);
+        }
+        else
+        {
+          last = sputrunc(cap.runtime.sampcnt);
+          cap.runtime.sampcnt += SPU->channels[1+2*capchan].sampinc;
+          curr = sputrunc(cap.runtime.sampcnt);
+        }
         for (u32 j = last; j < curr; j++)
         {
           //so, this is a little strange. why go through a fifo?
@@ -1305,7 +1550,10 @@ static void SPU_MixAudio_Advanced(bool actuallyMix, SPU_struct *SPU, int length)
           if (cap.runtime.curdad >= cap.runtime.maxdad)
           {
             cap.runtime.curdad = cap.dad;
-            cap.runtime.sampcnt -= cap.len*multiplier;
+            if (SPU->fixedCounters)
+              cap.runtime.sampcntFixed -= (s64)(cap.len*multiplier) << 32;
+            else
+              cap.runtime.sampcnt -= cap.len*multiplier;
           }
         } //sampinc loop
       } //if capchan running
@@ -1316,16 +1564,82 @@ static void SPU_MixAudio_Advanced(bool actuallyMix, SPU_struct *SPU, int length)
   SPU->sndbuf[1] = samp0[1];
 }
 
+//when neither capture unit is running and both outputs come straight from the mixer,
+//nothing in SPU_MixAudio_Advanced depends on the interleaving of channels within a sample.
+//so here each channel renders its whole run at once and accumulates into sndbuf, which
+//yields exactly the same sums. the channel selection below must stay in step with the advanced path.
+static void SPU_MixAudio_Block(bool actuallyMix, SPU_struct *SPU, int length)
+{
+  static std::vector<s32> discard;
+
+  memset(SPU->sndbuf, 0, length*4*2);
+  if (length <= 0) return;
+
+  for (int i = 0; i < 16; i++)
+  {
+    channel_struct *chan = &SPU->channels[i];
+    if (chan->status != CHANSTAT_PLAY) continue;
+
+    bool bypass = false;
+    if (i==1 && SPU->regs.ctl_ch1bypass) bypass=true;
+    if (i==3 && SPU->regs.ctl_ch3bypass) bypass=true;
+
+    bool outputToMix = true;
+    if (CommonSettings.spu_muteChannels[i]) outputToMix = false;
+    if (bypass) outputToMix = false;
+    bool outputToCap = outputToMix;
+    if (CommonSettings.spu_captureMuted && !bypass) outputToCap = true;
+    bool domix = outputToCap || outputToMix || i==1 || i==3;
+    //when nothing is heard only PSG channels need generating, to keep their noise state
+    if (!actuallyMix)
+    {
+      domix = domix && chan->format == 3;
+      outputToMix = false;
+    }
+
+    SPU->bufpos = 0;
+    SPU->buflength = length;
+
+    if (outputToMix || !domix)
+    {
+      _SPU_ChanUpdate(domix, SPU, chan);
+    }
+    else
+    {
+      //the advanced path still generates this channel (which advances PSG noise state),
+      //it just doesnt hear it. render it somewhere harmless.
+      discard.resize(length*2);
+      s32 *sndbuf = SPU->sndbuf;
+      SPU->sndbuf = &discard[0];
+      _SPU_ChanUpdate(true, SPU, chan);
+      SPU->sndbuf = sndbuf;
+    }
+  }
+}
+
 //ENTER
-static void SPU_MixAudio(bool actuallyMix, SPU_struct *SPU, int length)
+//the 16-bit result is written to out, which is SPU->outbuf unless it goes straight to an output span
+static void SPU_MixAudio(bool actuallyMix, SPU_struct *SPU, int length, s16 *out)
 {
   if (actuallyMix)
   {
     memset(SPU->sndbuf, 0, length*4*2);
-    memset(SPU->outbuf, 0, length*2*2);
+    memset(out, 0, length*2*2);
   }
 
-  SPU_MixAudio_Advanced(actuallyMix, SPU, length);
+  if (stemSink)
+    stemMix.resize(length*32);
+
+  //without mixing, channels only need advancing unless a capture has to hear them
+  bool capturing = SPU->regs.cap[0].runtime.running || SPU->regs.cap[1].runtime.running;
+  if (!actuallyMix && !capturing)
+    SPU_MixAudio_Block(false, SPU, length);
+  else if (!stemSink && !capturing
+    && SPU->regs.ctl_left == SPU_struct::REGS::LOM_LEFT_MIXER
+    && SPU->regs.ctl_right == SPU_struct::REGS::ROM_RIGHT_MIXER)
+    SPU_MixAudio_Block(true, SPU, length);
+  else
+    SPU_MixAudio_Advanced(actuallyMix, SPU, length);
 
   //we used to bail out if speakers were disabled.
   //this is technically wrong. sound may still be captured, or something.
@@ -1343,9 +1657,68 @@ static void SPU_MixAudio(bool actuallyMix, SPU_struct *SPU, int length)
       // Apply Master Volume
       SPU->sndbuf[i] = spumuldiv7(SPU->sndbuf[i], vol);
       s16 outsample = MinMax(SPU->sndbuf[i],-0x8000,0x7FFF);
-      SPU->outbuf[i] = outsample;
+      out[i] = outsample;
     }
   }
+
+  if (stemSink && actuallyMix)
+  {
+    stemOut.resize(length*SPU_STEM_COUNT*2);
+    s16 *stems = stemOut.empty() ? NULL : &stemOut[0];
+    for (int samp = 0; samp < length; samp++)
+    {
+      for (int i = 0; i < 32; i++)
+        *stems++ = speakers ? (s16)MinMax(spumuldiv7(stemMix[samp*32+i], vol),-0x8000,0x7FFF) : 0;
+      *stems++ = out[samp*2];
+      *stems++ = out[samp*2+1];
+    }
+    stemSink(stemOut.empty() ? NULL : &stemOut[0], length, stemContext);
+  }
+}
+
+void SPU_SetStemSink(SPU_StemSink sink, void *context)
+{
+  stemSink = sink;
+  stemContext = context;
+  if (!sink)
+  {
+    std::vector<s32>().swap(stemMix);
+    std::vector<s16>().swap(stemOut);
+  }
+}
+
+void SPU_SetDirectOutput(bool enable)
+{
+  directOutput = enable;
+  outputSpan = NULL;
+  outputSpanSize = outputSpanFilled = 0;
+  outputSpill.clear();
+}
+
+void SPU_SetOutputSpan(s16 *buffer, u32 num_samples)
+{
+  outputSpan = buffer;
+  outputSpanSize = num_samples;
+  outputSpanFilled = 0;
+  if (outputSpill.empty())
+    return;
+
+  //hand over what the previous span couldn't take first
+  u32 spilled = std::min<u32>(outputSpill.size() / 2, outputSpanSize);
+  if (buffer)
+    memcpy(buffer, &outputSpill[0], spilled*2*2);
+  outputSpill.erase(outputSpill.begin(), outputSpill.begin() + spilled*2);
+  outputSpanFilled = spilled;
+}
+
+u32 SPU_OutputSpanFilled()
+{
+  return outputSpanFilled;
+}
+
+bool SPU_OutputSpanFull()
+{
+  return outputSpanSize && outputSpanFilled >= outputSpanSize;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1364,7 +1737,39 @@ void SPU_Emulate_core()
   spu_core_samples = (int)(samples);
   samples -= spu_core_samples;
 
-  SPU_MixAudio(needToMix, SPU_core, spu_core_samples);
+  if (directOutput)
+  {
+    u32 room = outputSpanSize - outputSpanFilled;
+    u32 taken = std::min(room, (u32)spu_core_samples);
+
+    //mix straight into the span when the whole hline fits
+    if (outputSpan && taken == (u32)spu_core_samples)
+    {
+      SPU_MixAudio(needToMix, SPU_core, spu_core_samples, outputSpan + outputSpanFilled*2);
+      outputSpanFilled += taken;
+      return;
+    }
+
+    //nobody hears this hline when it all goes to a skip span, or there is no span at all
+    if (!stemSink && (!outputSpanSize || taken == (u32)spu_core_samples))
+    {
+      SPU_MixAudio(false, SPU_core, spu_core_samples, SPU_core->outbuf);
+      outputSpanFilled += taken;
+      return;
+    }
+
+    //otherwise go through outbuf and spill what the span can't take
+    SPU_MixAudio(needToMix, SPU_core, spu_core_samples, SPU_core->outbuf);
+    if (!outputSpanSize)
+      return;
+    if (outputSpan)
+      memcpy(outputSpan + outputSpanFilled*2, SPU_core->outbuf, taken*2*2);
+    outputSpanFilled += taken;
+    outputSpill.insert(outputSpill.end(), SPU_core->outbuf + taken*2, SPU_core->outbuf + spu_core_samples*2);
+    return;
+  }
+
+  SPU_MixAudio(needToMix, SPU_core, spu_core_samples, SPU_core->outbuf);
 
   if (soundProcessor == NULL)
   {
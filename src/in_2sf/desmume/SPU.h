@@ -30,6 +30,7 @@
 #include "metaspu/metaspu.h"
 
 class EMUFILE;
+class SampleData;
 
 #define SNDCORE_DEFAULT         -1
 #define SNDCORE_DUMMY           0
@@ -37,6 +38,9 @@ class EMUFILE;
 #define CHANSTAT_STOPPED          0
 #define CHANSTAT_PLAY             1
 
+// default for CommonSettings.spu_fixedPointCounters
+#define SPU_FIXED_POINT_COUNTERS 1
+
 
 //who made these static? theyre used in multiple places.
 FORCEINLINE u32 sputrunc(float f) { return u32floor(f); }
@@ -51,7 +55,8 @@ enum SPUInterpolationMode
 	SPUInterpolation_None   = 0,
 	SPUInterpolation_Linear = 1,
 	SPUInterpolation_Cosine = 2,
-	SPUInterpolation_Sharp  = 3
+	SPUInterpolation_Sharp  = 3,
+	SPUInterpolation_Sinc   = 4
 };
 
 struct SoundInterface_struct
@@ -94,6 +99,9 @@ struct channel_struct
 						double_totlength_shifted(0.0),
 						sampcnt(0.0),
 						sampinc(0.0),
+						totlengthFixed(0),
+						sampcntFixed(0),
+						sampincFixed(0),
 						lastsampcnt(0),
 						pcm16b(0),
 						pcm16b_last(0),
@@ -101,7 +109,10 @@ struct channel_struct
 						index(0),
 						loop_index(0),
 						x(0),
-						psgnoise_last(0)
+						psgnoise_last(0),
+						sample(NULL),
+						sampleGeneration(0),
+						interpolation(0)
 	{}
 	u32 num;
    u8 vol;
@@ -121,6 +132,10 @@ struct channel_struct
    double double_totlength_shifted;
    double sampcnt;
    double sampinc;
+   // the same three in 32.32 fixed point, used instead when SPU_struct::fixedCounters is set
+   s64 totlengthFixed;
+   s64 sampcntFixed;
+   s64 sampincFixed;
    // ADPCM specific
    u32 lastsampcnt;
    s16 pcm16b, pcm16b_last;
@@ -129,6 +144,12 @@ struct channel_struct
    int loop_index;
    u16 x;
    s16 psgnoise_last;
+   // decoded sample bound at KeyOn; cleared whenever addr, loopstart,
+   // length or format is written and rebound lazily by the mixer
+   // (also when the cache generation moves on, i.e. something was evicted)
+   const SampleData *sample;
+   u32 sampleGeneration;
+   u8 interpolation;
 };
 
 class SPUFifo
@@ -153,6 +174,9 @@ public:
    s16 *outbuf;
    u32 bufsize;
    channel_struct channels[16];
+   // step channel and capture positions in 32.32 fixed point rather than double;
+   // latched from CommonSettings at reset
+   bool fixedCounters;
 
    //registers
    struct REGS {
@@ -191,12 +215,13 @@ public:
 		   u16 len;
 		   struct Runtime {
 			   Runtime()
-				   : running(0), curdad(0), maxdad(0)
+				   : running(0), curdad(0), maxdad(0), sampcnt(0), sampcntFixed(0)
 			   {}
 			   u8 running;
 			   u32 curdad;
 			   u32 maxdad;
 			   double sampcnt;
+			   s64 sampcntFixed;
 			   SPUFifo fifo;
 		   } runtime;
 	   } cap[2];
@@ -258,6 +283,25 @@ static FORCEINLINE u16 SPU_ReadWord(u32 addr) { return SPU_core->ReadWord(addr &
 static FORCEINLINE u32 SPU_ReadLong(u32 addr) { return SPU_core->ReadLong(addr & 0x0FFF); }
 void SPU_Emulate_core(void);
 void SPU_Emulate_user(bool mix = true);
+
+// Per-channel output ("stems"). While a sink is set, every mixed sample is also handed to it as
+// SPU_STEM_COUNT interleaved stereo pairs: channels 0-15 after pan, channel volume and master
+// volume, then the master mix exactly as it goes to the sound core. Channel stems are generated
+// even for muted or bypassed channels; the sample-exact mixer is used while a sink is set.
+#define SPU_STEM_COUNT 17
+typedef void (*SPU_StemSink)(const s16 *stems, u32 num_samples, void *context);
+void SPU_SetStemSink(SPU_StemSink sink, void *context);
+
+// Direct output, for hosts that pull audio themselves. While enabled, SPU_Emulate_core bypasses
+// the sound core and synchronizer and converts each hline straight into the span passed to
+// SPU_SetOutputSpan (num_samples interleaved stereo pairs). Samples mixed past the end of a span
+// are held and delivered first into the next one. A span with no buffer skips num_samples instead:
+// channels (and captures) advance as usual but nothing is mixed, and the same goes for hlines run
+// while no span is set at all, unless a stem sink wants them.
+void SPU_SetDirectOutput(bool enable);
+void SPU_SetOutputSpan(s16 *buffer, u32 num_samples);
+u32 SPU_OutputSpanFilled();
+bool SPU_OutputSpanFull();
 void SPU_DefaultFetchSamples(s16 *sampleBuffer, size_t sampleCount, ESynchMode synchMode, ISynchronizingAudioBuffer *theSynchronizer);
 size_t SPU_DefaultPostProcessSamples(s16 *postProcessBuffer, size_t requestedSampleCount, ESynchMode synchMode, ISynchronizingAudioBuffer *theSynchronizer);
 
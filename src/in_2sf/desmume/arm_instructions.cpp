@@ -6153,3 +6153,10 @@ const OpFunc arm_instructions_set[2][4096] =
 #undef TABDECL
 	}
 };
+
+const char *arm_instruction_names[4096] =
+{
+#define TABDECL(x) #x
+#include "instruction_tabdef.inc"
+#undef TABDECL
+};
@@ -41,9 +41,11 @@
 #define LOG_JIT_LEVEL 0
 #define PROFILER_JIT_LEVEL 0
 
-#if PROFILER_JIT_LEVEL > 0
-# include <algorithm>
-#endif
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <unordered_map>
 
 using namespace asmjit;
 
@@ -185,6 +187,90 @@ DS_ALIGN(4096) uintptr_t compiled_funcs[1 << 26] = {0};
 
 static uint8_t recompile_counts[(1 << 26) / 16];
 
+// Two-tier compilation.
+// Blocks are first compiled short (cheap to build, fine-grained timing). A first-tier block that was cut off by
+// the size limit rather than ending on a branch counts its executions, and once it is hot enough it drops its own
+// entry point so the next dispatch recompiles it as a long block running up to the next branch.
+// Blocks that end on a branch anyway are never counted, since recompiling them would produce the same code.
+// The threshold is scaled by how often the block's memory has already been recompiled, so drivers that keep
+// rewriting their code don't pay for second-tier compiles that will be thrown away.
+// Promotion only lasts as long as the code: a write that clears the entry point brings the block back to the
+// first tier with a fresh count.
+// The second tier only makes blocks longer. Guest registers still live in cpu->R between instructions, since
+// the emitters and the interpreter fallbacks all work on them there; caching them in host registers across a
+// block is not done.
+static const uint32_t JIT_TIER1_BLOCK_SIZE = 16;
+static const uint32_t JIT_AUTO_MAX_BLOCK_SIZE = 100;
+static const uint32_t JIT_HOT_THRESHOLD = 64;
+
+// counters are referenced by compiled code, so they live in a fixed pool that is only recycled on reset.
+// a block recompiled at the same address takes over its old counter, so only new entry points use up the pool.
+static uint32_t jit_hot_counters[1 << 16];
+static uint32_t jit_hot_counters_used;
+static std::unordered_map<uint32_t, uint32_t *> jit_block_counters[2];
+
+static inline uint32_t jit_block_size(bool hot)
+{
+	uint32_t max_block_size = CommonSettings.jit_max_block_size ? CommonSettings.jit_max_block_size : JIT_AUTO_MAX_BLOCK_SIZE;
+	return hot ? max_block_size : std::min(max_block_size, JIT_TIER1_BLOCK_SIZE);
+}
+
+template<int PROCNUM> static bool jit_has_hot_counter(uint32_t adr)
+{
+	return jit_hot_counters_used < ARRAY_SIZE(jit_hot_counters) || jit_block_counters[PROCNUM].count(adr);
+}
+
+template<int PROCNUM> static uint32_t *jit_hot_counter(uint32_t adr)
+{
+	uint32_t *&counter = jit_block_counters[PROCNUM][adr];
+	if (!counter)
+		counter = &jit_hot_counters[jit_hot_counters_used++];
+	return counter;
+}
+
+static inline uint32_t jit_recompile_count(uint32_t adr)
+{
+	uint32_t mask_adr = (adr & 0x07FFFFFE) >> 4;
+	return (recompile_counts[mask_adr >> 1] >> 4 * (mask_adr & 1)) & 0xF;
+}
+
+// runtime statistics, see JIT_STATS
+struct JIT_BLOCK_RECORD
+{
+	uint32_t addr;
+	uint8_t proc;
+	bool thumb;
+	uint16_t instructions;
+	uint32_t runs_lo, runs_hi;
+	uint32_t cycles_lo, cycles_hi;
+};
+
+static struct JIT_COUNTERS
+{
+	uint32_t blocks_compiled;
+	uint32_t blocks_promoted;
+	uint32_t compile_errors;
+	uint32_t recompile_limit_hits;
+	uint64_t compile_ns;
+	uint64_t code_bytes;
+	uint32_t arm_fallbacks[4096];
+	uint32_t thumb_fallbacks[1024];
+} jit_counters[2];
+
+// like the hot counters, these are referenced by compiled code
+static JIT_BLOCK_RECORD jit_block_records[1 << 16];
+static uint32_t jit_block_records_used;
+
+template<int PROCNUM> static uint32_t FASTCALL arm_jit_compile_promoted();
+
+// the entry point is replaced rather than cleared, so a write to the block before it runs again still
+// sends it back through arm_jit_compile as a recompile
+template<int PROCNUM> static void arm_jit_promote(uint32_t adr)
+{
+	++jit_counters[PROCNUM].blocks_promoted;
+	JIT_COMPILED_FUNC(adr, PROCNUM) = reinterpret_cast<uintptr_t>(arm_jit_compile_promoted<PROCNUM>);
+}
+
 #ifdef HAVE_STATIC_CODE_BUFFER
 // On x86_64, allocate jitted code from a static buffer to ensure that it's within 2GB of .text
 // Allows call instructions to use pcrel offsets, as opposed to slower indirect calls.
@@ -2134,6 +2220,8 @@ template<int PROCNUM, bool store, int dir, bool null_compiled> static FORCEINLIN
 	{ \
 		*func = 0; \
 		*(func + 1) = 0; \
+		decode_cache_invalidate<4>(adr); \
+		sampleCacheNotifyWrite(adr, 4); \
 	} \
 	int Rd = (static_cast<uintptr_t>(regs) >> (j * 4)) & 0xF; \
 	if (store) \
@@ -3812,18 +3900,23 @@ template<int PROCNUM, int thumb> static uint32_t FASTCALL OP_DECODE()
 	{
 		cpu->next_instruction = adr + 2;
 		cpu->R[15] = adr + 4;
-		uint32_t opcode = _MMU_read16<PROCNUM, MMU_AT_CODE>(adr);
-		_armlog(PROCNUM, adr, opcode);
-		cycles = thumb_instructions_set[PROCNUM][opcode >> 6](opcode);
+		const DecodedOp &op = armcpu_decode<PROCNUM, true>(adr);
+		_armlog(PROCNUM, adr, op.opcode);
+		if (CommonSettings.jit_stats)
+			++jit_counters[PROCNUM].thumb_fallbacks[op.opcode >> 6];
+		cycles = op.handler(op.opcode);
 	}
 	else
 	{
 		cpu->next_instruction = adr + 4;
 		cpu->R[15] = adr + 8;
-		uint32_t opcode = _MMU_read32<PROCNUM, MMU_AT_CODE>(adr);
+		const DecodedOp &op = armcpu_decode<PROCNUM, false>(adr);
+		uint32_t opcode = op.opcode;
 		_armlog(PROCNUM, adr, opcode);
+		if (CommonSettings.jit_stats)
+			++jit_counters[PROCNUM].arm_fallbacks[INSTRUCTION_INDEX(opcode)];
 		if (CONDITION(opcode) == 0xE || TEST_COND(CONDITION(opcode), CODE(opcode), cpu->CPSR))
-			cycles = arm_instructions_set[PROCNUM][INSTRUCTION_INDEX(opcode)](opcode);
+			cycles = op.handler(opcode);
 		else
 			cycles = 1;
 	}
@@ -3962,6 +4055,14 @@ static void emit_armop_call(uint32_t opcode)
 		return;
 
 	JIT_COMMENT("call interpreter");
+	if (CommonSettings.jit_stats)
+	{
+		uint32_t *counter = bb_thumb ? &jit_counters[PROCNUM].thumb_fallbacks[opcode >> 6] : &jit_counters[PROCNUM].arm_fallbacks[INSTRUCTION_INDEX(opcode)];
+		GpVar x = c.newGpVar(kVarTypeIntPtr);
+		c.mov(x, reinterpret_cast<uintptr_t>(counter));
+		c.add(x86::dword_ptr(x), 1);
+		c.unuse(x);
+	}
 	GpVar arg = c.newGpVar(kVarTypeInt32);
 	c.mov(arg, opcode);
 	OpFunc f = bb_thumb ? thumb_instructions_set[PROCNUM][opcode >> 6] : arm_instructions_set[PROCNUM][INSTRUCTION_INDEX(opcode)];
@@ -3990,7 +4091,7 @@ static void _armlog(uint8_t proc, uint32_t addr, uint32_t opcode)
 #endif
 }
 
-template<int PROCNUM> static uint32_t compile_basicblock()
+template<int PROCNUM> static uint32_t compile_basicblock(bool hot)
 {
 #if LOG_JIT
 	bool has_variable_cycles = false;
@@ -4032,6 +4133,10 @@ template<int PROCNUM> static uint32_t compile_basicblock()
 	c.mov(bb_profiler, reinterpret_cast<uintptr_t>(&profiler_counter[PROCNUM]));
 #endif
 
+	// once the counters have run out, a first-tier block could never be promoted, so it's compiled long right away
+	if (!hot && !jit_has_hot_counter<PROCNUM>(start_adr))
+		hot = true;
+	uint32_t max_block_size = jit_block_size(hot);
 	bb_constant_cycles = 0;
 	for (uint32_t i = 0, bEndBlock = 0; !bEndBlock; ++i)
 	{
@@ -4052,7 +4157,7 @@ template<int PROCNUM> static uint32_t compile_basicblock()
 
 		uint32_t cycles = instr_cycles(opcode);
 
-		bEndBlock = i >= CommonSettings.jit_max_block_size - 1 || instr_is_branch(opcode);
+		bEndBlock = i >= max_block_size - 1 || instr_is_branch(opcode);
 
 #if LOG_JIT
 		if (instr_is_conditional(opcode) && cycles > 1 || !cycles)
@@ -4115,11 +4220,47 @@ template<int PROCNUM> static uint32_t compile_basicblock()
 		//c.mov(cpu_ptr(instruct_adr), bb_next_instruction);
 	}
 
+	if (!hot && !instr_is_branch(opcode))
+	{
+		JIT_COMMENT("first tier: count down to recompilation");
+		uint32_t *counter = jit_hot_counter<PROCNUM>(start_adr);
+		*counter = JIT_HOT_THRESHOLD << std::min<uint32_t>(jit_recompile_count(start_adr), 4);
+		GpVar x = c.newGpVar(kVarTypeIntPtr);
+		c.mov(x, reinterpret_cast<uintptr_t>(counter));
+		c.sub(x86::dword_ptr(x), 1);
+		c.unuse(x);
+		Label cold = c.newLabel();
+		c.jnz(cold);
+		GpVar arg = c.newGpVar(kVarTypeInt32);
+		c.mov(arg, start_adr);
+		auto ctx = c.addCall(imm_ptr(arm_jit_promote<PROCNUM>), ASMJIT_STDLIB_CALL_CONV, FuncBuilder1<void, uint32_t>());
+		ctx->setArg(0, arg);
+		c.bind(cold);
+	}
+
 	JIT_COMMENT("total cycles (block)");
 
 	if (bb_constant_cycles > 0)
 		c.add(bb_total_cycles, bb_constant_cycles);
 
+	if (CommonSettings.jit_stats && jit_block_records_used < ARRAY_SIZE(jit_block_records))
+	{
+		JIT_COMMENT("stats - runs and cycles");
+		JIT_BLOCK_RECORD *record = &jit_block_records[jit_block_records_used++];
+		record->addr = start_adr;
+		record->proc = PROCNUM;
+		record->thumb = bb_thumb;
+		record->instructions = (bb_adr - start_adr) / bb_opcodesize + 1;
+		record->runs_lo = record->runs_hi = record->cycles_lo = record->cycles_hi = 0;
+		GpVar x = c.newGpVar(kVarTypeIntPtr);
+		c.mov(x, reinterpret_cast<uintptr_t>(record));
+		c.add(x86::dword_ptr(x, offsetof(JIT_BLOCK_RECORD, runs_lo)), 1);
+		c.adc(x86::dword_ptr(x, offsetof(JIT_BLOCK_RECORD, runs_hi)), 0);
+		c.add(x86::dword_ptr(x, offsetof(JIT_BLOCK_RECORD, cycles_lo)), bb_total_cycles.r32());
+		c.adc(x86::dword_ptr(x, offsetof(JIT_BLOCK_RECORD, cycles_hi)), 0);
+		c.unuse(x);
+	}
+
 #if PROFILER_JIT_LEVEL > 1
 	JIT_COMMENT("*** profiler - cycles");
 	uint32_t padr = (start_adr & 0x07FFFFFE) >> 1;
@@ -4140,6 +4281,12 @@ template<int PROCNUM> static uint32_t compile_basicblock()
 	{
 		fprintf(stderr, "JIT error: %s\n", ErrorUtil::asString(c.getError()));
 		f = op_decode[PROCNUM][bb_thumb];
+		++jit_counters[PROCNUM].compile_errors;
+	}
+	else
+	{
+		++jit_counters[PROCNUM].blocks_compiled;
+		jit_counters[PROCNUM].code_bytes += c._assembler->getCodeSize();
 	}
 #if LOG_JIT
 	uintptr_t baddr = reinterpret_cast<uintptr_t>(f);
@@ -4151,6 +4298,22 @@ template<int PROCNUM> static uint32_t compile_basicblock()
 	return interpreted_cycles;
 }
 
+template<int PROCNUM> static uint32_t compile_basicblock_timed(bool hot)
+{
+	auto start = std::chrono::steady_clock::now();
+	uint32_t cycles = compile_basicblock<PROCNUM>(hot);
+	jit_counters[PROCNUM].compile_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	return cycles;
+}
+
+// a promotion is not a recompile caused by a write, so it doesn't count against the limit.
+// it can only happen once per first-tier block, since second-tier blocks don't count executions.
+template<int PROCNUM> static uint32_t FASTCALL arm_jit_compile_promoted()
+{
+	*PROCNUM_ptr = PROCNUM;
+	return compile_basicblock_timed<PROCNUM>(true);
+}
+
 template<int PROCNUM> uint32_t arm_jit_compile()
 {
 	*PROCNUM_ptr = PROCNUM;
@@ -4159,15 +4322,17 @@ template<int PROCNUM> uint32_t arm_jit_compile()
 	// also allows us to clear compiled_funcs[] while leaving it sparsely allocated, if the OS does memory overcommit.
 	uint32_t adr = cpu->instruct_adr;
 	uint32_t mask_adr = (adr & 0x07FFFFFE) >> 4;
-	if (((recompile_counts[mask_adr >> 1] >> 4 * (mask_adr & 1)) & 0xF) > 8)
+	if (jit_recompile_count(adr) > 8)
 	{
+		++jit_counters[PROCNUM].recompile_limit_hits;
 		ArmOpCompiled f = op_decode[PROCNUM][cpu->CPSR.bits.T];
 		JIT_COMPILED_FUNC(adr, PROCNUM) = reinterpret_cast<uintptr_t>(f);
 		return f();
 	}
 	recompile_counts[mask_adr >> 1] += 1 << 4 * (mask_adr & 1);
 
-	return compile_basicblock<PROCNUM>();
+	// first compile, or the code was written to: either way it starts over in the first tier
+	return compile_basicblock_timed<PROCNUM>(false);
 }
 
 template uint32_t arm_jit_compile<0>();
@@ -4188,7 +4353,10 @@ void arm_jit_reset(bool enable)
 
 	if (enable)
 	{
-		fprintf(stderr, "JIT max block size %d instruction(s)\n", CommonSettings.jit_max_block_size);
+		if (CommonSettings.jit_max_block_size)
+			fprintf(stderr, "JIT max block size %d instruction(s)\n", CommonSettings.jit_max_block_size);
+		else
+			fprintf(stderr, "JIT max block size auto\n");
 #ifdef MAPPED_JIT_FUNCS
 		// these pointers are allocated by asmjit and need freeing
 #ifndef HAVE_STATIC_CODE_BUFFER
@@ -4219,6 +4387,14 @@ void arm_jit_reset(bool enable)
 
 	c.reset();
 
+	jit_hot_counters_used = 0;
+	jit_block_records_used = 0;
+	for (int proc = 0; proc < 2; ++proc)
+	{
+		jit_block_counters[proc].clear();
+		memset(&jit_counters[proc], 0, sizeof(jit_counters[proc]));
+	}
+
 #if PROFILER_JIT_LEVEL > 0
 	reconstruct(&profiler_counter[0]);
 	reconstruct(&profiler_counter[1]);
@@ -4246,8 +4422,89 @@ static int pcmp_entry(PROFILER_ENTRY *info1, PROFILER_ENTRY *info2)
 #endif
 #endif
 
+void arm_jit_get_stats(int PROCNUM, JIT_STATS &stats, size_t max_blocks)
+{
+	const JIT_COUNTERS &counters = jit_counters[PROCNUM];
+	stats.blocks_compiled = counters.blocks_compiled;
+	stats.blocks_promoted = counters.blocks_promoted;
+	stats.compile_errors = counters.compile_errors;
+	stats.recompile_limit_hits = counters.recompile_limit_hits;
+	stats.compile_ns = counters.compile_ns;
+	stats.code_bytes = counters.code_bytes;
+
+	// several table entries share a handler, so merge them by name
+	std::map<std::string, uint64_t> arm, thumb;
+	for (int i = 0; i < 4096; ++i)
+		if (counters.arm_fallbacks[i])
+			arm[arm_instruction_names[i]] += counters.arm_fallbacks[i];
+	for (int i = 0; i < 1024; ++i)
+		if (counters.thumb_fallbacks[i])
+			thumb[thumb_instruction_names[i]] += counters.thumb_fallbacks[i];
+	stats.fallbacks.clear();
+	for (int i = 0; i < 4096; ++i)
+	{
+		auto found = arm.find(arm_instruction_names[i]);
+		if (found != arm.end())
+		{
+			stats.fallbacks.push_back({ arm_instruction_names[i], false, found->second });
+			arm.erase(found);
+		}
+	}
+	for (int i = 0; i < 1024; ++i)
+	{
+		auto found = thumb.find(thumb_instruction_names[i]);
+		if (found != thumb.end())
+		{
+			stats.fallbacks.push_back({ thumb_instruction_names[i], true, found->second });
+			thumb.erase(found);
+		}
+	}
+	std::sort(stats.fallbacks.begin(), stats.fallbacks.end(), [](const JIT_STATS::OPCODE &a, const JIT_STATS::OPCODE &b) { return a.count > b.count; });
+
+	// a block that was recompiled has several records, keep the busiest one
+	std::map<uint32_t, JIT_STATS::BLOCK> blocks;
+	for (uint32_t i = 0; i < jit_block_records_used; ++i)
+	{
+		const JIT_BLOCK_RECORD &record = jit_block_records[i];
+		if (record.proc != PROCNUM || !(record.runs_lo | record.runs_hi))
+			continue;
+		JIT_STATS::BLOCK block = { record.addr, record.thumb, record.instructions, (static_cast<uint64_t>(record.runs_hi) << 32) | record.runs_lo,
+			(static_cast<uint64_t>(record.cycles_hi) << 32) | record.cycles_lo };
+		auto &slot = blocks[record.addr];
+		if (block.cycles >= slot.cycles)
+			slot = block;
+	}
+	stats.hottest.clear();
+	for (auto &block : blocks)
+		stats.hottest.push_back(block.second);
+	std::sort(stats.hottest.begin(), stats.hottest.end(), [](const JIT_STATS::BLOCK &a, const JIT_STATS::BLOCK &b) { return a.cycles > b.cycles; });
+	if (stats.hottest.size() > max_blocks)
+		stats.hottest.resize(max_blocks);
+}
+
+void arm_jit_print_stats(FILE *fp)
+{
+	for (int proc = 0; proc < 2; ++proc)
+	{
+		JIT_STATS stats;
+		arm_jit_get_stats(proc, stats);
+
+		fprintf(fp, "JIT stats ARM%c: %u blocks (%u promoted, %u errors), %u recompile limit hits, %.3f ms compiling, %llu code bytes\n", !proc ? '9' : '7',
+			stats.blocks_compiled, stats.blocks_promoted, stats.compile_errors, stats.recompile_limit_hits, stats.compile_ns / 1000000.0, static_cast<unsigned long long>(stats.code_bytes));
+		size_t shown = std::min<size_t>(stats.fallbacks.size(), 20);
+		for (size_t i = 0; i < shown; ++i)
+			fprintf(fp, "  interpreted %-6s %-24s %12llu\n", stats.fallbacks[i].thumb ? "THUMB" : "ARM", stats.fallbacks[i].name, static_cast<unsigned long long>(stats.fallbacks[i].count));
+		for (auto &block : stats.hottest)
+			fprintf(fp, "  block %08X %-5s %3u instr %12llu runs %14llu cycles\n", block.addr, block.thumb ? "THUMB" : "ARM", block.instructions,
+				static_cast<unsigned long long>(block.runs), static_cast<unsigned long long>(block.cycles));
+	}
+}
+
 void arm_jit_close()
 {
+	if (CommonSettings.jit_stats)
+		arm_jit_print_stats(stderr);
+
 #if PROFILER_JIT_LEVEL > 0
 	fprintf(stderr, "Generating profile report...");
 
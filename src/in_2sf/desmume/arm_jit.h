@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <vector>
+#include <cstdio>
 #include "types.h"
 
 typedef uint32_t (FASTCALL *ArmOpCompiled)();
@@ -27,6 +29,43 @@ void arm_jit_close();
 void arm_jit_sync();
 template<int PROCNUM> uint32_t arm_jit_compile();
 
+// Runtime JIT statistics for one cpu, counted since the last arm_jit_reset.
+// The compile-side counters are always kept. fallbacks and hottest need counters inside the compiled code,
+// so they are only filled in for code compiled while CommonSettings.jit_stats is set.
+struct JIT_STATS
+{
+	struct OPCODE
+	{
+		const char *name;
+		bool thumb;
+		uint64_t count;
+	};
+
+	struct BLOCK
+	{
+		uint32_t addr;
+		bool thumb;
+		uint32_t instructions;
+		uint64_t runs;
+		uint64_t cycles;
+	};
+
+	uint32_t blocks_compiled;
+	uint32_t blocks_promoted;
+	uint32_t compile_errors;
+	uint32_t recompile_limit_hits; // compiles refused because the code kept getting overwritten
+	uint64_t compile_ns;
+	uint64_t code_bytes;
+
+	// instructions executed by the interpreter, from compiled blocks or in place of them, most frequent first
+	std::vector<OPCODE> fallbacks;
+	// compiled blocks by cycles spent in them, most first
+	std::vector<BLOCK> hottest;
+};
+
+void arm_jit_get_stats(int PROCNUM, JIT_STATS &stats, size_t max_blocks = 20);
+void arm_jit_print_stats(FILE *fp);
+
 #if defined(_WINDOWS) || defined(DESMUME_COCOA) || defined(HAVE_JIT)
 # define MAPPED_JIT_FUNCS
 #endif
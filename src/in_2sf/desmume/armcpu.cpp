@@ -46,6 +46,14 @@ static inline uint32_t armcpu_prefetch(armcpu_t *armcpu)
 armcpu_t NDS_ARM7;
 armcpu_t NDS_ARM9;
 
+DecodedOp decode_cache[2][DECODE_CACHE_SIZE];
+
+void decode_cache_reset(int PROCNUM)
+{
+	for (uint32_t i = 0; i < DECODE_CACHE_SIZE; ++i)
+		decode_cache[PROCNUM][i].tag = DECODE_CACHE_INVALID;
+}
+
 int armcpu_new(armcpu_t *armcpu, uint32_t id)
 {
 	armcpu->proc_ID = id;
@@ -94,6 +102,9 @@ void armcpu_init(armcpu_t *armcpu, uint32_t adr)
 
 	armcpu->next_instruction = adr;
 
+	// memory has been reloaded behind the write hooks' back by now
+	decode_cache_reset(armcpu->proc_ID);
+
 	armcpu_prefetch(armcpu);
 }
 
@@ -209,7 +220,9 @@ template<uint32_t PROCNUM> static inline uint32_t armcpu_prefetch()
 		armcpu->instruct_adr = curInstruction;
 		armcpu->next_instruction = curInstruction + 4;
 		armcpu->R[15] = curInstruction + 8;
-		armcpu->instruction = _MMU_read32<PROCNUM, MMU_AT_CODE>(curInstruction);
+		const DecodedOp &op = armcpu_decode<PROCNUM, false>(curInstruction);
+		armcpu->instruction = op.opcode;
+		armcpu->instruction_handler = op.handler;
 
 		return MMU_codeFetchCycles<PROCNUM, 32>(curInstruction);
 	}
@@ -219,7 +232,9 @@ template<uint32_t PROCNUM> static inline uint32_t armcpu_prefetch()
 	armcpu->instruct_adr = curInstruction;
 	armcpu->next_instruction = curInstruction + 2;
 	armcpu->R[15] = curInstruction + 4;
-	armcpu->instruction = _MMU_read16<PROCNUM, MMU_AT_CODE>(curInstruction);
+	const DecodedOp &op = armcpu_decode<PROCNUM, true>(curInstruction);
+	armcpu->instruction = op.opcode;
+	armcpu->instruction_handler = op.handler;
 
 	if (!PROCNUM)
 	{
@@ -341,7 +356,7 @@ template<int PROCNUM> uint32_t armcpu_exec()
 #ifdef HAVE_LUA
 			CallRegisteredLuaMemHook(ARMPROC.instruct_adr, 4, ARMPROC.instruction, LUAMEMHOOK_EXEC); // should report even if condition=false?
 #endif
-			cExecute = arm_instructions_set[PROCNUM][INSTRUCTION_INDEX(ARMPROC.instruction)](ARMPROC.instruction);
+			cExecute = ARMPROC.instruction_handler(ARMPROC.instruction);
 		}
 		else
 			cExecute = 1; // If condition=false: 1S cycle
@@ -352,7 +367,7 @@ template<int PROCNUM> uint32_t armcpu_exec()
 #ifdef HAVE_LUA
 	CallRegisteredLuaMemHook(ARMPROC.instruct_adr, 2, ARMPROC.instruction, LUAMEMHOOK_EXEC);
 #endif
-	cExecute = thumb_instructions_set[PROCNUM][ARMPROC.instruction>>6](ARMPROC.instruction);
+	cExecute = ARMPROC.instruction_handler(ARMPROC.instruction);
 
 	cFetch = armcpu_prefetch<PROCNUM>();
 	return MMU_fetchExecuteCycles<PROCNUM>(cExecute, cFetch);
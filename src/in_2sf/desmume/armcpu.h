@@ -208,6 +208,9 @@ struct armcpu_t
 	// flag indicating if the processor is stalled (for debugging)
 	int stalled;
 
+	// handler for instruction, looked up by the same prefetch that fetched it
+	OpFunc instruction_handler;
+
 #if defined(_M_X64) || defined(__x86_64__)
 	uint8_t cond_table[16 * 16];
 #endif
@@ -224,6 +227,35 @@ uint32_t armcpu_Wait4IRQ(armcpu_t *cpu);
 
 extern armcpu_t NDS_ARM7, NDS_ARM9;
 
+// fetches the opcode at adr through the predecoded instruction cache, decoding it on a miss
+template<int PROCNUM, bool thumb> inline const DecodedOp &armcpu_decode(uint32_t adr)
+{
+	DecodedOp &op = DECODED_OP(adr, PROCNUM);
+	uint32_t tag = adr | thumb;
+	if (op.tag != tag)
+	{
+		if (thumb)
+		{
+			op.opcode = _MMU_read16<PROCNUM, MMU_AT_CODE>(adr);
+			op.handler = thumb_instructions_set[PROCNUM][op.opcode >> 6];
+		}
+		else
+		{
+			op.opcode = _MMU_read32<PROCNUM, MMU_AT_CODE>(adr);
+			op.handler = arm_instructions_set[PROCNUM][INSTRUCTION_INDEX(op.opcode)];
+		}
+		op.tag = tag;
+	}
+#ifdef _DEBUG
+	// a write path that missed decode_cache_invalidate would run the old opcode from here
+	else if (thumb)
+		assert((op.opcode == _MMU_read16<PROCNUM, MMU_AT_DEBUG>(adr)));
+	else
+		assert((op.opcode == _MMU_read32<PROCNUM, MMU_AT_DEBUG>(adr)));
+#endif
+	return op;
+}
+
 template<int PROCNUM> uint32_t armcpu_exec();
 #ifdef HAVE_JIT
 template<int PROCNUM, bool jit> uint32_t armcpu_exec();
@@ -17,6 +17,7 @@
 */
 
 #include <cmath>
+#include <cstring>
 #include "cp15.h"
 #include "MMU.h"
 #include "NDSSystem.h"
@@ -35,6 +36,92 @@ private:
 	u32 value;
 };
 
+// Guest memory as seen by the copy and decompression SWIs. The source and destination are resolved to host
+// pointers once per call when they lie in plain RAM, so the loops below don't go through the MMU for every unit;
+// anything outside those windows still does. Writes through the destination window are invalidated in one go
+// when the call returns instead of once per write.
+TEMPLATE struct BiosMem
+{
+	uint32_t srcBase, srcSize, dstBase, dstSize;
+	const uint8_t *src;
+	uint8_t *dst;
+
+	BiosMem() : srcBase(0), srcSize(0), dstBase(0), dstSize(0), src(nullptr), dst(nullptr) {}
+	~BiosMem()
+	{
+		if (dstSize)
+			MMU_invalidateRange(PROCNUM, dstBase, dstSize);
+	}
+
+	void map(uint32_t srcAdr, uint32_t srcWant, uint32_t dstAdr, uint32_t dstWant)
+	{
+		src = MMU_hostSpan(PROCNUM, srcAdr, srcWant, false, srcSize);
+		srcBase = srcAdr;
+		dst = MMU_hostSpan(PROCNUM, dstAdr, dstWant, true, dstSize);
+		dstBase = dstAdr;
+	}
+
+	// true when both windows cover everything asked for in map()
+	bool whole(uint32_t srcWant, uint32_t dstWant) const { return srcSize == srcWant && dstSize == dstWant; }
+
+	static bool inside(uint32_t ofs, uint32_t size, uint32_t width) { return ofs < size && size - ofs >= width; }
+
+	uint8_t read08(uint32_t adr) const
+	{
+		if (inside(adr - dstBase, dstSize, 1))
+			return T1ReadByte(dst, adr - dstBase);
+		if (inside(adr - srcBase, srcSize, 1))
+			return T1ReadByte(src, adr - srcBase);
+		return _MMU_read08<PROCNUM>(adr);
+	}
+
+	uint16_t read16(uint32_t adr) const
+	{
+		uint32_t a = adr & ~1;
+		if (inside(a - dstBase, dstSize, 2))
+			return T1ReadWord(dst, a - dstBase);
+		if (inside(a - srcBase, srcSize, 2))
+			return T1ReadWord(src, a - srcBase);
+		return _MMU_read16<PROCNUM>(adr);
+	}
+
+	uint32_t read32(uint32_t adr) const
+	{
+		uint32_t a = adr & ~3;
+		if (inside(a - dstBase, dstSize, 4))
+			return T1ReadLong(dst, a - dstBase);
+		if (inside(a - srcBase, srcSize, 4))
+			return T1ReadLong(src, a - srcBase);
+		return _MMU_read32<PROCNUM>(adr);
+	}
+
+	void write08(uint32_t adr, uint8_t val)
+	{
+		if (inside(adr - dstBase, dstSize, 1))
+			T1WriteByte(dst, adr - dstBase, val);
+		else
+			_MMU_write08<PROCNUM>(adr, val);
+	}
+
+	void write16(uint32_t adr, uint16_t val)
+	{
+		uint32_t a = adr & ~1;
+		if (inside(a - dstBase, dstSize, 2))
+			T1WriteWord(dst, a - dstBase, val);
+		else
+			_MMU_write16<PROCNUM>(adr, val);
+	}
+
+	void write32(uint32_t adr, uint32_t val)
+	{
+		uint32_t a = adr & ~3;
+		if (inside(a - dstBase, dstSize, 4))
+			T1WriteLong(dst, a - dstBase, val);
+		else
+			_MMU_write32<PROCNUM>(adr, val);
+	}
+};
+
 static const uint16_t getsinetbl[] =
 {
 	0x0000, 0x0324, 0x0648, 0x096A, 0x0C8C, 0x0FAB, 0x12C8, 0x15E2,
@@ -311,6 +398,7 @@ TEMPLATE static uint32_t copy()
 	uint32_t src = cpu->R[0];
 	uint32_t dst = cpu->R[1];
 	uint32_t cnt = cpu->R[2];
+	BiosMem<PROCNUM> mem;
 
 	switch (BIT26(cnt))
 	{
@@ -321,9 +409,16 @@ TEMPLATE static uint32_t copy()
 			{
 				case 0:
 					cnt &= 0x1FFFFF;
+					mem.map(src, cnt * 2, dst, cnt * 2);
+					if (cnt && mem.whole(cnt * 2, cnt * 2) && (mem.dst <= mem.src || mem.dst >= mem.src + cnt * 2))
+					{
+						// no overlap that the forward copy below would smear
+						std::memmove(mem.dst, mem.src, cnt * 2);
+						break;
+					}
 					while (cnt)
 					{
-						_MMU_write16<PROCNUM>(dst, _MMU_read16<PROCNUM>(src));
+						mem.write16(dst, mem.read16(src));
 						--cnt;
 						dst += 2;
 						src += 2;
@@ -331,11 +426,12 @@ TEMPLATE static uint32_t copy()
 					break;
 				case 1:
 				{
-					uint16_t val = _MMU_read16<PROCNUM>(src);
 					cnt &= 0x1FFFFF;
+					mem.map(src, 2, dst, cnt * 2);
+					uint16_t val = mem.read16(src);
 					while (cnt)
 					{
-						_MMU_write16<PROCNUM>(dst, val);
+						mem.write16(dst, val);
 						--cnt;
 						dst += 2;
 					}
@@ -350,9 +446,15 @@ TEMPLATE static uint32_t copy()
 			{
 				case 0:
 					cnt &= 0x1FFFFF;
+					mem.map(src, cnt * 4, dst, cnt * 4);
+					if (cnt && mem.whole(cnt * 4, cnt * 4) && (mem.dst <= mem.src || mem.dst >= mem.src + cnt * 4))
+					{
+						std::memmove(mem.dst, mem.src, cnt * 4);
+						break;
+					}
 					while (cnt)
 					{
-						_MMU_write32<PROCNUM>(dst, _MMU_read32<PROCNUM>(src));
+						mem.write32(dst, mem.read32(src));
 						--cnt;
 						dst += 4;
 						src += 4;
@@ -360,11 +462,12 @@ TEMPLATE static uint32_t copy()
 					break;
 				case 1:
 				{
-					uint32_t val = _MMU_read32<PROCNUM>(src);
 					cnt &= 0x1FFFFF;
+					mem.map(src, 4, dst, cnt * 4);
+					uint32_t val = mem.read32(src);
 					while (cnt)
 					{
-						_MMU_write32<PROCNUM>(dst, val);
+						mem.write32(dst, val);
 						--cnt;
 						dst += 4;
 					}
@@ -381,14 +484,21 @@ TEMPLATE static uint32_t fastCopy()
 	uint32_t src = cpu->R[0] & 0xFFFFFFFC;
 	uint32_t dst = cpu->R[1] & 0xFFFFFFFC;
 	uint32_t cnt = cpu->R[2];
+	BiosMem<PROCNUM> mem;
 
 	switch (BIT24(cnt))
 	{
 		case 0:
 			cnt &= 0x1FFFFF;
+			mem.map(src, cnt * 4, dst, cnt * 4);
+			if (cnt && mem.whole(cnt * 4, cnt * 4) && (mem.dst <= mem.src || mem.dst >= mem.src + cnt * 4))
+			{
+				std::memmove(mem.dst, mem.src, cnt * 4);
+				break;
+			}
 			while (cnt)
 			{
-				_MMU_write32<PROCNUM>(dst, _MMU_read32<PROCNUM>(src));
+				mem.write32(dst, mem.read32(src));
 				--cnt;
 				dst += 4;
 				src += 4;
@@ -396,11 +506,12 @@ TEMPLATE static uint32_t fastCopy()
 			break;
 		case 1:
 		{
-			uint32_t val = _MMU_read32<PROCNUM>(src);
 			cnt &= 0x1FFFFF;
+			mem.map(src, 4, dst, cnt * 4);
+			uint32_t val = mem.read32(src);
 			while (cnt)
 			{
-				_MMU_write32<PROCNUM>(dst, val);
+				mem.write32(dst, val);
 				--cnt;
 				dst += 4;
 			}
@@ -420,15 +531,17 @@ TEMPLATE static uint32_t LZ77UnCompVram()
 	if (!(source & 0xe000000) || !((source + ((header >> 8) & 0x1fffff)) & 0xe000000))
 		return 0;
 
+	int len = header >> 8;
+	BiosMem<PROCNUM> mem;
+	mem.map(source, len + len / 8 + 1, dest, (len + 1) & ~1);
+
 	int byteCount = 0;
 	int byteShift = 0;
 	uint32_t writeValue = 0;
 
-	int len = header >> 8;
-
 	while (len > 0)
 	{
-		uint8_t d = _MMU_read08<PROCNUM>(source++);
+		uint8_t d = mem.read08(source++);
 
 		int i1, i2;
 		if (d)
@@ -437,20 +550,20 @@ TEMPLATE static uint32_t LZ77UnCompVram()
 			{
 				if (d & 0x80)
 				{
-					uint16_t data = _MMU_read08<PROCNUM>(source++) << 8;
-					data |= _MMU_read08<PROCNUM>(source++);
+					uint16_t data = mem.read08(source++) << 8;
+					data |= mem.read08(source++);
 					int length = (data >> 12) + 3;
 					int offset = data & 0x0FFF;
 					uint32_t windowOffset = dest + byteCount - offset - 1;
 					for (i2 = 0; i2 < length; ++i2)
 					{
-						writeValue |= _MMU_read08<PROCNUM>(windowOffset++) << byteShift;
+						writeValue |= mem.read08(windowOffset++) << byteShift;
 						byteShift += 8;
 						++byteCount;
 
 						if (byteCount == 2)
 						{
-							_MMU_write16<PROCNUM>(dest, writeValue & 0xFFFF);
+							mem.write16(dest, writeValue & 0xFFFF);
 							dest += 2;
 							byteCount = 0;
 							byteShift = 0;
@@ -463,12 +576,12 @@ TEMPLATE static uint32_t LZ77UnCompVram()
 				}
 				else
 				{
-					writeValue |= _MMU_read08<PROCNUM>(source++) << byteShift;
+					writeValue |= mem.read08(source++) << byteShift;
 					byteShift += 8;
 					++byteCount;
 					if (byteCount == 2)
 					{
-						_MMU_write16<PROCNUM>(dest, writeValue & 0xFFFF);
+						mem.write16(dest, writeValue & 0xFFFF);
 						dest += 2;
 						byteCount = 0;
 						byteShift = 0;
@@ -485,12 +598,12 @@ TEMPLATE static uint32_t LZ77UnCompVram()
 		{
 			for (i1 = 0; i1 < 8; ++i1)
 			{
-				writeValue |= _MMU_read08<PROCNUM>(source++) << byteShift;
+				writeValue |= mem.read08(source++) << byteShift;
 				byteShift += 8;
 				++byteCount;
 				if (byteCount == 2)
 				{
-					_MMU_write16<PROCNUM>(dest, writeValue & 0xFFFF);
+					mem.write16(dest, writeValue & 0xFFFF);
 					dest += 2;
 					byteShift = 0;
 					byteCount = 0;
@@ -516,10 +629,12 @@ TEMPLATE static uint32_t LZ77UnCompWram()
 		return 0;
 
 	int len = header >> 8;
+	BiosMem<PROCNUM> mem;
+	mem.map(source, len + len / 8 + 1, dest, len);
 
 	while (len > 0)
 	{
-		uint8_t d = _MMU_read08<PROCNUM>(source++);
+		uint8_t d = mem.read08(source++);
 
 		int i1, i2;
 		if (d)
@@ -528,14 +643,14 @@ TEMPLATE static uint32_t LZ77UnCompWram()
 			{
 				if (d & 0x80)
 				{
-					uint16_t data = _MMU_read08<PROCNUM>(source++) << 8;
-					data |= _MMU_read08<PROCNUM>(source++);
+					uint16_t data = mem.read08(source++) << 8;
+					data |= mem.read08(source++);
 					int length = (data >> 12) + 3;
 					int offset = data & 0x0FFF;
 					uint32_t windowOffset = dest - offset - 1;
 					for (i2 = 0; i2 < length; ++i2)
 					{
-						_MMU_write08<PROCNUM>(dest++, _MMU_read08<PROCNUM>(windowOffset++));
+						mem.write08(dest++, mem.read08(windowOffset++));
 						--len;
 						if (!len)
 							return 0;
@@ -543,7 +658,7 @@ TEMPLATE static uint32_t LZ77UnCompWram()
 				}
 				else
 				{
-					_MMU_write08<PROCNUM>(dest++, _MMU_read08<PROCNUM>(source++));
+					mem.write08(dest++, mem.read08(source++));
 					--len;
 					if (!len)
 						return 0;
@@ -555,7 +670,7 @@ TEMPLATE static uint32_t LZ77UnCompWram()
 		{
 			for (i1 = 0; i1 < 8; ++i1)
 			{
-				_MMU_write08<PROCNUM>(dest++, _MMU_read08<PROCNUM>(source++));
+				mem.write08(dest++, mem.read08(source++));
 				--len;
 				if (!len)
 					return 0;
@@ -576,19 +691,22 @@ TEMPLATE static uint32_t RLUnCompVram()
 		return 0;
 
 	int len = header >> 8;
+	BiosMem<PROCNUM> mem;
+	mem.map(source, len * 2 + 1, dest, (len + 1) & ~1);
+
 	int byteCount = 0;
 	int byteShift = 0;
 	uint32_t writeValue = 0;
 
 	while (len > 0)
 	{
-		uint8_t d = _MMU_read08<PROCNUM>(source++);
+		uint8_t d = mem.read08(source++);
 		int l = d & 0x7F;
 
 		int i;
 		if (d & 0x80)
 		{
-			uint8_t data = _MMU_read08<PROCNUM>(source++);
+			uint8_t data = mem.read08(source++);
 			l += 3;
 			for (i = 0; i < l; ++i)
 			{
@@ -598,7 +716,7 @@ TEMPLATE static uint32_t RLUnCompVram()
 
 				if (byteCount == 2)
 				{
-					_MMU_write16<PROCNUM>(dest, writeValue & 0xFFFF);
+					mem.write16(dest, writeValue & 0xFFFF);
 					dest += 2;
 					byteCount = 0;
 					byteShift = 0;
@@ -614,13 +732,13 @@ TEMPLATE static uint32_t RLUnCompVram()
 			++l;
 			for (i = 0; i < l; ++i)
 			{
-				writeValue |= _MMU_read08<PROCNUM>(source++) << byteShift;
+				writeValue |= mem.read08(source++) << byteShift;
 				byteShift += 8;
 				++byteCount;
 
 				if (byteCount == 2)
 				{
-					_MMU_write16<PROCNUM>(dest, writeValue & 0xFFFF);
+					mem.write16(dest, writeValue & 0xFFFF);
 					dest += 2;
 					byteCount = 0;
 					byteShift = 0;
@@ -646,20 +764,22 @@ TEMPLATE static uint32_t RLUnCompWram()
 		return 0;
 
 	int len = header >> 8;
+	BiosMem<PROCNUM> mem;
+	mem.map(source, len * 2 + 1, dest, len);
 
 	while (len > 0)
 	{
-		uint8_t d = _MMU_read08<PROCNUM>(source++);
+		uint8_t d = mem.read08(source++);
 		int l = d & 0x7F;
 
 		int i;
 		if (d & 0x80)
 		{
-			uint8_t data = _MMU_read08<PROCNUM>(source++);
+			uint8_t data = mem.read08(source++);
 			l += 3;
 			for (i = 0; i < l; ++i)
 			{
-				_MMU_write08<PROCNUM>(dest++, data);
+				mem.write08(dest++, data);
 				--len;
 				if (!len)
 					return 0;
@@ -670,7 +790,7 @@ TEMPLATE static uint32_t RLUnCompWram()
 			++l;
 			for (i = 0; i < l; ++i)
 			{
-				_MMU_write08<PROCNUM>(dest++,  _MMU_read08<PROCNUM>(source++));
+				mem.write08(dest++,  mem.read08(source++));
 				--len;
 				if (!len)
 					return 0;
@@ -690,20 +810,23 @@ TEMPLATE static uint32_t UnCompHuffman()
 	if (!(source & 0xe000000) || !((source + ((header >> 8) & 0x1fffff)) & 0xe000000))
 		return 0;
 
-	uint8_t treeSize = _MMU_read08<PROCNUM>(source++);
+	int len = header >> 8;
+	BiosMem<PROCNUM> mem;
+	// the tree is at most 512 bytes; the bitstream is usually shorter than the output
+	mem.map(source, 0x200 + len, dest, (len + 3) & ~3);
+
+	uint8_t treeSize = mem.read08(source++);
 
 	uint32_t treeStart = source;
 
 	source += ((treeSize + 1) << 1) - 1; // minus because we already skipped one byte
 
-	int len = header >> 8;
-
 	uint32_t mask = 0x80000000;
-	uint32_t data = _MMU_read32<PROCNUM>(source);
+	uint32_t data = mem.read32(source);
 	source += 4;
 
 	int pos = 0;
-	uint8_t rootNode = _MMU_read08<PROCNUM>(treeStart);
+	uint8_t rootNode = mem.read08(treeStart);
 	uint8_t currentNode = rootNode;
 	int writeData = 0;
 	int byteShift = 0;
@@ -725,14 +848,14 @@ TEMPLATE static uint32_t UnCompHuffman()
 				// right
 				if (currentNode & 0x40)
 					writeData = 1;
-				currentNode = _MMU_read08<PROCNUM>(treeStart + pos + 1);
+				currentNode = mem.read08(treeStart + pos + 1);
 			}
 			else
 			{
 				// left
 				if (currentNode & 0x80)
 					writeData = 1;
-				currentNode = _MMU_read08<PROCNUM>(treeStart + pos);
+				currentNode = mem.read08(treeStart + pos);
 			}
 
 			if (writeData)
@@ -749,7 +872,7 @@ TEMPLATE static uint32_t UnCompHuffman()
 				{
 					byteCount = 0;
 					byteShift = 0;
-					_MMU_write32<PROCNUM>(dest, writeValue);
+					mem.write32(dest, writeValue);
 					writeValue = 0;
 					dest += 4;
 					len -= 4;
@@ -759,7 +882,7 @@ TEMPLATE static uint32_t UnCompHuffman()
 			if (!mask)
 			{
 				mask = 0x80000000;
-				data = _MMU_read32<PROCNUM>(source);
+				data = mem.read32(source);
 				source += 4;
 			}
 		}
@@ -781,14 +904,14 @@ TEMPLATE static uint32_t UnCompHuffman()
 				// right
 				if (currentNode & 0x40)
 					writeData = 1;
-				currentNode = _MMU_read08<PROCNUM>(treeStart + pos + 1);
+				currentNode = mem.read08(treeStart + pos + 1);
 			}
 			else
 			{
 				// left
 				if (currentNode & 0x80)
 					writeData = 1;
-				currentNode = _MMU_read08<PROCNUM>(treeStart + pos);
+				currentNode = mem.read08(treeStart + pos);
 			}
 
 			if (writeData)
@@ -812,7 +935,7 @@ TEMPLATE static uint32_t UnCompHuffman()
 					{
 						byteCount = 0;
 						byteShift = 0;
-						_MMU_write32<PROCNUM>(dest, writeValue);
+						mem.write32(dest, writeValue);
 						dest += 4;
 						writeValue = 0;
 						len -= 4;
@@ -826,7 +949,7 @@ TEMPLATE static uint32_t UnCompHuffman()
 			if (!mask)
 			{
 				mask = 0x80000000;
-				data = _MMU_read32<PROCNUM>(source);
+				data = mem.read32(source);
 				source += 4;
 			}
 		}
@@ -871,6 +994,9 @@ TEMPLATE static uint32_t BitUnPack()
 	int addBase = base & 0x80000000 ? 1 : 0;
 	base &= 0x7fffffff;
 
+	BiosMem<PROCNUM> mem;
+	mem.map(source, len, dest, ((len * 8 / bits) * dataSize + 31) / 32 * 4);
+
 	int data = 0;
 	int bitwritecount = 0;
 	while (1)
@@ -879,7 +1005,7 @@ TEMPLATE static uint32_t BitUnPack()
 		if (len < 0)
 			break;
 		int mask = 0xff >> revbits;
-		uint8_t b = _MMU_read08<PROCNUM>(source);
+		uint8_t b = mem.read08(source);
 		++source;
 		int bitcount = 0;
 		while (1)
@@ -894,7 +1020,7 @@ TEMPLATE static uint32_t BitUnPack()
 			bitwritecount += dataSize;
 			if (bitwritecount >= 32)
 			{
-				_MMU_write32<PROCNUM>(dest, data);
+				mem.write32(dest, data);
 				dest += 4;
 				data = 0;
 				bitwritecount = 0;
@@ -920,15 +1046,18 @@ TEMPLATE static uint32_t Diff8bitUnFilterWram()
       return 0;
   }
 
-	uint8_t data = _MMU_read08<PROCNUM>(source++);
-	_MMU_write08<PROCNUM>(dest++, data);
+	BiosMem<PROCNUM> mem;
+	mem.map(source, len, dest, len);
+
+	uint8_t data = mem.read08(source++);
+	mem.write08(dest++, data);
 	--len;
 
 	while (len > 0)
 	{
-		uint8_t diff = _MMU_read08<PROCNUM>(source++);
+		uint8_t diff = mem.read08(source++);
 		data += diff;
-		_MMU_write08<PROCNUM>(dest++, data);
+		mem.write08(dest++, data);
 		--len;
 	}
 	return 1;
@@ -942,19 +1071,21 @@ TEMPLATE static uint32_t Diff16bitUnFilter()
 	source += 4;
 
 	int len = header.DecompressedSize();
+	BiosMem<PROCNUM> mem;
+	mem.map(source, (len + 1) & ~1, dest, (len + 1) & ~1);
 
-	uint16_t data = _MMU_read16<PROCNUM>(source);
+	uint16_t data = mem.read16(source);
 	source += 2;
-	_MMU_write16<PROCNUM>(dest, data);
+	mem.write16(dest, data);
 	dest += 2;
 	len -= 2;
 
 	while (len >= 2)
 	{
-		uint16_t diff = _MMU_read16<PROCNUM>(source);
+		uint16_t diff = mem.read16(source);
 		source += 2;
 		data += diff;
-		_MMU_write16<PROCNUM>(dest, data);
+		mem.write16(dest, data);
 		dest += 2;
 		len -= 2;
 	}
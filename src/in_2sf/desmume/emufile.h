@@ -68,6 +68,8 @@ public:
 	// virtuals
 	virtual size_t _fread(void *ptr, size_t bytes) = 0;
 
+	virtual void fwrite(const void *ptr, size_t bytes) = 0;
+
 	virtual int fseek(int offset, int origin) = 0;
 
 	virtual size_t ftell() = 0;
@@ -120,6 +122,16 @@ public:
 
 	virtual size_t _fread(void *ptr, size_t bytes);
 
+	virtual void fwrite(const void *ptr, size_t bytes)
+	{
+		if (!bytes)
+			return;
+		this->reserve(this->pos + bytes);
+		memcpy(&(*this->vec)[this->pos], ptr, bytes);
+		this->pos += bytes;
+		this->len = std::max(this->pos, this->len);
+	}
+
 	virtual int fseek(int offset, int origin)
 	{
 		// work differently for read-only...?
@@ -187,6 +199,13 @@ public:
 		return ret;
 	}
 
+	virtual void fwrite(const void *ptr, size_t bytes)
+	{
+		size_t ret = ::fwrite(ptr, 1, bytes, this->fp);
+		if (ret < bytes)
+			this->failbit = true;
+	}
+
 	virtual int fseek(int offset, int origin)
 	{
 		return ::fseek(this->fp, offset, origin);
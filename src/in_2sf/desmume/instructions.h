@@ -22,3 +22,39 @@ extern const OpFunc arm_instructions_set[2][4096];
 extern const char *arm_instruction_names[4096];
 extern const OpFunc thumb_instructions_set[2][1024];
 extern const char *thumb_instruction_names[1024];
+
+// Predecoded instruction cache for the interpreter, direct-mapped on the instruction address.
+// The tag is the address with bit 0 set for thumb code. Entries are dropped by the same MMU write hooks that
+// clear JIT_COMPILED_FUNC; both cpus are invalidated since code can be written by either one.
+struct DecodedOp
+{
+	uint32_t tag;
+	uint32_t opcode;
+	OpFunc handler;
+};
+
+const uint32_t DECODE_CACHE_SIZE = 1 << 14;
+const uint32_t DECODE_CACHE_INVALID = 0xFFFFFFFF;
+extern DecodedOp decode_cache[2][DECODE_CACHE_SIZE];
+
+inline DecodedOp &DECODED_OP(uint32_t adr, int PROCNUM) { return decode_cache[PROCNUM][(adr >> 1) & (DECODE_CACHE_SIZE - 1)]; }
+
+// drops every arm or thumb opcode a SIZE byte write to adr may overlap
+template<int SIZE> inline void decode_cache_invalidate(uint32_t adr)
+{
+	uint32_t arm = (adr >> 1) & (DECODE_CACHE_SIZE - 2);
+	uint32_t thumb = SIZE == 4 ? arm + 1 : (adr >> 1) & (DECODE_CACHE_SIZE - 1);
+	decode_cache[0][arm].tag = decode_cache[0][thumb].tag = DECODE_CACHE_INVALID;
+	decode_cache[1][arm].tag = decode_cache[1][thumb].tag = DECODE_CACHE_INVALID;
+}
+
+// drops every opcode overlapping [adr, adr + size), for bulk writes
+inline void decode_cache_invalidate_range(uint32_t adr, uint32_t size)
+{
+	if (size >= DECODE_CACHE_SIZE * 2)
+		size = DECODE_CACHE_SIZE * 2; // every slot
+	for (uint32_t ofs = 0; ofs < size + (adr & 1); ofs += 2)
+		decode_cache_invalidate<2>((adr & ~1) + ofs);
+}
+
+void decode_cache_reset(int PROCNUM);
@@ -0,0 +1,299 @@
+/*
+	Copyright (C) 2006 Normmatt
+	Copyright (C) 2006 Theo Berkau
+	Copyright (C) 2008-2012 DeSmuME team
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+#include "saveStates.h"
+#include "NDSSystem.h"
+#include "MMU.h"
+#include "armcpu.h"
+#include "cp15.h"
+#include "instructions.h"
+#ifdef HAVE_JIT
+# include "arm_jit.h"
+#endif
+#include "../spu/samplecache.h"
+
+static const uint32_t SAVESTATE_MAGIC = 0x54535344; // "DSST"
+static const uint32_t SAVESTATE_VERSION = 1;
+
+// Unchanged stretches shorter than this are stored along with the changes around them
+static const size_t DELTA_MIN_SKIP = 16;
+
+struct SaveStateHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t size; // of the state itself
+	uint32_t payloadSize; // after delta encoding, before compression
+	uint32_t reference; // hash of the reference a delta was taken against
+};
+
+static std::vector<uint8_t> reference;
+static uint32_t referenceHash;
+
+// FNV-1a
+static uint32_t savestate_hash(const std::vector<uint8_t> &data)
+{
+	uint32_t hash = 0x811C9DC5;
+	for (uint8_t b : data)
+		hash = (hash ^ b) * 0x01000193;
+	return hash;
+}
+
+// the prefetched opcode is stored, so its handler is looked up again rather than refetched
+template<bool SAVE> static void armcpu_state(armcpu_t *armcpu, EMUFILE *f)
+{
+	savestate_field<SAVE>(f, armcpu->instruction);
+	savestate_field<SAVE>(f, armcpu->instruct_adr);
+	savestate_field<SAVE>(f, armcpu->next_instruction);
+	savestate_field<SAVE>(f, armcpu->R);
+	savestate_field<SAVE>(f, armcpu->CPSR);
+	savestate_field<SAVE>(f, armcpu->SPSR);
+	savestate_field<SAVE>(f, armcpu->R13_usr);
+	savestate_field<SAVE>(f, armcpu->R14_usr);
+	savestate_field<SAVE>(f, armcpu->R13_svc);
+	savestate_field<SAVE>(f, armcpu->R14_svc);
+	savestate_field<SAVE>(f, armcpu->R13_abt);
+	savestate_field<SAVE>(f, armcpu->R14_abt);
+	savestate_field<SAVE>(f, armcpu->R13_und);
+	savestate_field<SAVE>(f, armcpu->R14_und);
+	savestate_field<SAVE>(f, armcpu->R13_irq);
+	savestate_field<SAVE>(f, armcpu->R14_irq);
+	savestate_field<SAVE>(f, armcpu->R8_fiq);
+	savestate_field<SAVE>(f, armcpu->R9_fiq);
+	savestate_field<SAVE>(f, armcpu->R10_fiq);
+	savestate_field<SAVE>(f, armcpu->R11_fiq);
+	savestate_field<SAVE>(f, armcpu->R12_fiq);
+	savestate_field<SAVE>(f, armcpu->R13_fiq);
+	savestate_field<SAVE>(f, armcpu->R14_fiq);
+	savestate_field<SAVE>(f, armcpu->SPSR_svc);
+	savestate_field<SAVE>(f, armcpu->SPSR_abt);
+	savestate_field<SAVE>(f, armcpu->SPSR_und);
+	savestate_field<SAVE>(f, armcpu->SPSR_irq);
+	savestate_field<SAVE>(f, armcpu->SPSR_fiq);
+	savestate_field<SAVE>(f, armcpu->intVector);
+	savestate_field<SAVE>(f, armcpu->LDTBit);
+	savestate_field<SAVE>(f, armcpu->waitIRQ);
+	savestate_field<SAVE>(f, armcpu->halt_IE_and_IF);
+	savestate_field<SAVE>(f, armcpu->intrWaitARM_state);
+
+	if (!SAVE)
+	{
+		if (armcpu->CPSR.bits.T)
+			armcpu->instruction_handler = thumb_instructions_set[armcpu->proc_ID][armcpu->instruction >> 6];
+		else
+			armcpu->instruction_handler = arm_instructions_set[armcpu->proc_ID][INSTRUCTION_INDEX(armcpu->instruction)];
+	}
+}
+
+template<bool SAVE> static void cp15_state(EMUFILE *f)
+{
+	armcp15_t state = cp15;
+	state.cpu = nullptr;
+	savestate_field<SAVE>(f, state);
+	if (!SAVE)
+	{
+		state.cpu = cp15.cpu;
+		cp15 = state;
+	}
+}
+
+template<bool SAVE> static bool savestate_state(EMUFILE *f)
+{
+	if (!MMU_state<SAVE>(f))
+		return false;
+	armcpu_state<SAVE>(&NDS_ARM9, f);
+	armcpu_state<SAVE>(&NDS_ARM7, f);
+	cp15_state<SAVE>(f);
+	return NDS_state<SAVE>(f) && SPU_state<SAVE>(f);
+}
+
+static void savestate_take(std::vector<uint8_t> &state)
+{
+	state.clear();
+	state.reserve(reference.size());
+	EMUFILE_MEMORY os(&state);
+	savestate_state<true>(&os);
+}
+
+// Changed stretches of state as (unchanged bytes skipped, changed bytes, the bytes themselves).
+// Past the end of the reference, the state is compared against zeroes.
+static void savestate_deltaEncode(const std::vector<uint8_t> &state, std::vector<uint8_t> &out)
+{
+	auto ref = [](size_t pos) { return pos < reference.size() ? reference[pos] : 0; };
+	auto put32 = [&out](uint32_t val) { out.insert(out.end(), reinterpret_cast<uint8_t *>(&val), reinterpret_cast<uint8_t *>(&val) + 4); };
+
+	size_t size = state.size(), common = std::min(size, reference.size()), pos = 0, last = 0;
+	while (pos < size)
+	{
+		// find the next change, a word at a time where both sides have one
+		while (pos + 8 <= common && !memcmp(&state[pos], &reference[pos], 8))
+			pos += 8;
+		while (pos < size && state[pos] == ref(pos))
+			++pos;
+		if (pos == size)
+			break;
+
+		// and where it ends: the next unchanged stretch long enough to be worth skipping
+		size_t end = pos, same = 0;
+		for (; end < size && same < DELTA_MIN_SKIP; ++end)
+			same = state[end] == ref(end) ? same + 1 : 0;
+		end -= same;
+
+		put32(pos - last);
+		put32(end - pos);
+		out.insert(out.end(), state.begin() + pos, state.begin() + end);
+		pos = last = end;
+	}
+}
+
+static bool savestate_deltaDecode(const uint8_t *in, size_t inSize, std::vector<uint8_t> &state, size_t size)
+{
+	state.assign(reference.begin(), reference.begin() + std::min(size, reference.size()));
+	state.resize(size);
+
+	size_t pos = 0;
+	for (size_t i = 0; i + 8 <= inSize; )
+	{
+		uint32_t skip, count;
+		memcpy(&skip, in + i, 4);
+		memcpy(&count, in + i + 4, 4);
+		i += 8;
+		pos += skip;
+		if (pos > size || count > size - pos || count > inSize - i)
+			return false;
+		if (count)
+			memcpy(&state[pos], in + i, count);
+		i += count;
+		pos += count;
+	}
+	return true;
+}
+
+void savestate_setReference()
+{
+	savestate_take(reference);
+	referenceHash = savestate_hash(reference);
+}
+
+void savestate_clearReference()
+{
+	std::vector<uint8_t>().swap(reference);
+	referenceHash = 0;
+}
+
+bool savestate_save(std::vector<uint8_t> &out, int flags)
+{
+#ifndef HAVE_LIBZ
+	flags &= ~SAVESTATE_COMPRESS;
+#endif
+	if ((flags & SAVESTATE_DELTA) && reference.empty())
+		return false;
+
+	std::vector<uint8_t> state, delta;
+	savestate_take(state);
+	const std::vector<uint8_t> *payload = &state;
+	if (flags & SAVESTATE_DELTA)
+	{
+		savestate_deltaEncode(state, delta);
+		payload = &delta;
+	}
+
+	SaveStateHeader header = { SAVESTATE_MAGIC, SAVESTATE_VERSION, static_cast<uint32_t>(flags), static_cast<uint32_t>(state.size()),
+		static_cast<uint32_t>(payload->size()), (flags & SAVESTATE_DELTA) ? referenceHash : 0 };
+	out.resize(sizeof(header));
+	memcpy(&out[0], &header, sizeof(header));
+
+#ifdef HAVE_LIBZ
+	if (flags & SAVESTATE_COMPRESS)
+	{
+		uLongf packedSize = compressBound(payload->size());
+		out.resize(sizeof(header) + packedSize);
+		if (compress2(&out[sizeof(header)], &packedSize, payload->empty() ? nullptr : &(*payload)[0], payload->size(), Z_BEST_SPEED) != Z_OK)
+			return false;
+		out.resize(sizeof(header) + packedSize);
+		return true;
+	}
+#endif
+	out.insert(out.end(), payload->begin(), payload->end());
+	return true;
+}
+
+bool savestate_load(const std::vector<uint8_t> &in)
+{
+	SaveStateHeader header;
+	if (in.size() < sizeof(header))
+		return false;
+	memcpy(&header, &in[0], sizeof(header));
+	if (header.magic != SAVESTATE_MAGIC || header.version != SAVESTATE_VERSION)
+		return false;
+	if ((header.flags & SAVESTATE_DELTA) && (reference.empty() || header.reference != referenceHash))
+	{
+		fprintf(stderr, "savestate: delta taken against a different reference\n");
+		return false;
+	}
+
+	const uint8_t *payload = &in[sizeof(header)];
+	size_t payloadSize = in.size() - sizeof(header);
+	std::vector<uint8_t> inflated;
+	if (header.flags & SAVESTATE_COMPRESS)
+	{
+#ifdef HAVE_LIBZ
+		inflated.resize(header.payloadSize);
+		uLongf size = header.payloadSize;
+		if (uncompress(inflated.empty() ? nullptr : &inflated[0], &size, payload, payloadSize) != Z_OK || size != header.payloadSize)
+			return false;
+		payload = inflated.empty() ? nullptr : &inflated[0];
+		payloadSize = size;
+#else
+		return false;
+#endif
+	}
+	else if (payloadSize != header.payloadSize)
+		return false;
+
+	std::vector<uint8_t> state;
+	if (header.flags & SAVESTATE_DELTA)
+	{
+		if (!savestate_deltaDecode(payload, payloadSize, state, header.size))
+			return false;
+	}
+	else
+		state.assign(payload, payload + payloadSize);
+	if (state.size() != header.size)
+		return false;
+
+	EMUFILE_MEMORY is(&state);
+	if (!savestate_state<false>(&is) || is.ftell() != state.size())
+		return false;
+
+	// everything cached from the old memory contents goes
+	decode_cache_reset(ARMCPU_ARM9);
+	decode_cache_reset(ARMCPU_ARM7);
+#ifdef HAVE_JIT
+	arm_jit_reset(CommonSettings.use_jit);
+#endif
+	sampleCache.clear();
+
+	return true;
+}
@@ -0,0 +1,76 @@
+/*
+	Copyright (C) 2006 Normmatt
+	Copyright (C) 2006 Theo Berkau
+	Copyright (C) 2008-2012 DeSmuME team
+
+	This file is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This file is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with the this software.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <type_traits>
+#include <vector>
+#include "types.h"
+#include "emufile.h"
+
+// Save states hold the emulated machine only (memory, both cpus, cp15, the sequencer, timers, DMA
+// and the SPU) and are restored into an emulator that was set up for the same rom with NDS_Reset.
+// Fields are stored in host order, so a state is only good for the build that wrote it; caches
+// derived from memory (decoded instructions, JIT blocks, decoded samples) are rebuilt on load.
+// Running on from a loaded state produces exactly the output the saved emulator would have.
+
+enum
+{
+	SAVESTATE_COMPRESS = 1, // deflate the state (needs HAVE_LIBZ)
+	SAVESTATE_DELTA = 2 // only store what changed since savestate_setReference
+};
+
+// Captures the current state (normally right after NDS_Reset) to delta encode against
+void savestate_setReference();
+void savestate_clearReference();
+
+bool savestate_save(std::vector<uint8_t> &out, int flags = 0);
+// On failure the emulator is left partially loaded and should be reset
+bool savestate_load(const std::vector<uint8_t> &in);
+
+// Moves plain data to or from a state, so the same field list serves saving and loading
+template<bool SAVE> inline void savestate_raw(EMUFILE *f, void *ptr, size_t bytes)
+{
+	if (SAVE)
+		f->fwrite(ptr, bytes);
+	else
+		f->fread(ptr, bytes);
+}
+
+template<bool SAVE, typename T> inline void savestate_field(EMUFILE *f, T &val)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "only plain data can go in a save state");
+	savestate_raw<SAVE>(f, &val, sizeof(val));
+}
+
+template<bool SAVE, typename T> inline void savestate_vector(EMUFILE *f, std::vector<T> &vec)
+{
+	uint32_t size = vec.size();
+	savestate_field<SAVE>(f, size);
+	if (!SAVE)
+		vec.resize(f->fail() ? 0 : size);
+	if (size && !vec.empty())
+		savestate_raw<SAVE>(f, &vec[0], size * sizeof(T));
+}
+
+// The parts held in statics of the modules that own them. These return false when the state
+// can't be read, or was saved from an emulator set up differently
+template<bool SAVE> bool MMU_state(EMUFILE *f);
+template<bool SAVE> bool NDS_state(EMUFILE *f);
+template<bool SAVE> bool SPU_state(EMUFILE *f);
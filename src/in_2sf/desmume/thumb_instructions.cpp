@@ -1157,3 +1157,10 @@ const OpFunc thumb_instructions_set[2][1024] =
 #undef TABDECL
 	}
 };
+
+const char *thumb_instruction_names[1024] =
+{
+#define TABDECL(x) #x
+#include "thumb_tabdef.inc"
+#undef TABDECL
+};
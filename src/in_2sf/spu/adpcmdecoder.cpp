@@ -38,6 +38,56 @@ AdpcmDecoder::AdpcmDecoder(int16_t initialPredictor, int16_t initialStep)
   // initializers only
 }
 
+namespace {
+  // Per step index and nibble: the signed predictor delta and the next step index
+  struct AdpcmTables
+  {
+    int32_t delta[maxAdpcmStep + 1][16];
+    int8_t nextIndex[maxAdpcmStep + 1][16];
+
+    AdpcmTables()
+    {
+      for (int index = 0; index <= maxAdpcmStep; index++) {
+        int16_t step = adpcmStep[index];
+        for (int value = 0; value < 16; value++) {
+          int32_t d = step >> 3;
+          if (value & 0x04) d += step;
+          if (value & 0x02) d += step >> 1;
+          if (value & 0x01) d += step >> 2;
+          if (value & 0x08) d = -d;
+          delta[index][value] = d;
+          nextIndex[index][value] = clamp<int8_t>(index + adpcmIndex[value & 0x07], 0, maxAdpcmStep);
+        }
+      }
+    }
+  };
+
+  const AdpcmTables adpcmTables;
+}
+
+template <typename T>
+void AdpcmDecoder::decode(const uint8_t* src, uint32_t length, T* dst)
+{
+  int32_t pred = predictor;
+  int idx = index;
+  for (uint32_t i = 0; i < length; i++) {
+    uint8_t data = src[i];
+    for (int half = 0; half < 2; half++) {
+      uint8_t value = half ? data >> 4 : data & 0x0f;
+      int32_t next = pred + adpcmTables.delta[idx][value];
+      // same clamping as getNextSample
+      pred = next == -0x8000 ? -0x8000 : clamp<int32_t>(next, -0x7fff, 0x7fff);
+      idx = adpcmTables.nextIndex[idx][value];
+      *dst++ = T(pred);
+    }
+  }
+  predictor = int16_t(pred);
+  index = int8_t(idx);
+}
+
+template void AdpcmDecoder::decode<int16_t>(const uint8_t* src, uint32_t length, int16_t* dst);
+template void AdpcmDecoder::decode<int32_t>(const uint8_t* src, uint32_t length, int32_t* dst);
+
 int16_t AdpcmDecoder::getNextSample(uint8_t value)
 {
   int16_t step = adpcmStep[index];
@@ -14,6 +14,10 @@ public:
   AdpcmDecoder(int16_t initialPredictor, int16_t initialStep);
   int16_t getNextSample(uint8_t value);
 
+  // Decodes length bytes (two samples each, low nibble first) from src into dst
+  template <typename T>
+  void decode(const uint8_t* src, uint32_t length, T* dst);
+
   std::vector<int16_t> decode(const std::vector<char>& data, uint32_t offset = 0, uint32_t length = 0);
   static std::vector<int16_t> decodeFile(const std::vector<char>& data, uint32_t offset = 0, uint32_t length = 0);
 };
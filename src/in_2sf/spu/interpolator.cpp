@@ -1,30 +1,43 @@
 #include "interpolator.h"
 #include <cmath>
+#include <cstring>
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
-static LinearInterpolator* iLin = new LinearInterpolator;
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define INTERPOLATOR_X86_SIMD 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define INTERPOLATOR_X86_SIMD 0
+#endif
+
+double CosineInterpolator::lut[8192];
 
 // Keep in the same order as SPUInterpolationMode
-IInterpolator* IInterpolator::allInterpolators[4] = {
+IInterpolator* IInterpolator::allInterpolators[5] = {
   nullptr,
-  iLin,
+  new LinearInterpolator,
   new CosineInterpolator,
-  new SharpIInterpolator
+  new SharpIInterpolator,
+  new SincInterpolator
 };
 
 static inline int32_t lerp(int32_t left, int32_t right, double weight)
 {
-  return (left * (1 - weight)) + (right * weight);
+  return LinearInterpolator::lerp(left, right, weight);
 }
 
-int32_t LinearInterpolator::interpolate(const std::vector<int32_t>& data, double time) const
+int32_t LinearInterpolator::interpolate(const std::vector<sample_t>& data, double time) const
 {
-  if (time < 0) {
-    return 0;
-  }
-  return lerp(data[time], data[time + 1], time - std::floor(time));
+  return interpolateAt(data, time);
 }
 
 CosineInterpolator::CosineInterpolator()
@@ -34,21 +47,20 @@ CosineInterpolator::CosineInterpolator()
   }
 }
 
-int32_t CosineInterpolator::interpolate(const std::vector<int32_t>& data, double time) const
+int32_t CosineInterpolator::interpolate(const std::vector<sample_t>& data, double time) const
 {
-  if (time < 0) {
-    return 0;
-  }
-  int32_t left = data[time];
-  int32_t right = data[time + 1];
-  double weight = time - std::floor(time);
-  return lut[size_t(weight * 8192)] * (right - left) + right;
+  return interpolateAt(data, time);
 }
 
-int32_t SharpIInterpolator::interpolate(const std::vector<int32_t>& data, double time) const
+int32_t SharpIInterpolator::interpolate(const std::vector<sample_t>& data, double time) const
+{
+  return interpolateAt(data, time);
+}
+
+int32_t SharpIInterpolator::interpolateAt(const std::vector<sample_t>& data, double time)
 {
   if (time <= 2) {
-    return iLin->interpolate(data, time);
+    return LinearInterpolator::interpolateAt(data, time);
   }
 
   size_t index = size_t(time);
@@ -81,3 +93,292 @@ int32_t SharpIInterpolator::interpolate(const std::vector<int32_t>& data, double
   }
   return result;
 }
+
+// ---------------------------------------------------------------------------
+// Fixed-point kernels
+//
+// Weights are taken from the top bits of the 32-bit fraction and stored as
+// int16 pairs/quads so that the SIMD versions can use a single multiply-add
+// per output. Linear and sinc weights are Q14; cosine needs Q13 because its
+// curve overshoots to about 2.07.
+
+namespace {
+  const int linearShift = 14;
+  const int cosineShift = 13;
+  const int sincShift = 14;
+  const int sincPhaseBits = 8;
+
+  struct KernelTables
+  {
+    int16_t cosine[8192][2];
+    int16_t sinc[1 << sincPhaseBits][4];
+
+    KernelTables()
+    {
+      for (int i = 0; i < 8192; i++) {
+        // same curve as CosineInterpolator: right + c * (right - left)
+        int c = int(std::floor((1.0 - std::cos(M_PI * i / 8192.0) * M_PI) * 0.5 * (1 << cosineShift) + 0.5));
+        cosine[i][0] = int16_t(-c);
+        cosine[i][1] = int16_t((1 << cosineShift) + c);
+      }
+      for (int phase = 0; phase < (1 << sincPhaseBits); phase++) {
+        double frac = double(phase) / (1 << sincPhaseBits);
+        double taps[4];
+        double sum = 0;
+        for (int k = 0; k < 4; k++) {
+          // taps sit at index - 1 .. index + 2
+          double x = frac - (k - 1);
+          taps[k] = !phase && k == 1 ? 1.0 : 2 * std::sin(M_PI * x) * std::sin(M_PI * x / 2) / (M_PI * M_PI * x * x);
+          sum += taps[k];
+        }
+        // normalise so that DC passes through unchanged
+        int total = 0;
+        for (int k = 0; k < 4; k++) {
+          sinc[phase][k] = int16_t(std::floor(taps[k] / sum * (1 << sincShift) + 0.5));
+          total += sinc[phase][k];
+        }
+        sinc[phase][1] += int16_t((1 << sincShift) - total);
+      }
+    }
+  };
+
+  const KernelTables tables;
+
+  inline uint32_t linearWeight(uint64_t pos) { return uint32_t(pos) >> (32 - linearShift); }
+  inline const int16_t* cosineWeights(uint64_t pos) { return tables.cosine[uint32_t(pos) >> 19]; }
+  inline const int16_t* sincWeights(uint64_t pos) { return tables.sinc[uint32_t(pos) >> (32 - sincPhaseBits)]; }
+
+  inline int32_t linearAt(const sample_t* data, uint64_t pos)
+  {
+    const sample_t* p = data + (pos >> 32);
+    int32_t w = int32_t(linearWeight(pos));
+    return (p[0] * ((1 << linearShift) - w) + p[1] * w) >> linearShift;
+  }
+
+  inline int32_t cosineAt(const sample_t* data, uint64_t pos)
+  {
+    const sample_t* p = data + (pos >> 32);
+    const int16_t* w = cosineWeights(pos);
+    return (p[0] * w[0] + p[1] * w[1]) >> cosineShift;
+  }
+
+  inline int32_t sincAt(const sample_t* data, uint64_t pos)
+  {
+    uint32_t index = uint32_t(pos >> 32);
+    const int16_t* w = sincWeights(pos);
+    // there is nothing before the first sample; repeat it
+    int32_t before = data[index ? index - 1 : 0];
+    const sample_t* p = data + index;
+    return (before * w[0] + p[0] * w[1] + p[1] * w[2] + p[2] * w[3]) >> sincShift;
+  }
+
+  void blockNone(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    const sample_t* p = data.data();
+    for (uint32_t i = 0; i < count; i++, pos += step) {
+      out[i] = p[pos >> 32];
+    }
+  }
+
+  void blockSharp(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    for (uint32_t i = 0; i < count; i++, pos += step) {
+      out[i] = SharpIInterpolator::interpolateAt(data, pos / 4294967296.0);
+    }
+  }
+
+#if !INTERPOLATOR_X86_SIMD || !SAMPLEDATA_INT16_STORAGE
+  void blockLinear(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    const sample_t* p = data.data();
+    for (uint32_t i = 0; i < count; i++, pos += step) {
+      out[i] = linearAt(p, pos);
+    }
+  }
+
+  void blockCosine(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    const sample_t* p = data.data();
+    for (uint32_t i = 0; i < count; i++, pos += step) {
+      out[i] = cosineAt(p, pos);
+    }
+  }
+
+  void blockSinc(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    const sample_t* p = data.data();
+    for (uint32_t i = 0; i < count; i++, pos += step) {
+      out[i] = sincAt(p, pos);
+    }
+  }
+#endif
+
+#if INTERPOLATOR_X86_SIMD && SAMPLEDATA_INT16_STORAGE
+  // Adjacent int16 samples packed into one lane, low sample in the low half
+  inline int32_t loadPair(const sample_t* p)
+  {
+    int32_t pair;
+    std::memcpy(&pair, p, sizeof(pair));
+    return pair;
+  }
+
+  inline int32_t linearPair(uint64_t pos)
+  {
+    uint32_t w = linearWeight(pos);
+    return int32_t(((1 << linearShift) - w) | (w << 16));
+  }
+
+  inline int32_t cosinePair(uint64_t pos)
+  {
+    int32_t pair;
+    std::memcpy(&pair, cosineWeights(pos), sizeof(pair));
+    return pair;
+  }
+
+  // Two-tap kernels: each output is one multiply-add of a sample pair and a weight pair
+  template <int32_t (*WEIGHTS)(uint64_t), int SHIFT>
+  void blockPairSSE2(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    const sample_t* p = data.data();
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+      alignas(16) int32_t samples[4], weights[4];
+      for (int k = 0; k < 4; k++, pos += step) {
+        samples[k] = loadPair(p + (pos >> 32));
+        weights[k] = WEIGHTS(pos);
+      }
+      __m128i sum = _mm_madd_epi16(_mm_load_si128(reinterpret_cast<const __m128i*>(samples)), _mm_load_si128(reinterpret_cast<const __m128i*>(weights)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_srai_epi32(sum, SHIFT));
+    }
+    for (; i < count; i++, pos += step) {
+      out[i] = (SHIFT == linearShift) ? linearAt(p, pos) : cosineAt(p, pos);
+    }
+  }
+
+  template <int32_t (*WEIGHTS)(uint64_t), int SHIFT>
+  TARGET_AVX2 void blockPairAVX2(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    const sample_t* p = data.data();
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+      alignas(32) int32_t samples[8], weights[8];
+      for (int k = 0; k < 8; k++, pos += step) {
+        samples[k] = loadPair(p + (pos >> 32));
+        weights[k] = WEIGHTS(pos);
+      }
+      __m256i sum = _mm256_madd_epi16(_mm256_load_si256(reinterpret_cast<const __m256i*>(samples)), _mm256_load_si256(reinterpret_cast<const __m256i*>(weights)));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_srai_epi32(sum, SHIFT));
+    }
+    for (; i < count; i++, pos += step) {
+      out[i] = (SHIFT == linearShift) ? linearAt(p, pos) : cosineAt(p, pos);
+    }
+  }
+
+  // Four-tap sinc: two multiply-adds per output, then a horizontal add
+  void blockSincSSE2(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    const sample_t* p = data.data();
+    uint32_t i = 0;
+    for (; i < count && !(pos >> 32); i++, pos += step) {
+      out[i] = sincAt(p, pos);
+    }
+    for (; i + 2 <= count; i += 2) {
+      __m128i taps0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + (pos >> 32) - 1));
+      __m128i weights0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(sincWeights(pos)));
+      pos += step;
+      __m128i taps1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + (pos >> 32) - 1));
+      __m128i weights1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(sincWeights(pos)));
+      pos += step;
+      __m128i sum = _mm_madd_epi16(_mm_unpacklo_epi64(taps0, taps1), _mm_unpacklo_epi64(weights0, weights1));
+      sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+      sum = _mm_srai_epi32(_mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 1, 2, 0)), sincShift);
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), sum);
+    }
+    for (; i < count; i++, pos += step) {
+      out[i] = sincAt(p, pos);
+    }
+  }
+
+  TARGET_AVX2 void blockSincAVX2(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count)
+  {
+    const sample_t* p = data.data();
+    uint32_t i = 0;
+    for (; i < count && !(pos >> 32); i++, pos += step) {
+      out[i] = sincAt(p, pos);
+    }
+    for (; i + 4 <= count; i += 4) {
+      alignas(32) int64_t taps[4], weights[4];
+      for (int k = 0; k < 4; k++, pos += step) {
+        std::memcpy(&taps[k], p + (pos >> 32) - 1, sizeof(taps[k]));
+        std::memcpy(&weights[k], sincWeights(pos), sizeof(weights[k]));
+      }
+      __m256i sum = _mm256_madd_epi16(_mm256_load_si256(reinterpret_cast<const __m256i*>(taps)), _mm256_load_si256(reinterpret_cast<const __m256i*>(weights)));
+      sum = _mm256_add_epi32(sum, _mm256_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+      sum = _mm256_srai_epi32(sum, sincShift);
+      // the four results sit in lanes 0, 2, 4 and 6
+      sum = _mm256_permutevar8x32_epi32(sum, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(sum));
+    }
+    for (; i < count; i++, pos += step) {
+      out[i] = sincAt(p, pos);
+    }
+  }
+
+  bool cpuHasAVX2()
+  {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+      return false;
+    }
+    __cpuid(info, 1);
+    // AVX and OSXSAVE, then check that the OS saves the YMM registers
+    if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6) {
+      return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & 0x20) != 0;
+#elif defined(__GNUC__)
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+  }
+#endif
+}
+
+InterpolateBlockFunc IInterpolator::blockKernel(int mode)
+{
+#if INTERPOLATOR_X86_SIMD && SAMPLEDATA_INT16_STORAGE
+  static const bool avx2 = cpuHasAVX2();
+  switch (mode) {
+    case 1: return avx2 ? blockPairAVX2<linearPair, linearShift> : blockPairSSE2<linearPair, linearShift>;
+    case 2: return avx2 ? blockPairAVX2<cosinePair, cosineShift> : blockPairSSE2<cosinePair, cosineShift>;
+    case 3: return blockSharp;
+    case 4: return avx2 ? blockSincAVX2 : blockSincSSE2;
+    default: return blockNone;
+  }
+#else
+  switch (mode) {
+    case 1: return blockLinear;
+    case 2: return blockCosine;
+    case 3: return blockSharp;
+    case 4: return blockSinc;
+    default: return blockNone;
+  }
+#endif
+}
+
+int32_t SincInterpolator::interpolate(const std::vector<sample_t>& data, double time) const
+{
+  return interpolateAt(data, time);
+}
+
+int32_t SincInterpolator::interpolateAt(const std::vector<sample_t>& data, double time)
+{
+  if (time < 0) {
+    return 0;
+  }
+  return sincAt(data.data(), uint64_t(time * 4294967296.0));
+}
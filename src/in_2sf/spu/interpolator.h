@@ -3,21 +3,49 @@
 
 #include <vector>
 #include <cstdint>
+#include <cmath>
+#include "sampledata.h"
+
+// Renders count samples of one channel into out, starting at pos and advancing
+// by step. Positions are 32.32 fixed point: whole samples in the high half.
+typedef void (*InterpolateBlockFunc)(const std::vector<sample_t>& data, uint64_t pos, uint64_t step, int32_t* out, uint32_t count);
 
 class IInterpolator
 {
 public:
   virtual ~IInterpolator() {}
 
-  virtual int32_t interpolate(const std::vector<int32_t>& data, double time) const = 0;
+  virtual int32_t interpolate(const std::vector<sample_t>& data, double time) const = 0;
+
+  static IInterpolator* allInterpolators[5];
 
-  static IInterpolator* allInterpolators[4];
+  // Fixed-point batch kernel for an SPUInterpolationMode, using SSE2 or AVX2
+  // where the CPU and sample storage allow it. These round differently from
+  // the double precision interpolate() above.
+  static InterpolateBlockFunc blockKernel(int mode);
 };
 
+// Each interpolator also exposes its kernel as a static interpolateAt() so
+// that hot loops which already know the mode can call it without going
+// through the vtable.
+
 class LinearInterpolator : public IInterpolator
 {
 public:
-  virtual int32_t interpolate(const std::vector<int32_t>& data, double time) const;
+  virtual int32_t interpolate(const std::vector<sample_t>& data, double time) const;
+
+  static inline int32_t interpolateAt(const std::vector<sample_t>& data, double time)
+  {
+    if (time < 0) {
+      return 0;
+    }
+    return lerp(data[time], data[time + 1], time - std::floor(time));
+  }
+
+  static inline int32_t lerp(int32_t left, int32_t right, double weight)
+  {
+    return (left * (1 - weight)) + (right * weight);
+  }
 };
 
 class CosineInterpolator : public IInterpolator
@@ -25,16 +53,38 @@ class CosineInterpolator : public IInterpolator
 public:
   CosineInterpolator();
 
-  virtual int32_t interpolate(const std::vector<int32_t>& data, double time) const;
+  virtual int32_t interpolate(const std::vector<sample_t>& data, double time) const;
+
+  static inline int32_t interpolateAt(const std::vector<sample_t>& data, double time)
+  {
+    if (time < 0) {
+      return 0;
+    }
+    int32_t left = data[time];
+    int32_t right = data[time + 1];
+    double weight = time - std::floor(time);
+    return lut[size_t(weight * 8192)] * (right - left) + right;
+  }
 
 private:
-  double lut[8192];
+  static double lut[8192];
 };
 
 class SharpIInterpolator : public IInterpolator
 {
 public:
-  virtual int32_t interpolate(const std::vector<int32_t>& data, double time) const;
+  virtual int32_t interpolate(const std::vector<sample_t>& data, double time) const;
+
+  static int32_t interpolateAt(const std::vector<sample_t>& data, double time);
+};
+
+// 4-tap Lanczos windowed sinc in fixed point; about as cheap as cosine
+class SincInterpolator : public IInterpolator
+{
+public:
+  virtual int32_t interpolate(const std::vector<sample_t>& data, double time) const;
+
+  static int32_t interpolateAt(const std::vector<sample_t>& data, double time);
 };
 
 
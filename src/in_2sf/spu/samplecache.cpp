@@ -1,32 +1,179 @@
 #include "samplecache.h"
+#include "../desmume/MMU.h"
+#include <cstring>
 
-static inline constexpr uint64_t makeKey(uint32_t base, uint16_t loop, uint32_t length)
+SampleCache sampleCache;
+uint16_t sampleCacheWatchedPages[0x10000];
+
+static const size_t defaultBudget = 64 << 20;
+
+static inline constexpr uint64_t makeKey(uint32_t base, uint16_t loop, uint32_t length, SampleData::Format format)
 {
   return
     // has to be 32-bit aligned, so 2 low bits aren't needed
     // has to fit in the memory map, so high 7 bits aren't needed
     (uint64_t(base & 0x01FFFFFC) >> 2) |
     // loop uses the full 16 bits
-    uint64_t(loop << 23) |
+    (uint64_t(loop) << 23) |
     // max length is 21 bits
-    (uint64_t(length & 0x1FFFFF) << 39);
+    (uint64_t(length & 0x1FFFFF) << 39) |
+    // the same bytes decode differently in each format
+    (uint64_t(format) << 60);
+}
+
+// Main memory is mirrored across its 16MB window; fold addresses onto the first copy
+static inline uint32_t canonicalAddr(uint32_t addr)
+{
+  addr &= 0x0FFFFFFF;
+  if ((addr & 0x0F000000) == 0x02000000) {
+    return 0x02000000 | (addr & _MMU_MAIN_MEM_MASK);
+  }
+  return addr;
+}
+
+SampleCache::SampleCache()
+: used(0), budget(defaultBudget), gen(0)
+{
+  // initializers only
 }
 
 const SampleData& SampleCache::getSample(uint32_t baseAddr, uint16_t loopStartWords, uint32_t loopLengthWords, SampleData::Format format)
 {
-  uint64_t key = makeKey(baseAddr, loopStartWords, loopLengthWords);
+  uint64_t key = makeKey(baseAddr, loopStartWords, loopLengthWords, format);
   auto iter = samples.find(key);
-  if (iter == samples.end()) {
-    iter = samples.emplace(
-      std::piecewise_construct,
-      std::forward_as_tuple(key),
-      std::forward_as_tuple(baseAddr, loopStartWords << 2, (loopStartWords + loopLengthWords) << 2, format)
-    ).first;
+  if (iter != samples.end()) {
+    lru.splice(lru.begin(), lru, iter->second.lru);
+    return iter->second.data;
   }
-  return iter->second;
+
+  iter = samples.emplace(
+    std::piecewise_construct,
+    std::forward_as_tuple(key),
+    std::forward_as_tuple(baseAddr, loopStartWords << 2, (loopStartWords + loopLengthWords) << 2, format)
+  ).first;
+  Entry& entry = iter->second;
+  // the loaders read loopStart + loopLength bytes as passed above
+  entry.start = canonicalAddr(baseAddr);
+  entry.end = entry.start + ((2 * loopStartWords + loopLengthWords) << 2);
+  entry.bytes = sizeof(Entry) + entry.data.capacity() * sizeof(sample_t);
+  entry.lru = lru.insert(lru.begin(), key);
+  used += entry.bytes;
+  watch(key, entry, 1);
+
+  // never evict the sample being returned; marking it played makes every other
+  // sample come up for eviction before it can reach the back again
+  entry.data.used = true;
+  while (used > budget && lru.size() > 1) {
+    evict();
+  }
+  return entry.data;
 }
 
 void SampleCache::clear()
 {
+  if (!samples.empty()) {
+    ++gen;
+  }
   samples.clear();
+  pages.clear();
+  lru.clear();
+  used = 0;
+  std::memset(sampleCacheWatchedPages, 0, sizeof(sampleCacheWatchedPages));
+}
+
+void SampleCache::invalidate(uint32_t addr, uint32_t size)
+{
+  if (!size) {
+    return;
+  }
+  uint32_t start = canonicalAddr(addr);
+  uint32_t end = start + size;
+  // erasing edits the page lists, so gather the hits first; a sample spanning
+  // several written pages is listed once per page
+  std::vector<uint64_t> hits;
+  for (uint32_t page = start >> 12, last = (end - 1) >> 12; page <= last; page++) {
+    auto iter = pages.find(page);
+    if (iter == pages.end()) {
+      continue;
+    }
+    for (uint64_t key : iter->second) {
+      const Entry& entry = samples.find(key)->second;
+      if (entry.start < end && start < entry.end) {
+        hits.push_back(key);
+      }
+    }
+  }
+  for (uint64_t key : hits) {
+    auto iter = samples.find(key);
+    if (iter != samples.end()) {
+      erase(iter);
+    }
+  }
+}
+
+void SampleCache::setBudget(size_t bytes)
+{
+  budget = bytes;
+  while (used > budget && !lru.empty()) {
+    evict();
+  }
+}
+
+void SampleCache::watch(uint64_t key, const Entry& entry, int delta)
+{
+  uint32_t firstPage = entry.start >> 12;
+  uint32_t lastPage = (entry.end - 1) >> 12;
+  for (uint32_t page = firstPage; page <= lastPage; page++) {
+    std::vector<uint64_t>& keys = pages[page];
+    if (delta > 0) {
+      keys.push_back(key);
+    } else {
+      for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] == key) {
+          keys[i] = keys.back();
+          keys.pop_back();
+          break;
+        }
+      }
+      if (keys.empty()) {
+        pages.erase(page);
+      }
+    }
+  }
+
+  uint32_t mirrors = 1;
+  uint32_t mirrorPages = 0;
+  if ((entry.start & 0x0F000000) == 0x02000000) {
+    mirrorPages = (_MMU_MAIN_MEM_MASK + 1) >> 12;
+    mirrors = 0x1000 / mirrorPages;
+  }
+  for (uint32_t m = 0; m < mirrors; m++) {
+    for (uint32_t page = firstPage; page <= lastPage; page++) {
+      sampleCacheWatchedPages[(page + m * mirrorPages) & 0xFFFF] += delta;
+    }
+  }
+}
+
+// Drops the least recently used sample. One played since it last came up goes back
+// to the front instead, so the list order only has to be kept up on getSample()
+void SampleCache::evict()
+{
+  for (;;) {
+    auto iter = samples.find(lru.back());
+    if (!iter->second.data.used) {
+      erase(iter);
+      return;
+    }
+    iter->second.data.used = false;
+    lru.splice(lru.begin(), lru, iter->second.lru);
+  }
+}
+
+void SampleCache::erase(std::unordered_map<uint64_t, Entry>::iterator iter)
+{
+  watch(iter->first, iter->second, -1);
+  used -= iter->second.bytes;
+  lru.erase(iter->second.lru);
+  samples.erase(iter);
+  ++gen;
 }
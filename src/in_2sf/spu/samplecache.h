@@ -2,15 +2,84 @@
 #define TWOSF2WAV_SAMPLECACHE_H
 
 #include <unordered_map>
+#include <list>
+#include <vector>
+#include <cstddef>
 #include "sampledata.h"
 
 class SampleCache {
 public:
+  SampleCache();
+
   const SampleData& getSample(uint32_t baseAddr, uint16_t loopStartWords, uint32_t loopLengthWords, SampleData::Format format);
   void clear();
 
+  // Drops every sample decoded from emulated memory in [addr, addr + size)
+  void invalidate(uint32_t addr, uint32_t size);
+
+  // Marks a sample handed out by getSample() as played. A channel binds its
+  // sample once, so this is what keeps a long note from looking unused
+  void touch(const SampleData& sample) { sample.used = true; }
+
+  // Least recently used samples are dropped once the decoded data exceeds this
+  void setBudget(size_t bytes);
+  size_t bytesUsed() const { return used; }
+
+  // Bumped whenever a sample is dropped; references handed out by getSample()
+  // are only valid while this is unchanged
+  uint32_t generation() const { return gen; }
+
 private:
-  std::unordered_map<uint64_t, SampleData> samples;
+  struct Entry {
+    Entry(uint32_t baseAddr, uint16_t loopStart, uint32_t loopLength, SampleData::Format format)
+    : data(baseAddr, loopStart, loopLength, format) {}
+
+    SampleData data;
+    uint32_t start, end;
+    size_t bytes;
+    std::list<uint64_t>::iterator lru;
+  };
+
+  void watch(uint64_t key, const Entry& entry, int delta);
+  void erase(std::unordered_map<uint64_t, Entry>::iterator iter);
+  void evict();
+
+  std::unordered_map<uint64_t, Entry> samples;
+  // Keys of the samples overlapping each 4KB page, by canonical address, so
+  // that a write only looks at the samples it can hit
+  std::unordered_map<uint32_t, std::vector<uint64_t>> pages;
+  std::list<uint64_t> lru;
+  size_t used;
+  size_t budget;
+  uint32_t gen;
 };
 
+// The cache the SPU decodes through. Memory writes are reported to it with
+// sampleCacheNotifyWrite so that it never plays stale data.
+extern SampleCache sampleCache;
+
+// Number of cached samples overlapping each 4KB page of the bus, mirrors included
+extern uint16_t sampleCacheWatchedPages[0x10000];
+
+inline void sampleCacheNotifyWrite(uint32_t addr, uint32_t size)
+{
+  if (sampleCacheWatchedPages[(addr >> 12) & 0xFFFF]) {
+    sampleCache.invalidate(addr, size);
+  }
+}
+
+// Same for a bulk write that may span several pages
+inline void sampleCacheNotifyWriteRange(uint32_t addr, uint32_t size)
+{
+  if (!size) {
+    return;
+  }
+  for (uint32_t page = addr >> 12, last = (addr + size - 1) >> 12; page <= last; page++) {
+    if (sampleCacheWatchedPages[page & 0xFFFF]) {
+      sampleCache.invalidate(addr, size);
+      return;
+    }
+  }
+}
+
 #endif
@@ -2,15 +2,16 @@
 #include "adpcmdecoder.h"
 #include "interpolator.h"
 #include "../desmume/MMU.h"
+#include <algorithm>
 
 SampleData::SampleData()
-: std::vector<int32_t>(), baseAddr(0), loopStart(0), loopLength(0)
+: std::vector<sample_t>(), baseAddr(0), loopStart(0), loopLength(0), used(false)
 {
   // initializers only
 }
 
 SampleData::SampleData(uint32_t _baseAddr, uint16_t _loopStart, uint32_t _loopLength, Format format)
-: std::vector<int32_t>(), baseAddr(_baseAddr), loopStart(_loopStart), loopLength(_loopLength)
+: std::vector<sample_t>(), baseAddr(_baseAddr), loopStart(_loopStart), loopLength(_loopLength), used(false)
 {
   if (format == Pcm8) {
     loadPcm8();
@@ -21,17 +22,59 @@ SampleData::SampleData(uint32_t _baseAddr, uint16_t _loopStart, uint32_t _loopLe
   }
 }
 
+// Host memory backing [addr, addr + length) when it is one contiguous run of
+// main memory or ARM7 WRAM, so a whole sample can be decoded without going
+// through the MMU for every byte; nullptr otherwise
+static const uint8_t* hostMemory(uint32_t addr, uint32_t length)
+{
+  if ((addr & 0x0F000000) == 0x02000000) {
+    uint32_t offset = addr & _MMU_MAIN_MEM_MASK;
+    if (offset + length <= _MMU_MAIN_MEM_MASK + 1) {
+      return MMU.MAIN_MEM + offset;
+    }
+  } else if ((addr & 0xFF800000) == 0x03800000) {
+    uint32_t offset = addr & 0xFFFF;
+    if (offset + length <= sizeof(MMU.ARM7_ERAM)) {
+      return MMU.ARM7_ERAM + offset;
+    }
+  }
+  return nullptr;
+}
+
+// Returns length bytes of emulated memory starting at addr, copied into
+// scratch through the MMU (WIDTH bytes at a time) if they aren't directly mapped
+template <int WIDTH>
+static const uint8_t* sampleMemory(uint32_t addr, uint32_t length, std::vector<uint8_t>& scratch)
+{
+  const uint8_t* host = hostMemory(addr, length);
+  if (host) {
+    return host;
+  }
+  scratch.resize(length + WIDTH);
+  for (uint32_t i = 0; i < length; i += WIDTH) {
+    if (WIDTH == 2) {
+      uint16_t value = _MMU_read16<ARMCPU_ARM7, MMU_AT_DEBUG>(addr + i);
+      scratch[i] = uint8_t(value);
+      scratch[i + 1] = uint8_t(value >> 8);
+    } else {
+      scratch[i] = _MMU_read08<ARMCPU_ARM7, MMU_AT_DEBUG>(addr + i);
+    }
+  }
+  return scratch.data();
+}
+
 void SampleData::loadPcm8()
 {
   loopStart += 3;
   resize(loopStart + (loopLength << 2));
-  for (uint32_t i = 3; i < loopStart; i++) {
-    (*this)[i] = int8_t(_MMU_read08<ARMCPU_ARM7, MMU_AT_DEBUG>(baseAddr + i - 3)) << 8;
-  }
   uint32_t length = loopStart + loopLength;
-  for (uint32_t i = loopStart; i < length; i++) {
-    (*this)[i] = (*this)[length + i] = int8_t(_MMU_read08<ARMCPU_ARM7, MMU_AT_DEBUG>(baseAddr + i - 3)) << 8;
+  std::vector<uint8_t> scratch;
+  const uint8_t* src = sampleMemory<1>(baseAddr, length - 3, scratch);
+  sample_t* dst = data();
+  for (uint32_t i = 3; i < length; i++) {
+    dst[i] = sample_t(int8_t(src[i - 3]) * 256);
   }
+  std::copy(dst + loopStart, dst + length, dst + length + loopStart);
 }
 
 void SampleData::loadPcm16()
@@ -40,16 +83,14 @@ void SampleData::loadPcm16()
   loopLength >>= 1;
   loopStart += 3;
   resize(loopStart + (loopLength << 2));
-  uint32_t addr = baseAddr;
-  for (uint32_t i = 3; i < loopStart; i++) {
-    (*this)[i] = int16_t(_MMU_read16<ARMCPU_ARM7, MMU_AT_DEBUG>(addr));
-    addr += 2;
-  }
   uint32_t length = loopStart + loopLength;
-  for (uint32_t i = loopStart; i < length; i++) {
-    (*this)[i] = (*this)[length + i] = int16_t(_MMU_read16<ARMCPU_ARM7, MMU_AT_DEBUG>(addr));
-    addr += 2;
+  std::vector<uint8_t> scratch;
+  const uint8_t* src = sampleMemory<2>(baseAddr, (length - 3) << 1, scratch);
+  sample_t* dst = data();
+  for (uint32_t i = 3; i < length; i++) {
+    dst[i] = int16_t(T1ReadWord(src, (i - 3) << 1));
   }
+  std::copy(dst + loopStart, dst + length, dst + length + loopStart);
 }
 
 void SampleData::loadAdpcm()
@@ -58,20 +99,14 @@ void SampleData::loadAdpcm()
   loopStart = ((loopStart - 4) << 1) + 11;
   loopLength <<= 1;
   resize(loopStart + (loopLength << 2));
-  AdpcmDecoder adpcm(
-    int16_t(_MMU_read16<ARMCPU_ARM7, MMU_AT_DEBUG>(baseAddr)),
-    int16_t(_MMU_read16<ARMCPU_ARM7, MMU_AT_DEBUG>(baseAddr + 2))
-  );
-  uint32_t j = 11;
-  for (uint32_t i = 4; i < length; i++) {
-    uint8_t data = uint8_t(_MMU_read08<ARMCPU_ARM7, MMU_AT_DEBUG>(baseAddr + i));
-    (*this)[j++] = adpcm.getNextSample(uint8_t(data & 0x0f));
-    (*this)[j++] = adpcm.getNextSample(uint8_t(data & 0xf0) >> 4);
+  std::vector<uint8_t> scratch;
+  const uint8_t* src = sampleMemory<1>(baseAddr, length < 4 ? 4 : length, scratch);
+  AdpcmDecoder adpcm(int16_t(T1ReadWord(src, 0)), int16_t(T1ReadWord(src, 2)));
+  if (length > 4) {
+    adpcm.decode(src + 4, length - 4, data() + 11);
   }
   uint32_t loopEnd = loopStart + loopLength;
-  for (j = loopStart; j < loopEnd; j++) {
-    (*this)[j + loopLength] = (*this)[j];
-  }
+  std::copy(data() + loopStart, data() + loopEnd, data() + loopEnd);
 }
 
 int32_t SampleData::sampleAt(double time, IInterpolator* interp) const
@@ -5,7 +5,19 @@
 #include <cstdint>
 class IInterpolator;
 
-class SampleData : public std::vector<int32_t>
+// Every decoded sample fits in 16 bits, so by default samples are stored as
+// int16 to halve the cache; define as 0 to store them as int32 instead
+#ifndef SAMPLEDATA_INT16_STORAGE
+#define SAMPLEDATA_INT16_STORAGE 1
+#endif
+
+#if SAMPLEDATA_INT16_STORAGE
+typedef int16_t sample_t;
+#else
+typedef int32_t sample_t;
+#endif
+
+class SampleData : public std::vector<sample_t>
 {
 public:
   enum Format {
@@ -28,6 +40,9 @@ public:
   uint32_t baseAddr;
   uint16_t loopStart;
   uint32_t loopLength;
+  // Set by SampleCache::touch() when the sample is played, and cleared by the
+  // cache when it spares the sample from eviction
+  mutable bool used;
 
 private:
   void loadPcm8();
@@ -11,6 +11,7 @@
 #include "windowsh_wrapper.h"
 #include "XSFConfig.h"
 #include "convert.h"
+#include "vbam/gba/GBA-jit.h"
 #include "vbam/gba/Sound.h"
 
 class XSFPlayer;
@@ -18,7 +19,8 @@ class XSFPlayer;
 enum
 {
 	idLowPassFiltering = 1000,
-	idMutes
+	idMutes,
+	idRecompiler
 };
 
 class XSFConfig_GSF : public XSFConfig
@@ -26,10 +28,12 @@ class XSFConfig_GSF : public XSFConfig
 protected:
 	static bool initLowPassFiltering;
 	static std::string initMutes;
+	static bool initRecompiler;
 
 	friend class XSFConfig;
 	bool lowPassFiltering;
 	std::bitset<6> mutes;
+	bool recompiler;
 
 	XSFConfig_GSF();
 	void LoadSpecificConfig() override;
@@ -48,13 +52,14 @@ std::string XSFConfig::commonName = "GSF Decoder";
 std::string XSFConfig::versionNumber = "0.9b";
 bool XSFConfig_GSF::initLowPassFiltering = true;
 std::string XSFConfig_GSF::initMutes = "000000";
+bool XSFConfig_GSF::initRecompiler = true;
 
 XSFConfig *XSFConfig::Create()
 {
 	return new XSFConfig_GSF();
 }
 
-XSFConfig_GSF::XSFConfig_GSF() : XSFConfig(), lowPassFiltering(false), mutes()
+XSFConfig_GSF::XSFConfig_GSF() : XSFConfig(), lowPassFiltering(false), mutes(), recompiler(false)
 {
 	this->supportedSampleRates.push_back(8000);
 	this->supportedSampleRates.push_back(11025);
@@ -74,18 +79,22 @@ void XSFConfig_GSF::LoadSpecificConfig()
 	this->lowPassFiltering = this->configIO->GetValue("LowPassFiltering", XSFConfig_GSF::initLowPassFiltering);
 	std::stringstream mutesSS(this->configIO->GetValue("Mutes", XSFConfig_GSF::initMutes));
 	mutesSS >> this->mutes;
+	this->recompiler = this->configIO->GetValue("Recompiler", XSFConfig_GSF::initRecompiler);
 }
 
 void XSFConfig_GSF::SaveSpecificConfig()
 {
 	this->configIO->SetValue("LowPassFiltering", this->lowPassFiltering);
 	this->configIO->SetValue("Mutes", this->mutes.to_string<char>());
+	this->configIO->SetValue("Recompiler", this->recompiler);
 }
 
 void XSFConfig_GSF::GenerateSpecificDialogs()
 {
 	this->configDialog.AddCheckBoxControl(DialogCheckBoxBuilder(L"Low-Pass Filtering").WithSize(80, 10).InGroup(L"Output").WithRelativePositionToSibling(RelativePosition::PositionType::FromBottomLeft, Point<short>(0, 7), 2).WithTabStop().
 		WithID(idLowPassFiltering));
+	this->configDialog.AddCheckBoxControl(DialogCheckBoxBuilder(L"Recompiler").WithSize(80, 10).InGroup(L"Output").WithRelativePositionToSibling(RelativePosition::PositionType::FromBottomLeft, Point<short>(0, 7)).WithTabStop().
+		WithID(idRecompiler));
 	this->configDialog.AddLabelControl(DialogLabelBuilder(L"Mute").WithSize(50, 8).InGroup(L"Output").WithRelativePositionToSibling(RelativePosition::PositionType::FromBottomLeft, Point<short>(0, 10)).IsLeftJustified());
 	this->configDialog.AddListBoxControl(DialogListBoxBuilder().WithSize(78, 45).WithExactHeight().InGroup(L"Output").WithRelativePositionToSibling(RelativePosition::PositionType::FromTopRight, Point<short>(5, -3)).WithID(idMutes).WithBorder().
 		WithVerticalScrollbar().WithMultipleSelect().WithTabStop());
@@ -108,6 +117,9 @@ INT_PTR CALLBACK XSFConfig_GSF::ConfigDialogProc(HWND hwndDlg, UINT uMsg, WPARAM
 			SendMessageW(GetDlgItem(hwndDlg, idMutes), LB_ADDSTRING, 0, reinterpret_cast<LPARAM>(L"PCM B"));
 			for (int x = 0, numMutes = this->mutes.size(); x < numMutes; ++x)
 				SendMessageW(GetDlgItem(hwndDlg, idMutes), LB_SETSEL, this->mutes[x], x);
+			// Recompiler
+			if (this->recompiler)
+				SendMessageW(GetDlgItem(hwndDlg, idRecompiler), BM_SETCHECK, BST_CHECKED, 0);
 			break;
 		case WM_COMMAND:
 			break;
@@ -122,6 +134,7 @@ void XSFConfig_GSF::ResetSpecificConfigDefaults(HWND hwndDlg)
 	auto tmpMutes = std::bitset<6>(XSFConfig_GSF::initMutes);
 	for (int x = 0, numMutes = tmpMutes.size(); x < numMutes; ++x)
 		SendMessageW(GetDlgItem(hwndDlg, idMutes), LB_SETSEL, tmpMutes[x], x);
+	SendMessageW(GetDlgItem(hwndDlg, idRecompiler), BM_SETCHECK, XSFConfig_GSF::initRecompiler ? BST_CHECKED : BST_UNCHECKED, 0);
 }
 
 void XSFConfig_GSF::SaveSpecificConfigDialog(HWND hwndDlg)
@@ -129,11 +142,15 @@ void XSFConfig_GSF::SaveSpecificConfigDialog(HWND hwndDlg)
 	this->lowPassFiltering = SendMessageW(GetDlgItem(hwndDlg, idLowPassFiltering), BM_GETCHECK, 0, 0) == BST_CHECKED;
 	for (int x = 0, numMutes = this->mutes.size(); x < numMutes; ++x)
 		this->mutes[x] = !!SendMessageW(GetDlgItem(hwndDlg, idMutes), LB_GETSEL, x, 0);
+	this->recompiler = SendMessageW(GetDlgItem(hwndDlg, idRecompiler), BM_GETCHECK, 0, 0) == BST_CHECKED;
 }
 
 void XSFConfig_GSF::CopySpecificConfigToMemory(XSFPlayer *, bool preLoad)
 {
-	if (!preLoad)
+	// XSFPlayer_GSF::Load lets the _gsf_jit tag override this
+	if (preLoad)
+		cpuJit = this->recompiler;
+	else
 	{
 		soundInterpolation = this->lowPassFiltering;
 		unsigned long tmpMutes = this->mutes.to_ulong();
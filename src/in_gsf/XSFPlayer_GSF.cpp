@@ -20,6 +20,7 @@
 #include <zlib.h>
 #include "XSFCommon.h"
 #include "XSFPlayer.h"
+#include "vbam/gba/GBA-jit.h"
 #include "vbam/gba/Globals.h"
 #include "vbam/gba/Sound.h"
 #include "vbam/common/SoundDriver.h"
@@ -199,6 +200,9 @@ bool XSFPlayer_GSF::Load()
 	soundReset();
 	soundSetEnable(0x30F);
 
+	// _gsf_jit=0 leaves all code to the interpreter, any other value allows the recompiler
+	if (this->xSF->GetTagExists("_gsf_jit"))
+		cpuJit = this->xSF->GetTagValue("_gsf_jit") != "0";
 	CPUInit();
 	CPUReset();
 
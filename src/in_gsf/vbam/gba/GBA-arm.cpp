@@ -1893,7 +1893,6 @@ static INSN_REGPARM void armF00(uint32_t opcode)
 
 // Instruction table //////////////////////////////////////////////////////
 
-typedef INSN_REGPARM void (*insnfunc_t)(uint32_t opcode);
 #define REP16(insn) \
 	insn, insn, insn, insn, insn, insn, insn, insn, \
 	insn, insn, insn, insn, insn, insn, insn, insn
@@ -2083,6 +2082,16 @@ static insnfunc_t armInsnTable[] =
 	REP256(armF00)                                            // F00
 };
 
+insnfunc_t armInsnHandler(uint32_t opcode)
+{
+	return armInsnTable[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0x0F)];
+}
+
+int *armClockTicks()
+{
+	return &clockTicks;
+}
+
 // Wrapper routine (execution loop) ///////////////////////////////////////
 
 int armExecute()
@@ -2170,7 +2179,7 @@ int armExecute()
 		if (!clockTicks)
 			clockTicks = 1 + codeTicksAccessSeq32(oldArmNextPC);
 		cpuTotalTicks += clockTicks;
-	} while (cpuTotalTicks < cpuNextEvent && armState && !holdState && !SWITicks);
+	} while (cpuTotalTicks < cpuNextEvent && armState && !holdState && !SWITicks && !jitCanRun(armNextPC));
 
 	return 1;
 }
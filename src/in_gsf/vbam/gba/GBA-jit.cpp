@@ -0,0 +1,941 @@
+#include <cstdio>
+#include <cstring>
+#include "GBA-jit.h"
+
+bool cpuJit = false;
+uint8_t jitLineCode[JIT_LINES];
+uint8_t jitLineInvalidations[JIT_LINES];
+
+#ifdef HAVE_GBA_JIT
+#include <vector>
+#include "../../../in_2sf/desmume/utils/AsmJit/AsmJit.h"
+#include "GBA.h"
+#include "GBAcpu.h"
+#include "GBAinline.h"
+#include "Globals.h"
+
+using namespace asmjit;
+
+// Blocks call the interpreter's handlers, so they are called as INSN_REGPARM says
+#if defined(__GNUC__) && !defined(__APPLE__) && defined(__i386__)
+# define INSN_CALL_CONV kX86FuncConvGccRegParm1
+#else
+# define INSN_CALL_CONV kFuncConvHost
+#endif
+
+typedef int (*JitFunc)();
+
+struct JitBlock
+{
+	JitFunc func;
+	uint32_t adr; // bit 0 set for THUMB
+};
+
+static const uint32_t JIT_MAX_BLOCK_SIZE = 32;
+// The most a block and the two words prefetched past its end cover
+static const uint32_t JIT_MAX_BLOCK_SPAN = JIT_MAX_BLOCK_SIZE * 4 + 8;
+static const uint8_t JIT_MAX_INVALIDATIONS = 8;
+
+static JitBlock jitBlocks[JIT_MEMORY_SIZE >> 1];
+// Invalidated while they may still be running, so freed once back in jitExecute
+static std::vector<void *> jitRetired;
+static bool jitRunning;
+
+static bool jitInvalidated;
+
+static JitRuntime runtime;
+static X86Compiler c(&runtime);
+#ifndef ASMJIT_HOST_X86
+// Holds &reg for the whole block, the other globals are addressed from it
+static X86GpVar jitBase;
+#endif
+// The start of the block being compiled, and its exits for jitExecute's loop and CPULoop's
+static Label jitStart, jitExitLoop, jitExitBreak;
+
+// Globals may be out of reach of a 32-bit displacement on x64, so go through a register there
+template<typename T> static X86Mem jitMem(T *p)
+{
+#ifdef ASMJIT_HOST_X86
+	return x86::ptr_abs(reinterpret_cast<Ptr>(p), 0, sizeof(T));
+#else
+	intptr_t disp = reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(reg);
+	if (disp == static_cast<int32_t>(disp))
+		return x86::ptr(jitBase, static_cast<int32_t>(disp), sizeof(T));
+	X86GpVar base = c.newGpVar(kVarTypeIntPtr);
+	c.mov(base, imm_ptr(p));
+	return x86::ptr(base, 0, sizeof(T));
+#endif
+}
+
+static void jitSkipUnless(bool *flag, bool value, const Label &skip)
+{
+	c.cmp(jitMem(flag), 0);
+	if (value)
+		c.je(skip);
+	else
+		c.jne(skip);
+}
+
+static void jitSkipUnlessNEqualsV(bool equal, const Label &skip)
+{
+	X86GpVar n = c.newGpVar(kVarTypeUInt32), v = c.newGpVar(kVarTypeUInt32);
+	c.movzx(n, jitMem(&N_FLAG));
+	c.movzx(v, jitMem(&V_FLAG));
+	c.cmp(n, v);
+	if (equal)
+		c.jne(skip);
+	else
+		c.je(skip);
+}
+
+// Same as the switch in armExecute
+static void jitEmitCondition(int cond, const Label &skip)
+{
+	Label run = c.newLabel();
+	switch (cond)
+	{
+		case 0x00: // EQ
+			jitSkipUnless(&Z_FLAG, true, skip);
+			break;
+		case 0x01: // NE
+			jitSkipUnless(&Z_FLAG, false, skip);
+			break;
+		case 0x02: // CS
+			jitSkipUnless(&C_FLAG, true, skip);
+			break;
+		case 0x03: // CC
+			jitSkipUnless(&C_FLAG, false, skip);
+			break;
+		case 0x04: // MI
+			jitSkipUnless(&N_FLAG, true, skip);
+			break;
+		case 0x05: // PL
+			jitSkipUnless(&N_FLAG, false, skip);
+			break;
+		case 0x06: // VS
+			jitSkipUnless(&V_FLAG, true, skip);
+			break;
+		case 0x07: // VC
+			jitSkipUnless(&V_FLAG, false, skip);
+			break;
+		case 0x08: // HI
+			jitSkipUnless(&C_FLAG, true, skip);
+			jitSkipUnless(&Z_FLAG, false, skip);
+			break;
+		case 0x09: // LS
+			jitSkipUnless(&C_FLAG, true, run);
+			jitSkipUnless(&Z_FLAG, true, skip);
+			break;
+		case 0x0A: // GE
+			jitSkipUnlessNEqualsV(true, skip);
+			break;
+		case 0x0B: // LT
+			jitSkipUnlessNEqualsV(false, skip);
+			break;
+		case 0x0C: // GT
+			jitSkipUnless(&Z_FLAG, false, skip);
+			jitSkipUnlessNEqualsV(true, skip);
+			break;
+		case 0x0D: // LE
+			jitSkipUnless(&Z_FLAG, false, run);
+			jitSkipUnlessNEqualsV(false, skip);
+			break;
+		default:
+			c.jmp(skip);
+	}
+	c.bind(run);
+}
+
+// Unconditional control flow, and whatever may switch between ARM and THUMB without it
+static bool jitEndsBlock(uint32_t opcode, bool thumb)
+{
+	if (thumb)
+		return (opcode & 0xF800) == 0xE000 || // B
+			(opcode & 0xFF80) == 0x4700 || // BX
+			(opcode & 0xF800) == 0xF800 || // BL, second half
+			(opcode & 0xFF00) == 0xDF00 || // SWI
+			(opcode & 0xFF00) == 0xBD00; // POP with PC
+	return ((opcode & 0xFE000000) == 0xEA000000) || // B, BL
+		(opcode & 0x0FFFFFF0) == 0x012FFF10 || // BX
+		(opcode & 0x0F000000) == 0x0F000000 || // SWI
+		(opcode & 0x0DB0F000) == 0x0120F000; // MSR
+}
+
+// Where compiled code leaves the block after an instruction that didn't call its handler, so
+// didn't store where it is the way the handler path does
+struct JitExit
+{
+	Label label;
+	uint32_t adr;
+	bool thumb;
+	// Only known for the instruction after, a branch target is fetched when the block leaves
+	bool prefetchKnown;
+	uint32_t next, after;
+};
+
+static std::vector<JitExit> jitExits;
+// Where the block goes on from the last instruction compiled
+static Label jitFallThrough;
+// What the instructions compiled so far have left behind, when it differs from what
+// the interpreter's loop would store before the next one
+static bool jitPrefetchCountMasked, jitBusPrefetchSet;
+
+static Label jitExit(uint32_t adr, bool thumb, bool prefetchKnown, uint32_t next = 0, uint32_t after = 0)
+{
+	JitExit exit = { c.newLabel(), adr, thumb, prefetchKnown, next, after };
+	jitExits.push_back(exit);
+	return exit.label;
+}
+
+// Same as jitMem, indexed by a pointer-sized variable
+template<typename T> static X86Mem jitMem(T *p, const X86GpVar &index)
+{
+#ifdef ASMJIT_HOST_X86
+	return x86::ptr_abs(reinterpret_cast<Ptr>(p), index, 0, 0, sizeof(T));
+#else
+	intptr_t disp = reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(reg);
+	if (disp == static_cast<int32_t>(disp))
+		return x86::ptr(jitBase, index, 0, static_cast<int32_t>(disp), sizeof(T));
+	X86GpVar base = c.newGpVar(kVarTypeIntPtr);
+	c.mov(base, imm_ptr(p));
+	return x86::ptr(base, index, 0, 0, sizeof(T));
+#endif
+}
+
+static bool jitIsRam(uint32_t address)
+{
+	return (address >> 24) == 2 || (address >> 24) == 3;
+}
+
+template<typename T> static T *jitRamPtr(uint32_t address)
+{
+	return reinterpret_cast<T *>((address >> 24) == 3 ? &internalRAM[address & 0x7FFF & ~(sizeof(T) - 1)] : &workRAM[address & 0x3FFFF & ~(sizeof(T) - 1)]);
+}
+
+// Reads of the PC see the instruction two ahead, as reg[15] does when the handlers run
+static void jitLoadReg(const X86GpVar &var, int r, uint32_t adr, bool thumb)
+{
+	if (r == 15)
+		c.mov(var, static_cast<int32_t>(adr + (thumb ? 4 : 8)));
+	else
+		c.mov(var, jitMem(&reg[r].I));
+}
+
+// Same as the start of the interpreter's loop
+static void jitEmitPrefetchCount(bool thumb)
+{
+	Label prefetchDone = c.newLabel();
+	X86GpVar count = c.newGpVar(kVarTypeUInt32);
+	c.mov(count, jitMem(&busPrefetchCount));
+	c.test(count, static_cast<int32_t>(thumb ? 0xFFFFFF00 : 0xFFFFFE00));
+	c.jz(prefetchDone);
+	c.and_(count, 0xFF);
+	c.or_(count, 0x100);
+	c.mov(jitMem(&busPrefetchCount), count);
+	c.bind(prefetchDone);
+	jitPrefetchCountMasked = true;
+}
+
+static void jitEmitExitCheck(const Label &exit)
+{
+	X86GpVar total = c.newGpVar(kVarTypeInt32);
+	c.mov(total, jitMem(&cpuTotalTicks));
+	c.cmp(total, jitMem(&cpuNextEvent));
+	c.jge(exit);
+}
+
+// Sequential code access from IWRAM and EWRAM, as codeTicksAccessSeq16/32 work it out for them
+static void jitEmitSeqTicks(uint32_t region, bool thumb)
+{
+	X86GpVar ticks = c.newGpVar(kVarTypeInt32);
+	c.movzx(ticks, jitMem(thumb ? &memoryWaitSeq[region] : &memoryWaitSeq32[region]));
+	c.add(ticks, 1);
+	if (thumb)
+		c.mov(jitMem(&busPrefetchCount), 0);
+	c.add(jitMem(&cpuTotalTicks), ticks);
+}
+
+// Everything the interpreter's loop does around the handler, with the fetch done here
+static void jitEmitCall(uint32_t adr, uint32_t opcode, uint32_t next, uint32_t after, bool thumb, bool conditional)
+{
+	uint32_t size = thumb ? 2 : 4;
+	int *clockTicks = thumb ? thumbClockTicks() : armClockTicks();
+
+	c.mov(jitMem(&busPrefetch), 0);
+	c.mov(jitMem(clockTicks), 0);
+	c.mov(jitMem(&cpuPrefetch[0]), static_cast<int32_t>(next));
+	c.mov(jitMem(&cpuPrefetch[1]), static_cast<int32_t>(after));
+	c.mov(jitMem(&armNextPC), static_cast<int32_t>(adr + size));
+	c.mov(jitMem(&reg[15].I), static_cast<int32_t>(adr + 2 * size));
+
+	Label skip = c.newLabel();
+	int cond = thumb ? 0x0E : opcode >> 28;
+	if (conditional && cond != 0x0E)
+		jitEmitCondition(cond, skip);
+	X86GpVar arg = c.newGpVar(kVarTypeUInt32);
+	c.mov(arg, static_cast<int32_t>(opcode));
+	auto ctx = c.addCall(imm_ptr(thumb ? thumbInsnHandler(opcode) : armInsnHandler(opcode)), INSN_CALL_CONV, FuncBuilder1<void, uint32_t>());
+	ctx->setArg(0, arg);
+	c.bind(skip);
+
+	uint32_t region = adr >> 24;
+	Label ticksDone = c.newLabel();
+	X86GpVar ticks = c.newGpVar(kVarTypeInt32);
+	c.mov(ticks, jitMem(clockTicks));
+	c.test(ticks, ticks);
+	c.js(jitExitBreak);
+	c.jnz(ticksDone);
+	c.movzx(ticks, jitMem(thumb ? &memoryWaitSeq[region] : &memoryWaitSeq32[region]));
+	c.add(ticks, 1);
+	if (thumb)
+		c.mov(jitMem(&busPrefetchCount), 0);
+	c.bind(ticksDone);
+	c.add(jitMem(&cpuTotalTicks), ticks);
+}
+
+// Data processing with the operand shifted by an immediate, other than to the PC
+static bool jitArmAluNative(uint32_t opcode)
+{
+	if ((opcode & 0x0C000000) || (!(opcode & 0x02000000) && (opcode & 0x10)) || ((opcode >> 12) & 15) == 15)
+		return false;
+	int op = (opcode >> 21) & 15;
+	// TST, TEQ, CMP and CMN without S are MRS, MSR and BX
+	return op < 8 || op > 11 || (opcode & 0x00100000);
+}
+
+static void jitEmitArmAlu(uint32_t adr, uint32_t opcode)
+{
+	enum { AND, EOR, SUB, RSB, ADD, ADC, SBC, RSC, TST, TEQ, CMP, CMN, ORR, MOV, BIC, MVN };
+	int op = (opcode >> 21) & 15, dest = (opcode >> 12) & 15;
+	bool setFlags = !!(opcode & 0x00100000);
+	bool logical = op == AND || op == EOR || op == TST || op == TEQ || op >= ORR;
+	// The shifter's carry is only kept by the logical operations
+	bool carryOut = setFlags && logical;
+
+	X86GpVar value = c.newGpVar(kVarTypeUInt32);
+	if (opcode & 0x02000000)
+	{
+		int shift = (opcode & 0xF00) >> 7;
+		uint32_t v = opcode & 0xFF;
+		uint32_t imm = shift ? (v << (32 - shift)) | (v >> shift) : v;
+		c.mov(value, static_cast<int32_t>(imm));
+		if (carryOut && shift)
+			c.mov(jitMem(&C_FLAG), imm >> 31);
+	}
+	else
+	{
+		int shift = (opcode >> 7) & 0x1F;
+		jitLoadReg(value, opcode & 0x0F, adr, false);
+		switch ((opcode >> 5) & 3)
+		{
+			case 0: // LSL
+				if (!shift)
+					break;
+				c.shl(value, shift);
+				if (carryOut)
+					c.setc(jitMem(&C_FLAG));
+				break;
+			case 1: // LSR, #0 being #32
+				if (shift)
+				{
+					c.shr(value, shift);
+					if (carryOut)
+						c.setc(jitMem(&C_FLAG));
+				}
+				else
+				{
+					if (carryOut)
+					{
+						c.bt(value, 31);
+						c.setc(jitMem(&C_FLAG));
+					}
+					c.xor_(value, value);
+				}
+				break;
+			case 2: // ASR, #0 being #32
+				c.sar(value, shift ? shift : 31);
+				if (carryOut)
+				{
+					if (!shift)
+						c.bt(value, 0);
+					c.setc(jitMem(&C_FLAG));
+				}
+				break;
+			case 3: // ROR, #0 being RRX
+				if (shift)
+					c.ror(value, shift);
+				else
+				{
+					X86GpVar carry = c.newGpVar(kVarTypeUInt32);
+					c.movzx(carry, jitMem(&C_FLAG));
+					c.bt(carry, 0);
+					c.rcr(value, 1);
+				}
+				if (carryOut)
+					c.setc(jitMem(&C_FLAG));
+		}
+	}
+
+	X86GpVar res = c.newGpVar(kVarTypeUInt32), carry = c.newGpVar(kVarTypeUInt32);
+	if (op == ADC || op == SBC || op == RSC)
+		c.movzx(carry, jitMem(&C_FLAG));
+	if (op == RSB || op == RSC)
+		c.mov(res, value);
+	else if (op != MOV && op != MVN)
+		jitLoadReg(res, (opcode >> 16) & 15, adr, false);
+	switch (op)
+	{
+		case AND:
+		case TST:
+			c.and_(res, value);
+			break;
+		case EOR:
+		case TEQ:
+			c.xor_(res, value);
+			break;
+		case ORR:
+			c.or_(res, value);
+			break;
+		case BIC:
+			c.not_(value);
+			c.and_(res, value);
+			break;
+		case MVN:
+			c.not_(value);
+			// fall through
+		case MOV:
+			c.mov(res, value);
+			break;
+		case ADD:
+		case CMN:
+			c.add(res, value);
+			break;
+		case ADC:
+			c.bt(carry, 0);
+			c.adc(res, value);
+			break;
+		case SUB:
+		case CMP:
+			c.sub(res, value);
+			break;
+		case SBC:
+			// borrow is the inverse of the carry
+			c.cmp(carry, 1);
+			c.sbb(res, value);
+			break;
+		case RSB:
+			jitLoadReg(value, (opcode >> 16) & 15, adr, false);
+			c.sub(res, value);
+			break;
+		case RSC:
+			jitLoadReg(value, (opcode >> 16) & 15, adr, false);
+			c.cmp(carry, 1);
+			c.sbb(res, value);
+	}
+
+	if (setFlags)
+	{
+		if (logical)
+			c.test(res, res);
+		c.sets(jitMem(&N_FLAG));
+		c.setz(jitMem(&Z_FLAG));
+		if (!logical)
+		{
+			if (op == ADD || op == ADC || op == CMN)
+				c.setc(jitMem(&C_FLAG));
+			else
+				c.setnc(jitMem(&C_FLAG));
+			c.seto(jitMem(&V_FLAG));
+		}
+	}
+	if (op < TST || op > CMN)
+		c.mov(jitMem(&reg[dest].I), res);
+}
+
+// LDR, STR and their byte and halfword forms, other than loads to the PC, writebacks to it and
+// the user mode forms
+static bool jitArmLoadStoreNative(uint32_t opcode)
+{
+	bool pre = !!(opcode & 0x01000000), writeback = !!(opcode & 0x00200000);
+	int dest = (opcode >> 12) & 15, base = (opcode >> 16) & 15;
+	if ((opcode & 0x0C000000) == 0x04000000)
+	{
+		if ((opcode & 0x02000000) && (opcode & 0x10))
+			return false;
+	}
+	else if ((opcode & 0x0E000090) != 0x00000090 || !(opcode & 0x60) || (!(opcode & 0x00100000) && (opcode & 0x60) != 0x20) ||
+		(!(opcode & 0x00400000) && (opcode & 0xF00)))
+		return false;
+	if (!pre && writeback)
+		return false;
+	return !((opcode & 0x00100000) && dest == 15) && !((!pre || writeback) && base == 15);
+}
+
+static void jitEmitArmLoadStore(uint32_t adr, uint32_t opcode, const Label &slow)
+{
+	bool halfword = !(opcode & 0x0C000000);
+	bool load = !!(opcode & 0x00100000), pre = !!(opcode & 0x01000000), up = !!(opcode & 0x00800000);
+	bool writeback = !pre || (opcode & 0x00200000);
+	int dest = (opcode >> 12) & 15, base = (opcode >> 16) & 15;
+	// bytes for the access, and whether it's sign extended
+	int size = halfword ? ((opcode & 0x20) ? 2 : 1) : ((opcode & 0x00400000) ? 1 : 4);
+	bool sign = halfword && (opcode & 0x40);
+
+	X86GpVar offset = c.newGpVar(kVarTypeUInt32);
+	if (halfword ? !!(opcode & 0x00400000) : !(opcode & 0x02000000))
+		c.mov(offset, static_cast<int32_t>(halfword ? (opcode & 0x0F) | ((opcode >> 4) & 0xF0) : opcode & 0xFFF));
+	else
+	{
+		int shift = halfword ? 0 : (opcode >> 7) & 0x1F;
+		jitLoadReg(offset, opcode & 0x0F, adr, false);
+		switch (halfword ? 0 : (opcode >> 5) & 3)
+		{
+			case 0: // LSL
+				if (shift)
+					c.shl(offset, shift);
+				break;
+			case 1: // LSR, #0 being #32
+				if (shift)
+					c.shr(offset, shift);
+				else
+					c.xor_(offset, offset);
+				break;
+			case 2: // ASR, #0 being #32
+				c.sar(offset, shift ? shift : 31);
+				break;
+			case 3: // ROR, #0 being RRX
+				if (shift)
+					c.ror(offset, shift);
+				else
+				{
+					X86GpVar carry = c.newGpVar(kVarTypeUInt32);
+					c.movzx(carry, jitMem(&C_FLAG));
+					c.bt(carry, 0);
+					c.rcr(offset, 1);
+				}
+		}
+	}
+
+	X86GpVar address = c.newGpVar(kVarTypeIntPtr), written = c.newGpVar(kVarTypeUInt32);
+	jitLoadReg(address.r32(), base, adr, false);
+	c.mov(written, address.r32());
+	if (up)
+		c.add(written, offset);
+	else
+		c.sub(written, offset);
+	if (pre)
+		c.mov(address.r32(), written);
+
+	// Anything but IWRAM and EWRAM, or unaligned, is left to the handler
+	X86GpVar region = c.newGpVar(kVarTypeIntPtr), memOffset = c.newGpVar(kVarTypeIntPtr), lineOffset = c.newGpVar(kVarTypeIntPtr);
+	X86GpVar memBase = c.newGpVar(kVarTypeIntPtr);
+	Label iwram = c.newLabel(), access = c.newLabel();
+	if (size > 1)
+	{
+		c.test(address.r32(), size - 1);
+		c.jnz(slow);
+	}
+	c.mov(region.r32(), address.r32());
+	c.shr(region.r32(), 24);
+	c.cmp(region.r32(), 3);
+	c.je(iwram);
+	c.cmp(region.r32(), 2);
+	c.jne(slow);
+	c.mov(memOffset.r32(), address.r32());
+	c.and_(memOffset.r32(), 0x3FFFF);
+	c.mov(memBase, imm_ptr(workRAM));
+	if (!load)
+		c.mov(lineOffset.r32(), memOffset.r32());
+	c.jmp(access);
+	c.bind(iwram);
+	c.mov(memOffset.r32(), address.r32());
+	c.and_(memOffset.r32(), 0x7FFF);
+	c.mov(memBase, imm_ptr(internalRAM));
+	if (!load)
+		c.lea(lineOffset, x86::ptr(memOffset, 0x40000));
+	c.bind(access);
+
+	X86GpVar data = c.newGpVar(kVarTypeUInt32);
+	X86Mem mem = x86::ptr(memBase, memOffset, 0, 0, size);
+	if (load)
+	{
+		if (size == 4)
+			c.mov(data, mem);
+		else if (sign)
+			c.movsx(data, mem);
+		else
+			c.movzx(data, mem);
+		c.mov(jitMem(&reg[dest].I), data);
+		if (writeback && dest != base)
+			c.mov(jitMem(&reg[base].I), written);
+	}
+	else
+	{
+		// A pre-indexed writeback comes before the data is read
+		if (pre && writeback)
+			c.mov(jitMem(&reg[base].I), written);
+		jitLoadReg(data, dest, adr, false);
+		if (size == 4)
+			c.mov(mem, data);
+		else if (size == 2)
+			c.mov(mem, data.r16());
+		else
+			c.mov(mem, data.r8());
+		if (!pre)
+			c.mov(jitMem(&reg[base].I), written);
+
+		// as jitWrite
+		Label clean = c.newLabel();
+		c.shr(lineOffset.r32(), JIT_LINE_SHIFT);
+		c.cmp(jitMem(jitLineCode, lineOffset), 0);
+		c.je(clean);
+		auto ctx = c.addCall(imm_ptr(jitInvalidateLine), kFuncConvHost, FuncBuilder1<void, uint32_t>());
+		ctx->setArg(0, lineOffset.r32());
+		c.bind(clean);
+	}
+
+	// As LDRSTR_INIT, dataTicksAccess16/32 and codeTicksAccess32 leave it for IWRAM and EWRAM
+	Label prefetchDone = c.newLabel();
+	X86GpVar prefetch = c.newGpVar(kVarTypeUInt32);
+	c.movzx(prefetch, jitMem(&busPrefetchEnable));
+	c.cmp(jitMem(&busPrefetchCount), 0);
+	c.je(prefetchDone);
+	c.xor_(prefetch, prefetch);
+	c.bind(prefetchDone);
+	c.mov(jitMem(&busPrefetch), prefetch.r8());
+	c.mov(jitMem(&busPrefetchCount), 0);
+
+	X86GpVar ticks = c.newGpVar(kVarTypeInt32), codeTicks = c.newGpVar(kVarTypeInt32);
+	c.movzx(ticks, size == 4 ? jitMem(memoryWait32, region) : jitMem(memoryWait, region));
+	c.movzx(codeTicks, jitMem(&memoryWait32[adr >> 24]));
+	c.add(ticks, codeTicks);
+	c.add(ticks, load ? 3 : 2);
+	c.add(jitMem(&cpuTotalTicks), ticks);
+}
+
+// B and BL within IWRAM and EWRAM
+static void jitEmitArmBranch(uint32_t pc, uint32_t adr, uint32_t opcode, uint32_t target)
+{
+	uint32_t region = target >> 24;
+	if (opcode & 0x01000000)
+		c.mov(jitMem(&reg[14].I), static_cast<int32_t>(adr + 4));
+
+	// codeTicksAccessSeq32 and codeTicksAccess32 at the target
+	X86GpVar ticks = c.newGpVar(kVarTypeInt32), nonSeq = c.newGpVar(kVarTypeInt32);
+	c.movzx(ticks, jitMem(&memoryWaitSeq32[region]));
+	c.movzx(nonSeq, jitMem(&memoryWait32[region]));
+	c.add(ticks, ticks);
+	c.add(ticks, nonSeq);
+	c.add(ticks, 3);
+	c.mov(jitMem(&busPrefetchCount), 0);
+	c.add(jitMem(&cpuTotalTicks), ticks);
+
+	Label exit = jitExit(target, false, false);
+	jitEmitExitCheck(exit);
+	if (target == pc)
+		c.jmp(jitStart);
+	else
+		c.jmp(exit);
+}
+
+static bool jitEmitArm(uint32_t pc, uint32_t adr, uint32_t opcode, uint32_t next, uint32_t after)
+{
+	uint32_t target = adr + 8 + (static_cast<int32_t>(opcode << 8) >> 6);
+	bool alu = jitArmAluNative(opcode), loadStore = jitArmLoadStoreNative(opcode);
+	bool branch = (opcode & 0x0E000000) == 0x0A000000 && jitIsRam(target) && (opcode >> 28) != 0x0F;
+	if (!alu && !loadStore && !branch)
+		return false;
+
+	if (!jitPrefetchCountMasked)
+		jitEmitPrefetchCount(false);
+	if (jitBusPrefetchSet && !loadStore)
+	{
+		c.mov(jitMem(&busPrefetch), 0);
+		jitBusPrefetchSet = false;
+	}
+
+	uint32_t region = adr >> 24;
+	Label skip = c.newLabel(), done = c.newLabel();
+	int cond = opcode >> 28;
+	if (cond != 0x0E)
+		jitEmitCondition(cond, skip);
+	if (alu)
+		jitEmitArmAlu(adr, opcode);
+	else if (loadStore)
+	{
+		Label slow = c.newLabel();
+		jitEmitArmLoadStore(adr, opcode, slow);
+		c.jmp(done);
+		c.bind(slow);
+		jitEmitCall(adr, opcode, next, after, false, false);
+		c.jmp(done);
+	}
+	else
+	{
+		jitEmitArmBranch(pc, adr, opcode, target);
+		if (cond == 0x0E)
+		{
+			jitFallThrough = jitExitLoop;
+			return true;
+		}
+	}
+	c.bind(skip);
+	// Failed conditions take as long as data processing does
+	if (alu || cond != 0x0E)
+	{
+		if (loadStore)
+			c.mov(jitMem(&busPrefetch), 0);
+		jitEmitSeqTicks(region, false);
+	}
+	c.bind(done);
+
+	if (loadStore)
+	{
+		// Both the fast path and the handler leave nothing to prefetch
+		jitPrefetchCountMasked = true;
+		jitBusPrefetchSet = true;
+	}
+
+	Label exit = jitExit(adr + 4, false, true, next, after);
+	jitEmitExitCheck(exit);
+	jitFallThrough = exit;
+	return true;
+}
+
+// One pass of the interpreter's loop, with the fetch and everything known about it done here
+static void jitEmitInstruction(uint32_t pc, uint32_t adr, uint32_t opcode, uint32_t next, uint32_t after, bool thumb, bool last)
+{
+	if (!thumb && jitEmitArm(pc, adr, opcode, next, after))
+		return;
+
+	uint32_t size = thumb ? 2 : 4;
+	jitEmitPrefetchCount(thumb);
+	jitEmitCall(adr, opcode, next, after, thumb, true);
+	jitPrefetchCountMasked = false;
+	jitBusPrefetchSet = true;
+
+	// Stop where the interpreter's loop would, or where the instruction went somewhere else
+	// other than back to the start of the block, as loops do
+	jitEmitExitCheck(jitExitLoop);
+	Label nextInsn = c.newLabel();
+	if (!last)
+	{
+		c.cmp(jitMem(&armNextPC), static_cast<int32_t>(adr + size));
+		c.je(nextInsn);
+	}
+	c.cmp(jitMem(&armNextPC), static_cast<int32_t>(pc));
+	c.jne(jitExitLoop);
+	c.cmp(jitMem(&armState), thumb ? 0 : 1);
+	c.jne(jitExitLoop);
+	c.jmp(jitStart);
+	c.bind(nextInsn);
+	jitFallThrough = jitExitLoop;
+}
+
+static JitFunc jitCompile(uint32_t pc, bool thumb)
+{
+	uint32_t size = thumb ? 2 : 4;
+	uint32_t offset = jitOffset(pc);
+	uint32_t regionEnd = (pc >> 24) == 3 ? JIT_MEMORY_SIZE : 0x40000;
+
+	c.reset();
+	c.addFunc(kFuncConvHost, FuncBuilder0<int>());
+#ifndef ASMJIT_HOST_X86
+	jitBase = c.newGpVar(kVarTypeIntPtr);
+	c.mov(jitBase, imm_ptr(reg));
+#endif
+	jitStart = c.newLabel();
+	jitExitLoop = c.newLabel();
+	jitExitBreak = c.newLabel();
+	jitExits.clear();
+	jitPrefetchCountMasked = false;
+	jitBusPrefetchSet = true;
+	c.bind(jitStart);
+
+	uint32_t count = 0;
+	for (bool last = false; !last; ++count)
+	{
+		uint32_t adr = pc + count * size, adrOffset = offset + count * size;
+		// The prefetched words are read along with the instruction, so have to be tracked with it
+		if (adrOffset + 3 * size > regionEnd || jitLineInvalidations[adrOffset >> JIT_LINE_SHIFT] == JIT_LINE_NOCOMPILE ||
+			jitLineInvalidations[(adrOffset + 3 * size - 1) >> JIT_LINE_SHIFT] == JIT_LINE_NOCOMPILE)
+			break;
+
+		uint32_t opcode, next, after;
+		if (thumb)
+		{
+			opcode = CPUReadHalfWordQuick(adr);
+			next = CPUReadHalfWordQuick(adr + 2);
+			after = CPUReadHalfWordQuick(adr + 4);
+		}
+		else
+		{
+			opcode = CPUReadMemoryQuick(adr);
+			next = CPUReadMemoryQuick(adr + 4);
+			after = CPUReadMemoryQuick(adr + 8);
+		}
+		last = count + 1 == JIT_MAX_BLOCK_SIZE || jitEndsBlock(opcode, thumb);
+		jitEmitInstruction(pc, adr, opcode, next, after, thumb, last);
+	}
+	c.jmp(jitFallThrough);
+	if (!count)
+	{
+		c.endFunc();
+		return nullptr;
+	}
+
+	// The state the interpreter's loop would have stored, where compiled code didn't
+	for (const JitExit &exit : jitExits)
+	{
+		uint32_t size = exit.thumb ? 2 : 4;
+		c.bind(exit.label);
+		c.mov(jitMem(&armNextPC), static_cast<int32_t>(exit.adr));
+		c.mov(jitMem(&reg[15].I), static_cast<int32_t>(exit.adr + size));
+		if (exit.prefetchKnown)
+		{
+			c.mov(jitMem(&cpuPrefetch[0]), static_cast<int32_t>(exit.next));
+			c.mov(jitMem(&cpuPrefetch[1]), static_cast<int32_t>(exit.after));
+		}
+		else
+		{
+			X86GpVar word = c.newGpVar(kVarTypeUInt32);
+			for (int i = 0; i < 2; ++i)
+			{
+				if (exit.thumb)
+					c.movzx(word, jitMem(jitRamPtr<uint16_t>(exit.adr + i * size)));
+				else
+					c.mov(word, jitMem(jitRamPtr<uint32_t>(exit.adr + i * size)));
+				c.mov(jitMem(&cpuPrefetch[i]), word);
+			}
+		}
+		c.jmp(jitExitLoop);
+	}
+
+	X86GpVar result = c.newGpVar(kVarTypeInt32);
+	c.bind(jitExitLoop);
+	c.mov(result, 1);
+	c.ret(result);
+	c.bind(jitExitBreak);
+	c.mov(result, 0);
+	c.ret(result);
+	c.endFunc();
+
+	void *code = c.make();
+	if (c.getError() || !code)
+	{
+		fprintf(stderr, "GBA JIT error at %08X: %s\n", pc, ErrorUtil::asString(c.getError()));
+		return nullptr;
+	}
+
+	for (uint32_t line = offset >> JIT_LINE_SHIFT, end = (offset + (count + 2) * size - 1) >> JIT_LINE_SHIFT; line <= end; ++line)
+		jitLineCode[line] = 1;
+	return reinterpret_cast<JitFunc>(code);
+}
+
+static void jitRelease()
+{
+	for (void *code : jitRetired)
+		runtime.release(code);
+	jitRetired.clear();
+}
+
+void jitReset()
+{
+	for (auto &block : jitBlocks)
+		if (block.func)
+		{
+			jitRetired.push_back(reinterpret_cast<void *>(block.func));
+			block.func = nullptr;
+		}
+	jitRelease();
+	memset(jitLineCode, 0, sizeof(jitLineCode));
+	memset(jitLineInvalidations, 0, sizeof(jitLineInvalidations));
+}
+
+int jitExecute()
+{
+	// Only the interpreter, or a write to code, may have left something other than memory prefetched
+	jitInvalidated = true;
+	do
+	{
+		// Blocks fetch from memory, so after a write to the two words already prefetched, the
+		// interpreter runs until it's past them. It returns after every instruction here.
+		if (jitInvalidated && (armState ? cpuPrefetch[0] != CPUReadMemoryQuick(armNextPC) || cpuPrefetch[1] != CPUReadMemoryQuick(armNextPC + 4) :
+			cpuPrefetch[0] != CPUReadHalfWordQuick(armNextPC) || cpuPrefetch[1] != CPUReadHalfWordQuick(armNextPC + 2)))
+			return armState ? armExecute() : thumbExecute();
+		jitInvalidated = false;
+
+		uint32_t offset = jitOffset(armNextPC), adr = armNextPC | !armState;
+		JitBlock &block = jitBlocks[offset >> 1];
+		if (!block.func || block.adr != adr)
+		{
+			if (block.func)
+				jitRetired.push_back(reinterpret_cast<void *>(block.func));
+			block.func = jitCompile(armNextPC, !armState);
+			block.adr = adr;
+			if (!block.func)
+			{
+				// leave it to the interpreter, which will run until it's somewhere compiled code can run
+				jitLineInvalidations[offset >> JIT_LINE_SHIFT] = JIT_LINE_NOCOMPILE;
+				return 1;
+			}
+		}
+
+		jitRunning = true;
+		int result = block.func();
+		jitRunning = false;
+		if (!jitRetired.empty())
+			jitRelease();
+		if (!result)
+			return 0;
+	} while (cpuTotalTicks < cpuNextEvent && !holdState && !SWITicks && jitCanRun(armNextPC));
+
+	return 1;
+}
+
+void jitInvalidateLine(uint32_t line)
+{
+	jitLineCode[line] = 0;
+	jitInvalidated = true;
+	jitLineInvalidations[line] = jitLineInvalidations[line] < JIT_MAX_INVALIDATIONS ? jitLineInvalidations[line] + 1 : JIT_LINE_NOCOMPILE;
+
+	// Any block that starts close enough before the line may reach into it
+	uint32_t start = line << JIT_LINE_SHIFT, end = start + (1 << JIT_LINE_SHIFT);
+	start = start > JIT_MAX_BLOCK_SPAN ? start - JIT_MAX_BLOCK_SPAN : 0;
+	for (uint32_t offset = start; offset < end; offset += 2)
+	{
+		JitBlock &block = jitBlocks[offset >> 1];
+		if (block.func)
+		{
+			jitRetired.push_back(reinterpret_cast<void *>(block.func));
+			block.func = nullptr;
+		}
+	}
+
+	// A block writing to its own code stops after this instruction
+	if (jitRunning)
+		cpuNextEvent = cpuTotalTicks;
+}
+#else
+void jitReset()
+{
+}
+
+int jitExecute()
+{
+	return 1;
+}
+
+void jitInvalidateLine(uint32_t line)
+{
+	jitLineCode[line] = 0;
+}
+#endif
+
+void jitInvalidateRange(uint32_t address, uint32_t size)
+{
+	uint32_t offset = jitOffset(address);
+	for (uint32_t line = offset >> JIT_LINE_SHIFT, end = (offset + size - 1) >> JIT_LINE_SHIFT; line <= end; ++line)
+		if (jitLineCode[line])
+			jitInvalidateLine(line);
+}
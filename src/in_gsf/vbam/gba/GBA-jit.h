@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+// Basic block recompiler for code running from IWRAM and EWRAM, which is where
+// the sound drivers keep their mixers. Uses the AsmJit shipped with the 2SF core.
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+# define HAVE_GBA_JIT
+#endif
+
+// EWRAM, then IWRAM, as one range of offsets
+const uint32_t JIT_MEMORY_SIZE = 0x40000 + 0x8000;
+// Writes are tracked at this granularity
+const int JIT_LINE_SHIFT = 5;
+const uint32_t JIT_LINES = JIT_MEMORY_SIZE >> JIT_LINE_SHIFT;
+// Lines invalidated more often than this are left to the interpreter
+const uint8_t JIT_LINE_NOCOMPILE = 0xFF;
+
+extern bool cpuJit;
+extern uint8_t jitLineCode[JIT_LINES];
+extern uint8_t jitLineInvalidations[JIT_LINES];
+
+void jitReset();
+int jitExecute();
+void jitInvalidateLine(uint32_t line);
+void jitInvalidateRange(uint32_t address, uint32_t size);
+
+inline uint32_t jitOffset(uint32_t address) { return (address >> 24) == 3 ? 0x40000 + (address & 0x7FFF) : address & 0x3FFFF; }
+
+// Called by every write to IWRAM or EWRAM, with the offset from jitOffset
+inline void jitWrite(uint32_t offset)
+{
+	if (jitLineCode[offset >> JIT_LINE_SHIFT])
+		jitInvalidateLine(offset >> JIT_LINE_SHIFT);
+}
+
+inline bool jitCanRun(uint32_t pc)
+{
+#ifdef HAVE_GBA_JIT
+	uint32_t region = pc >> 24;
+	return cpuJit && (region == 2 || region == 3) && jitLineInvalidations[jitOffset(pc) >> JIT_LINE_SHIFT] != JIT_LINE_NOCOMPILE;
+#else
+	return false;
+#endif
+}
@@ -1417,7 +1417,6 @@ static INSN_REGPARM void thumbF8(uint32_t opcode)
 
 // Instruction table //////////////////////////////////////////////////////
 
-typedef INSN_REGPARM void (*insnfunc_t)(uint32_t opcode);
 #define thumbUI thumbUnknownInsn
 #define thumbBP thumbUnknownInsn
 static insnfunc_t thumbInsnTable[] =
@@ -1552,6 +1551,16 @@ static insnfunc_t thumbInsnTable[] =
 	thumbF8,thumbF8,thumbF8,thumbF8,thumbF8,thumbF8,thumbF8,thumbF8
 };
 
+insnfunc_t thumbInsnHandler(uint32_t opcode)
+{
+	return thumbInsnTable[opcode >> 6];
+}
+
+int *thumbClockTicks()
+{
+	return &clockTicks;
+}
+
 // Wrapper routine (execution loop) ///////////////////////////////////////
 
 int thumbExecute()
@@ -1581,6 +1590,6 @@ int thumbExecute()
 		if (!clockTicks)
 			clockTicks = codeTicksAccessSeq16(oldArmNextPC) + 1;
 		cpuTotalTicks += clockTicks;
-	} while (cpuTotalTicks < cpuNextEvent && !armState && !holdState && !SWITicks);
+	} while (cpuTotalTicks < cpuNextEvent && !armState && !holdState && !SWITicks && !jitCanRun(armNextPC));
 	return 1;
 }
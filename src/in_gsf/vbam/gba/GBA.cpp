@@ -1650,6 +1650,7 @@ void CPUReset()
 
 	// reset internal state
 	holdState = false;
+	jitReset();
 
 	biosProtected[0] = 0x00;
 	biosProtected[1] = 0xf0;
@@ -1762,7 +1763,12 @@ void CPULoop(int ticks)
 	{
 		if (!holdState && !SWITicks)
 		{
-			if (armState)
+			if (jitCanRun(armNextPC))
+			{
+				if (!jitExecute())
+					return;
+			}
+			else if (armState)
 			{
 				if (!armExecute())
 					return;
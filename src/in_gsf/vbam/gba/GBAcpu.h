@@ -19,6 +19,14 @@ int thumbExecute();
 # define UNLIKELY(x) (x)
 #endif
 
+typedef INSN_REGPARM void (*insnfunc_t)(uint32_t opcode);
+
+// For the recompiler, which does the fetching and dispatching itself
+insnfunc_t armInsnHandler(uint32_t opcode);
+insnfunc_t thumbInsnHandler(uint32_t opcode);
+int *armClockTicks();
+int *thumbClockTicks();
+
 inline void UPDATE_REG(uint32_t address, uint16_t value) { WRITE16LE(&ioMem[address], value); }
 
 extern uint32_t cpuPrefetch[2];
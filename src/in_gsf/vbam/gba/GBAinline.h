@@ -2,6 +2,7 @@
 
 #include "../common/Port.h"
 #include "Sound.h"
+#include "GBA-jit.h"
 
 extern const uint32_t objTilesAddress[3];
 
@@ -289,9 +290,11 @@ inline void CPUWriteMemory(uint32_t address, uint32_t value)
 	{
 		case 0x02:
 			WRITE32LE(&workRAM[address & 0x3FFFC], value);
+			jitWrite(address & 0x3FFFC);
 			break;
 		case 0x03:
 			WRITE32LE(&internalRAM[address & 0x7ffC], value);
+			jitWrite(0x40000 + (address & 0x7ffC));
 			break;
 		case 0x04:
 			if (address < 0x4000400)
@@ -325,9 +328,11 @@ inline void CPUWriteHalfWord(uint32_t address, uint16_t value)
 	{
 		case 2:
 			WRITE16LE(&workRAM[address & 0x3FFFE], value);
+			jitWrite(address & 0x3FFFE);
 			break;
 		case 3:
 			WRITE16LE(&internalRAM[address & 0x7ffe], value);
+			jitWrite(0x40000 + (address & 0x7ffe));
 			break;
 		case 4:
 			if (address < 0x4000400)
@@ -355,9 +360,11 @@ inline void CPUWriteByte(uint32_t address, uint8_t b)
 	{
 		case 2:
 			workRAM[address & 0x3FFFF] = b;
+			jitWrite(address & 0x3FFFF);
 			break;
 		case 3:
 			internalRAM[address & 0x7fff] = b;
+			jitWrite(0x40000 + (address & 0x7fff));
 			break;
 		case 4:
 			if (address < 0x4000400)
@@ -766,11 +766,17 @@ void BIOS_RegisterRamReset(uint32_t flags)
 	if (flags)
 	{
 		if (flags & 0x01)
+		{
 			// clear work RAM
 			memset(&workRAM[0], 0, 0x40000);
+			jitInvalidateRange(0x02000000, 0x40000);
+		}
 		if (flags & 0x02)
+		{
 			// clear internal RAM
 			memset(&internalRAM[0], 0, 0x7e00); // don't clear 0x7e00-0x7fff
+			jitInvalidateRange(0x03000000, 0x7e00);
+		}
 		if (flags & 0x04)
 			// clear palette RAM
 			memset(&paletteRAM[0], 0, 0x400);
@@ -964,6 +970,7 @@ void BIOS_SoftReset()
 	uint8_t b = internalRAM[0x7ffa];
 
 	memset(&internalRAM[0x7e00], 0, 0x200);
+	jitInvalidateRange(0x03007e00, 0x200);
 
 	if (b)
 	{
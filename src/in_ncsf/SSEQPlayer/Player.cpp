@@ -174,3 +174,43 @@ void Player::Timer()
 
 	this->Run();
 }
+
+static inline std::int32_t muldiv7(std::int32_t val, std::uint8_t mul)
+{
+	return mul == 127 ? val : ((val * mul) >> 7);
+}
+
+void Player::Mix(const std::bitset<16> &mutes, std::int32_t &left, std::int32_t &right, std::int32_t *chanOut)
+{
+	left = right = 0;
+
+	for (int i = 0; i < 16; ++i)
+	{
+		Channel &chn = this->channels[i];
+
+		std::int32_t chnLeft = 0, chnRight = 0;
+		if (chn.state > ChannelState::None)
+		{
+			std::int32_t sample = chn.GenerateSample();
+			chn.IncrementSample();
+
+			std::uint8_t datashift = chn.reg.volumeDiv;
+			if (datashift == 3)
+				datashift = 4;
+			sample = muldiv7(sample, chn.reg.volumeMul) >> datashift;
+
+			chnLeft = muldiv7(sample, 127 - chn.reg.panning);
+			chnRight = muldiv7(sample, chn.reg.panning);
+			if (!mutes[i])
+			{
+				left += chnLeft;
+				right += chnRight;
+			}
+		}
+		if (chanOut)
+		{
+			*chanOut++ = chnLeft;
+			*chanOut++ = chnRight;
+		}
+	}
+}
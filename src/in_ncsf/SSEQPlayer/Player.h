@@ -46,4 +46,7 @@ struct Player
 	void Run();
 	void UpdateTracks();
 	void Timer();
+	// Generates the next sample of every channel and mixes the ones not muted into left and right.
+	// When chanOut isn't null, it gets each channel's left and right too, muted or not.
+	void Mix(const std::bitset<16> &mutes, std::int32_t &left, std::int32_t &right, std::int32_t *chanOut = nullptr);
 };
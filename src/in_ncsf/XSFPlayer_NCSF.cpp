@@ -165,43 +165,14 @@ bool XSFPlayer_NCSF::Load()
 	return XSFPlayer::Load();
 }
 
-static inline std::int32_t muldiv7(std::int32_t val, std::uint8_t mul)
-{
-	return mul == 127 ? val : ((val * mul) >> 7);
-}
-
 void XSFPlayer_NCSF::GenerateSamples(std::vector<std::uint8_t> &buf, unsigned offset, unsigned samples)
 {
-	unsigned long mute = this->mutes.to_ulong();
-
 	for (unsigned smpl = 0; smpl < samples; ++smpl)
 	{
 		this->secondsIntoPlayback += this->secondsPerSample;
 
-		std::int32_t leftChannel = 0, rightChannel = 0;
-
-		// I need to advance the sound channels here
-		for (int i = 0; i < 16; ++i)
-		{
-			Channel &chn = this->player.channels[i];
-
-			if (chn.state > ChannelState::None)
-			{
-				std::int32_t sample = chn.GenerateSample();
-				chn.IncrementSample();
-
-				if (mute & BIT(i))
-					continue;
-
-				std::uint8_t datashift = chn.reg.volumeDiv;
-				if (datashift == 3)
-					datashift = 4;
-				sample = muldiv7(sample, chn.reg.volumeMul) >> datashift;
-
-				leftChannel += muldiv7(sample, 127 - chn.reg.panning);
-				rightChannel += muldiv7(sample, chn.reg.panning);
-			}
-		}
+		std::int32_t leftChannel, rightChannel;
+		this->player.Mix(this->mutes, leftChannel, rightChannel);
 
 		buf[offset++] = leftChannel & 0xFF;
 		buf[offset++] = (leftChannel >> 8) & 0xFF;
@@ -240,6 +240,16 @@ std::vector<std::uint8_t> XSFFile::GetProgramSection() const
 	return this->programSection;
 }
 
+const std::uint8_t *XSFFile::GetCompressedProgramSection(std::uint32_t &size) const
+{
+	size = 0;
+	if (!this->hasFile || this->rawData.size() < 16)
+		return nullptr;
+	std::uint32_t reservedSize = Get32BitsLE(&this->rawData[4]);
+	size = Get32BitsLE(&this->rawData[8]);
+	return size ? &this->rawData[reservedSize + 16] : nullptr;
+}
+
 const TagList &XSFFile::GetAllTags() const
 {
 	return this->tags;
@@ -53,6 +53,8 @@ public:
 	std::vector<std::uint8_t> GetReservedSection() const;
 	std::vector<std::uint8_t> &GetProgramSection();
 	std::vector<std::uint8_t> GetProgramSection() const;
+	// The program section as stored in the file, still deflated, which is kept even when only the tags were read
+	const std::uint8_t *GetCompressedProgramSection(std::uint32_t &size) const;
 	const TagList &GetAllTags() const;
 	void SetAllTags(const TagList &newTags);
 	void SetTag(const std::string &name, const std::string &value);
@@ -260,12 +260,12 @@ int XSFPlayer::Seek(unsigned seekPosition, volatile int *killswitch, std::vector
 				outMod->Flush(cur);
 			}
 		}
-		this->GenerateSamples(buf, 0, bufsize);
+		this->SkipSamples(buf, bufsize);
 		this->currentSample += bufsize;
 	}
 	if (seekSample - this->currentSample > 0)
 	{
-		this->GenerateSamples(buf, 0, seekSample - this->currentSample);
+		this->SkipSamples(buf, seekSample - this->currentSample);
 		this->currentSample = seekSample;
 	}
 	if (outMod)
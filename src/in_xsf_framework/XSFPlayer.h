@@ -51,6 +51,8 @@ public:
 	virtual bool Load();
 	bool FillBuffer(std::vector<std::uint8_t> &buf, unsigned &samplesWritten);
 	virtual void GenerateSamples(std::vector<std::uint8_t> &buf, unsigned offset, unsigned samples) = 0;
+	// Advances playback by samples that will never be heard, buf being scratch space big enough for them. Players that can skip cheaper than rendering should override this.
+	virtual void SkipSamples(std::vector<std::uint8_t> &buf, unsigned samples) { this->GenerateSamples(buf, 0, samples); }
 	void SeekTop();
 #ifdef WINAMP_PLUGIN
 	int Seek(unsigned seekPosition, volatile int *killswitch, std::vector<std::uint8_t> &buf, Out_Module *outMod);